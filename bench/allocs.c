@@ -0,0 +1,40 @@
+/* Allocation count report: the number of calls to the allocator made by
+ * picol while running a few workloads. Allocations served by the arena
+ * and the free lists of small blocks don't call malloc, so are not counted. */
+#define PICOL_COUNT_MALLOC
+#include "bench.h"
+
+/* Run 'script' and return the number of allocator calls it made. */
+unsigned long long count(struct picolInterp *i, char *script) {
+    unsigned long long start = picolMallocCalls;
+    if (picolEval(i,script) != PICOL_OK) {
+        fprintf(stderr,"Error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    return picolMallocCalls-start;
+}
+
+int main(void) {
+    struct picolInterp *i = picolInitInterp();
+    picolRegisterCoreCommands(i);
+    picolEval(i,"proc fib {x} { if {$x <= 1} { return $x }; "
+                "expr [fib [expr $x-1]] + [fib [expr $x-2]] }");
+    count(i,"fib 20"); /* Warmup: the first call compiles. */
+    unsigned long long n = count(i,"fib 20");
+    printf("fib(20): %llu malloc calls, %.2f per proc call\n",n,n/21891.0);
+
+    n = count(i,"set n 0; while {$n < 10000} { set s \"item $n\"; "
+                "set n [expr $n+1] }");
+    printf("interpolation loop: %llu malloc calls, %.2f per iteration\n",n,n/10000.0);
+
+    /* Scripts never seen before must be parsed and compiled. */
+    char buf[128];
+    n = 0;
+    for (int j = 0; j < 1000; j++) {
+        snprintf(buf,sizeof(buf),"set a%d [expr %d+1]; set b \"x $a%d y\"",j,j,j);
+        n += count(i,buf);
+    }
+    printf("new scripts: %.1f malloc calls per script\n",n/1000.0);
+    picolFreeInterp(i);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* String building benchmark: a string of up to 10MB is built 10 bytes at a
+ * time with [append], and a smaller one with set S "$S$x", that copies the
+ * whole string every time. With [append] the ns per byte must stay the same
+ * as the size grows, showing linear time. */
+#include "bench.h"
+
+/* Return the ns per byte to build the global S of 'bytes' with 'line'. */
+double bench(char *line, int bytes) {
+    struct picolInterp *i = picolInitInterp();
+    char script[256];
+    picolRegisterCoreCommands(i);
+    snprintf(script,sizeof(script),
+        "proc build {} { set S {}; set x 0123456789; set n 0; "
+        "while {$n < %d} { %s; set n [expr {$n+1}] } }",
+        bytes/10,line);
+    picolEval(i,script);
+    double start = now();
+    if (picolEval(i,"build") != PICOL_OK) {
+        fprintf(stderr,"Error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    double elapsed = now()-start;
+    if (picolGetVar(i,"S")->val->len != bytes) {
+        fprintf(stderr,"Error: wrong string length\n");
+        exit(1);
+    }
+    picolFreeInterp(i);
+    return elapsed/bytes;
+}
+
+int main(void) {
+    int sizes[] = {1000000, 2000000, 5000000, 10000000}, j;
+    for (j = 0; j < 4; j++)
+        printf("bytes=%d append_ns_per_byte=%.2f\n",sizes[j],bench("append S $x",sizes[j]));
+    for (j = 0; j < 3; j++)
+        printf("bytes=%d interpolation_ns_per_byte=%.2f\n",sizes[j]/10,
+            bench("set S \"$S$x\"",sizes[j]/10));
+    return 0;
+}
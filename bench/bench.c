@@ -0,0 +1,101 @@
+/* Benchmark suite runner: every script given as argument is sourced, then
+ * the [bench] procedure it defines is called a few times to warm up, and
+ * timed for a number of repetitions. Every script runs in its own process,
+ * so that the peak RSS is its own. One line of results for every script
+ * goes to stdout:
+ *
+ *   bench=proccall reps=10 ns_per_op=... min_ns_per_op=... mallocs_per_op=... peak_rss_kb=...
+ *
+ * Allocations served by the arena and by the free lists of small blocks
+ * don't call malloc, so are not counted, see bench/allocs.c.
+ *
+ * Build and run from the repository root with:
+ *
+ *   make bench
+ *
+ * or:
+ *
+ *   cc -O2 -pthread -o picol_bench bench/bench.c
+ *   ./picol_bench bench/proccall.tcl bench/expr.tcl ...
+ *
+ * Options: -w <warmup runs> (default 2) and -n <repetitions> (default 10). */
+#define PICOL_COUNT_MALLOC
+#include "bench.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Return the name of the script without directory and extension. */
+void benchName(char *path, char *buf, size_t len) {
+    char *p = strrchr(path,'/');
+    p = p ? p+1 : path;
+    snprintf(buf,len,"%s",p);
+    if ((p = strrchr(buf,'.')) != NULL) *p = '\0';
+}
+
+void call(struct picolInterp *i, char *name) {
+    if (picolEval(i,"bench") != PICOL_OK) {
+        fprintf(stderr,"%s: %s\n",name,picolGetResult(i));
+        exit(1);
+    }
+}
+
+/* Run the benchmark in the current process, and print its results. */
+void run(char *path, int warmup, int reps) {
+    struct picolInterp *i = picolInitInterp();
+    char name[256];
+    struct rusage ru;
+
+    benchName(path,name,sizeof(name));
+    picolRegisterCoreCommands(i);
+    picolSetVar(i,"BenchScript",path);
+    if (picolEval(i,"source $BenchScript") != PICOL_OK) {
+        fprintf(stderr,"%s: %s\n",name,picolGetResult(i));
+        exit(1);
+    }
+    for (int j = 0; j < warmup; j++) call(i,name);
+
+    double total = 0, min = 0;
+    unsigned long long mallocs = picolMallocCalls;
+    for (int j = 0; j < reps; j++) {
+        double start = now();
+        call(i,name);
+        double elapsed = now()-start;
+        total += elapsed;
+        if (j == 0 || elapsed < min) min = elapsed;
+    }
+    mallocs = picolMallocCalls-mallocs;
+    getrusage(RUSAGE_SELF,&ru);
+    printf("bench=%s reps=%d ns_per_op=%.0f min_ns_per_op=%.0f mallocs_per_op=%.1f peak_rss_kb=%ld\n",
+        name,reps,total/reps,min,(double)mallocs/reps,ru.ru_maxrss);
+    fflush(stdout);
+    picolFreeInterp(i);
+}
+
+int main(int argc, char **argv) {
+    int warmup = 2, reps = 10, failed = 0, j;
+
+    for (j = 1; j < argc-1 && argv[j][0] == '-'; j += 2) {
+        if (strcmp(argv[j],"-w") == 0) warmup = atoi(argv[j+1]);
+        else if (strcmp(argv[j],"-n") == 0) reps = atoi(argv[j+1]);
+        else break;
+    }
+    if (j == argc || reps < 1) {
+        fprintf(stderr,"Usage: %s [-w warmup] [-n reps] script.tcl ...\n",argv[0]);
+        return 1;
+    }
+    for (; j < argc; j++) {
+        pid_t pid = fork();
+        int status;
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run(argv[j],warmup,reps);
+            exit(0);
+        }
+        waitpid(pid,&status,0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    return failed ? 1 : 0;
+}
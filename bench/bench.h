@@ -0,0 +1,23 @@
+/* Common part of the benchmark programs of this directory. They are built
+ * into bench/bin by make bench, or make bench-programs, and run from the
+ * repository root, like:
+ *
+ *   ./bench/bin/proccall
+ *
+ * Programs counting allocator calls define PICOL_COUNT_MALLOC before
+ * including this file. */
+#ifndef PICOL_BENCH_H
+#define PICOL_BENCH_H
+
+#define PICOL_NO_MAIN
+#include "../picol.c"
+#include <time.h>
+
+/* Monotonic time in nanoseconds. */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/* Dict benchmark: 1 million keys are inserted with [dict set] and then
+ * looked up with [dict get]. The latency of every single insertion is
+ * measured too, calling picolDictSet() directly: since the hash table is
+ * rehashed incrementally, the slowest ones should stay in the microseconds
+ * even when the table holding a million keys grows. The maximum is usually
+ * dominated by the scheduler and page faults, the 99.99th percentile tells
+ * more. */
+#include "bench.h"
+
+#define KEYS 1000000
+
+int cmpdouble(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y)-(x < y);
+}
+
+/* Run 'script' and return the elapsed ns divided by 'ops'. */
+double bench(struct picolInterp *i, char *script, int ops) {
+    double start = now();
+    if (picolEval(i,script) != PICOL_OK) {
+        fprintf(stderr,"Error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    return (now()-start)/ops;
+}
+
+int main(void) {
+    struct picolInterp *i = picolInitInterp();
+    char buf[256];
+    int j;
+    picolRegisterCoreCommands(i);
+
+    /* From scripts, minus the cost of the loop itself. */
+    double loop = bench(i,"set j 0; while {$j < 1000000} { set k k$j; set j [expr {$j+1}] }",KEYS);
+    double set = bench(i,"set d {}; set j 0; while {$j < 1000000} "
+                         "{ dict set d k$j $j; set j [expr {$j+1}] }",KEYS)-loop;
+    snprintf(buf,sizeof(buf),"set r 1; set j 0; while {$j < 1000000} "
+                             "{ set r [expr {($r*1103515245+12345)%%2147483648}]; "
+                             "dict get $d k[expr {$r%%%d}]; set j [expr {$j+1}] }",KEYS);
+    double get = bench(i,buf,KEYS);
+    get -= bench(i,"set r 1; set j 0; while {$j < 1000000} "
+                   "{ set r [expr {($r*1103515245+12345)%2147483648}]; "
+                   "set k k[expr {$r%1000000}]; set j [expr {$j+1}] }",KEYS);
+    printf("keys=%d dict_set_ns=%.1f dict_get_ns=%.1f\n",KEYS,set,get);
+
+    /* Worst case latency of a single insertion. */
+    struct picolObj **keys = xmalloc(sizeof(struct picolObj*)*KEYS);
+    for (j = 0; j < KEYS; j++) {
+        int len = snprintf(buf,sizeof(buf),"key%d",j);
+        keys[j] = picolNewStringObj(buf,len);
+    }
+    struct picolDict *d = picolNewDict();
+    double *lat = xmalloc(sizeof(double)*KEYS), total = 0;
+    for (j = 0; j < KEYS; j++) {
+        double start = now();
+        picolDictSet(d,keys[j],i->emptyobj);
+        lat[j] = now()-start;
+        total += lat[j];
+    }
+    qsort(lat,KEYS,sizeof(double),cmpdouble);
+    printf("keys=%d insert_avg_ns=%.1f insert_p9999_ns=%.0f insert_max_ns=%.0f\n",
+        KEYS,total/KEYS,lat[KEYS-KEYS/10000],lat[KEYS-1]);
+    free(lat);
+    picolFreeDict(d);
+    free(keys);
+    picolFreeInterp(i);
+    return 0;
+}
@@ -0,0 +1,47 @@
+/* Command dispatch microbenchmark: the cost of calling a command while 0,
+ * 1000 and 10000 procedures are registered. Calls with a literal command
+ * name use the call site cache, calls like $cmd need a table lookup. */
+#include "bench.h"
+
+#define CALLS_PER_SCRIPT 1000
+#define RUNS 1000
+
+int picolCommandNop(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    return PICOL_OK;
+}
+
+/* Return the ns per call of 'line', repeated CALLS_PER_SCRIPT times. */
+double bench(struct picolInterp *i, char *line) {
+    int len = strlen(line), j;
+    char *script = xmalloc(len*CALLS_PER_SCRIPT+1);
+    for (j = 0; j < CALLS_PER_SCRIPT; j++) memcpy(script+j*len,line,len);
+    script[len*CALLS_PER_SCRIPT] = '\0';
+    picolEval(i,script); /* Warmup: compile and fill call site caches. */
+    double start = now();
+    for (j = 0; j < RUNS; j++) picolEval(i,script);
+    double elapsed = now()-start;
+    free(script);
+    return elapsed/((double)RUNS*CALLS_PER_SCRIPT);
+}
+
+int main(void) {
+    int counts[] = {0, 1000, 10000}, j, k;
+    for (j = 0; j < 3; j++) {
+        struct picolInterp *i = picolInitInterp();
+        char buf[64];
+        picolRegisterCoreCommands(i);
+        picolRegisterCommand(i,"nop",picolCommandNop);
+        double start = now();
+        for (k = 0; k < counts[j]; k++) {
+            snprintf(buf,sizeof(buf),"proc p%d {} {}",k);
+            picolEval(i,buf);
+        }
+        double regtime = now()-start;
+        picolEval(i,"set c nop");
+        printf("procs=%d register_ns=%.0f literal_call_ns=%.1f dynamic_call_ns=%.1f\n",
+            counts[j], counts[j] ? regtime/counts[j] : 0,
+            bench(i,"nop\n"), bench(i,"$c\n"));
+        picolFreeInterp(i);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* Event loop benchmark: an echo server written in Picol, with [socket
+ * -server], [fileevent] and [vwait], runs in a child process, while the
+ * parent opens 10000 concurrent connections, or the first argument, and
+ * on every one sends a line and waits for it to come back, 10 times, or
+ * the second argument. The parent keeps at most 1000 connections waiting
+ * for their first reply, not to overflow the listen queue. Results go to
+ * stderr. */
+#include "bench.h"
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+char *server =
+    "proc accept {s addr port} {\n"
+    "    fconfigure $s -blocking 0 -buffering line\n"
+    "    fileevent $s readable [list echo $s]\n"
+    "}\n"
+    "proc echo {s} {\n"
+    "    if {[gets $s line] < 0} {\n"
+    "        if {[eof $s]} {close $s}\n"
+    "        return\n"
+    "    }\n"
+    "    puts $s $line\n"
+    "}\n"
+    "set srv [socket -server accept -myaddr 127.0.0.1 0]\n"
+    "puts [lindex [fconfigure $srv -sockname] 2]\n"
+    "flush stdout\n"
+    "vwait Forever\n";
+
+struct client {
+    int fd;
+    int rounds;         // Replies still to receive.
+    int got;            // Bytes of the current reply received.
+};
+
+#define LINE "0123456789abcdefghijklmnopqrstu\n" // 32 bytes.
+
+void fail(char *what) {
+    perror(what);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int numconns = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    int pipefd[2], port, opened = 0, connecting = 0, done = 0;
+    struct rlimit rl;
+    char buf[64];
+
+    /* Both processes need a file descriptor for every connection. */
+    getrlimit(RLIMIT_NOFILE,&rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&rl);
+    if ((rlim_t)numconns+64 > rl.rlim_cur) {
+        fprintf(stderr,"Too many connections for the file descriptors limit %ld\n",
+            (long)rl.rlim_cur);
+        return 1;
+    }
+
+    if (pipe(pipefd) == -1) fail("pipe");
+    pid_t pid = fork();
+    if (pid == -1) fail("fork");
+    if (pid == 0) {
+        struct picolInterp *i = picolInitInterp();
+        dup2(pipefd[1],1);
+        picolRegisterCoreCommands(i);
+        picolEval(i,server);
+        fprintf(stderr,"Server error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    close(pipefd[1]);
+    FILE *fp = fdopen(pipefd[0],"r");
+    if (fgets(buf,sizeof(buf),fp) == NULL || (port = atoi(buf)) == 0) {
+        fprintf(stderr,"The server didn't start\n");
+        return 1;
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct client *clients = calloc(numconns,sizeof(*clients));
+    struct epoll_event ev[256];
+    int epfd = epoll_create1(0);
+    double start = now(), connected = 0;
+
+    while(done < numconns) {
+        while(opened < numconns && connecting < 1000) {
+            struct client *c = clients+opened;
+            c->fd = socket(AF_INET,SOCK_STREAM,0);
+            if (c->fd == -1 || connect(c->fd,(struct sockaddr*)&sa,sizeof(sa)) == -1)
+                fail("connect");
+            fcntl(c->fd,F_SETFL,O_NONBLOCK);
+            struct epoll_event e = {.events = EPOLLIN, .data.u32 = opened};
+            epoll_ctl(epfd,EPOLL_CTL_ADD,c->fd,&e);
+            c->rounds = rounds;
+            if (write(c->fd,LINE,32) != 32) fail("write");
+            opened++;
+            connecting++;
+        }
+        int n = epoll_wait(epfd,ev,256,-1);
+        for (int j = 0; j < n; j++) {
+            struct client *c = clients+ev[j].data.u32;
+            ssize_t r = read(c->fd,buf,sizeof(buf));
+            if (r <= 0) {
+                if (r == -1 && errno == EAGAIN) continue;
+                fprintf(stderr,"Connection closed by the server\n");
+                return 1;
+            }
+            c->got += r;
+            if (c->got < 32) continue;
+            c->got = 0;
+            if (c->rounds-- == rounds) {
+                if (--connecting == 0 && opened == numconns) connected = now();
+            }
+            if (c->rounds) {
+                if (write(c->fd,LINE,32) != 32) fail("write");
+            } else {
+                done++;
+            }
+        }
+    }
+    double elapsed = now()-start;
+    for (int j = 0; j < numconns; j++) close(clients[j].fd);
+    kill(pid,SIGKILL);
+    waitpid(pid,NULL,0);
+    fprintf(stderr,"conns=%d rounds=%d connect_ms=%.0f ms=%.0f msgs_per_sec=%.0f\n",
+        numconns,rounds,(connected-start)/1e6,elapsed/1e6,
+        (double)numconns*rounds/(elapsed/1e9));
+    return 0;
+}
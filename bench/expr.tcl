@@ -0,0 +1,13 @@
+# Expressions: integer and float math in a loop, braced and unbraced.
+proc bench {} {
+    set sum 0
+    set f 0.5
+    set n 0
+    while {$n < 20000} {
+        set sum [expr {($sum+$n*3-$n/2) % 1000003}]
+        set f [expr {$f*0.999+($n > 100 ? 0.25 : 0.5)}]
+        set sum [expr $sum + 1]
+        set n [expr {$n+1}]
+    }
+    list $sum $f
+}
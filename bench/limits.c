@@ -0,0 +1,57 @@
+/* Execution limits benchmark: fib 25 with the fib procedure of fib.tcl,
+ * without limits, and with a budget of checkpoints and a deadline that are
+ * never reached, reporting the best of 10 runs. To measure the cost of the
+ * checkpoints themselves, compare with the same benchmark built with the
+ * checkpoints compiled out. Results go to stderr.
+ *
+ * The version without checkpoints is built with:
+ *
+ *   cc -O2 -pthread -DPICOL_NO_LIMITS -o bench/bin/limits_off bench/limits.c
+ */
+#include "bench.h"
+
+char *setup =
+    "proc fib {x} {\n"
+    "    if {$x <= 1} { return $x }\n"
+    "    expr [fib [expr $x-1]] + [fib [expr $x-2]]\n"
+    "}\n";
+
+double run(struct picolInterp *i) {
+    double min = 0;
+    for (int j = 0; j < 10; j++) {
+        double start = now();
+        if (picolEval(i,"fib 25") != PICOL_OK) {
+            fprintf(stderr,"Error: %s\n",picolGetResult(i));
+            exit(1);
+        }
+        double elapsed = now()-start;
+        if (j == 0 || elapsed < min) min = elapsed;
+    }
+    return min;
+}
+
+int main(void) {
+    struct picolInterp *i = picolInitInterp();
+#ifdef PICOL_NO_LIMITS
+    char *checkpoints = "off";
+#else
+    char *checkpoints = "on";
+#endif
+
+    picolRegisterCoreCommands(i);
+    if (picolEval(i,setup) != PICOL_OK) exit(1);
+    run(i); // Warmup.
+    double base = run(i);
+    fprintf(stderr,"checkpoints=%s limits=none ms=%.2f\n",checkpoints,base/1e6);
+
+    long long budget = 1000000000000LL;
+    picolSetBudget(i,budget);
+    picolSetTimeLimit(i,3600*1000);
+    double limited = run(i);
+    fprintf(stderr,"checkpoints=%s limits=budget+deadline ms=%.2f overhead=%.2f%% "
+                   "checkpoints_per_run=%lld\n",
+        checkpoints,limited/1e6,(limited-base)*100/base,
+        (budget-picolGetBudget(i))/10);
+    picolFreeInterp(i);
+    return 0;
+}
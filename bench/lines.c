@@ -0,0 +1,60 @@
+/* File reading benchmark: counting the lines of a generated log file of
+ * 1GB with a [gets] loop, compared with wc -l, and reading the whole file
+ * with [read], that maps it in memory. The file size in MB can be given
+ * as argument. Results go to stderr. */
+#include "bench.h"
+
+#define LOGFILE "/tmp/picol_lines_bench.log"
+
+void generate(long size) {
+    FILE *fp = fopen(LOGFILE,"w");
+    long written = 0;
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    for (long j = 0; written < size; j++)
+        written += fprintf(fp,"2026-10-16 12:%02ld:%02ld host%ld GET /index.html 200 %ld\n",
+                           (j/60)%60,j%60,j%16,j*7%100000);
+    fclose(fp);
+}
+
+void report(char *mode, double elapsed, long size, char *result) {
+    fprintf(stderr,"mode=%s ms=%.0f MB_per_sec=%.0f result=%s\n",mode,
+        elapsed/1e6,size/(elapsed/1e3),result);
+}
+
+int main(int argc, char **argv) {
+    long size = (argc > 1 ? atol(argv[1]) : 1024)*1024*1024;
+    struct picolInterp *i = picolInitInterp();
+    double start;
+    char wc[64] = "";
+
+    picolRegisterCoreCommands(i);
+    generate(size);
+
+    /* Warm the page cache, so all the modes read from memory. */
+    if (system("cat " LOGFILE " > /dev/null") != 0) exit(1);
+
+    start = now();
+    FILE *p = popen("wc -l < " LOGFILE,"r");
+    if (p == NULL || fgets(wc,sizeof(wc),p) == NULL) exit(1);
+    pclose(p);
+    wc[strcspn(wc,"\n")] = '\0';
+    report("wc",now()-start,size,wc);
+
+    start = now();
+    if (picolEval(i,"set f [open " LOGFILE "]; set n 0\n"
+                    "while {[gets $f line] >= 0} {set n [expr {$n+1}]}\n"
+                    "close $f; set n") != PICOL_OK) exit(1);
+    report("gets",now()-start,size,picolGetResult(i));
+
+    start = now();
+    if (picolEval(i,"set f [open " LOGFILE "]; set data [read $f]; close $f") != PICOL_OK)
+        exit(1);
+    report("read",now()-start,size,"-");
+
+    picolFreeInterp(i);
+    unlink(LOGFILE);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* List benchmark: a list of 1 million elements is built with [lappend],
+ * then accessed at random indexes with [lindex]. Both must take constant
+ * time per operation, whatever the list size. */
+#include "bench.h"
+
+/* Run 'script' and return the elapsed ns divided by 'ops'. */
+double bench(struct picolInterp *i, char *script, int ops) {
+    double start = now();
+    if (picolEval(i,script) != PICOL_OK) {
+        fprintf(stderr,"Error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    return (now()-start)/ops;
+}
+
+int main(void) {
+    int sizes[] = {10000, 100000, 1000000}, j;
+    char buf[128];
+    for (j = 0; j < 3; j++) {
+        struct picolInterp *i = picolInitInterp();
+        picolRegisterCoreCommands(i);
+        /* The loops alone, to subtract their cost. */
+        picolEval(i,"proc build {n} { set l {}; set j 0; while {$j < $n} "
+                    "{ lappend l $j; set j [expr {$j+1}] }; return $l }");
+        picolEval(i,"proc access {l n} { set r 1; set j 0; while {$j < $n} "
+                    "{ set r [expr {($r*1103515245+12345)%2147483648}]; "
+                    "lindex $l [expr {$r%[llength $l]}]; set j [expr {$j+1}] } }");
+        picolEval(i,"proc empty {n} { set r 1; set j 0; while {$j < $n} "
+                    "{ set r [expr {($r*1103515245+12345)%2147483648}]; "
+                    "expr {$r%1}; set j [expr {$j+1}] } }");
+        snprintf(buf,sizeof(buf),"set L [build %d]",sizes[j]);
+        double append = bench(i,buf,sizes[j]);
+        double access = bench(i,"access $L 1000000",1000000)-
+                        bench(i,"empty 1000000",1000000);
+        printf("elements=%d lappend_ns=%.1f lindex_ns=%.1f\n",sizes[j],append,access);
+        picolFreeInterp(i);
+    }
+    return 0;
+}
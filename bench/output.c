@@ -0,0 +1,52 @@
+/* Output benchmark: 10 million small [puts] calls, with every buffering
+ * mode of stdout, that is redirected to /dev/null, and with an output
+ * handler. "printf" is the previous implementation, a printf() call for
+ * every [puts], for comparison. Results go to stderr. */
+#include "bench.h"
+
+#define CALLS 10000000
+
+int picolCommandPrintfPuts(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    printf("%s\n",argv[1]);
+    return PICOL_OK;
+}
+
+void discard(void *privdata, const char *buf, int len) {
+    (*(long long*)privdata)++;
+}
+
+/* Call 'cmd' CALLS times with the argument "hello world", and report the
+ * throughput. */
+void bench(struct picolInterp *i, char *cmd, char *mode) {
+    struct picolObj *objv[2] = {picolNewStringObj(cmd,-1), picolNewStringObj("hello world",-1)};
+    struct picolCmd *c = picolGetCommand(i,cmd);
+    double start = now();
+    for (int j = 0; j < CALLS; j++) picolCallCommand(i,c,2,objv);
+    picolFlushChannel(&i->out);
+    fflush(stdout);
+    double elapsed = now()-start;
+    fprintf(stderr,"mode=%s ns_per_puts=%.1f MB_per_sec=%.1f\n",mode,
+        elapsed/CALLS,(double)CALLS*12/elapsed*1e3);
+    picolDecrRefCount(objv[0]);
+    picolDecrRefCount(objv[1]);
+}
+
+int main(void) {
+    struct picolInterp *i = picolInitInterp();
+    long long calls = 0;
+    if (freopen("/dev/null","w",stdout) == NULL) exit(1);
+    picolRegisterCoreCommands(i);
+    picolRegisterCommand(i,"printfputs",picolCommandPrintfPuts);
+    bench(i,"printfputs","printf");
+    picolEval(i,"fconfigure stdout -buffering none");
+    bench(i,"puts","none");
+    picolEval(i,"fconfigure stdout -buffering line");
+    bench(i,"puts","line");
+    picolEval(i,"fconfigure stdout -buffering full");
+    bench(i,"puts","full");
+    picolSetOutputHandler(i,discard,&calls);
+    bench(i,"puts","handler");
+    fprintf(stderr,"handler_calls=%lld\n",calls);
+    picolFreeInterp(i);
+    return 0;
+}
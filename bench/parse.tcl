@@ -0,0 +1,14 @@
+# Large script parse: a generated script of 20000 different commands is
+# loaded, parsed, compiled and run by [source] at every iteration.
+set Script /tmp/picol_bench_parse.tcl
+set f [open $Script w]
+puts $f "proc add {a b} {expr {\$a+\$b}}"
+puts $f "set sum 0"
+set n 0
+while {$n < 20000} {
+    puts $f "set sum \[add \$sum $n\] ;# line $n, \"padding\" {text}"
+    set n [expr {$n+1}]
+}
+close $f
+
+proc bench {} {source $Script}
@@ -0,0 +1,66 @@
+/* Parallel map benchmark: the mandel procedure of mandelbrot.tcl computed
+ * for every pixel of a 300x120 image, in a serial loop, and with [pmap]
+ * on 1 to N worker threads. N is the number of online CPUs, or the first
+ * argument. Results go to stderr. */
+#include "bench.h"
+
+char *setup =
+    "proc mandel {cr ci maxiter} {\n"
+    "    set zr 0; set zi 0; set n 0\n"
+    "    while {$n < $maxiter} {\n"
+    "        set zr2 [expr {$zr*$zr}]\n"
+    "        set zi2 [expr {$zi*$zi}]\n"
+    "        if {$zr2+$zi2 > 4} {return $n}\n"
+    "        set zi [expr {2*$zr*$zi+$ci}]\n"
+    "        set zr [expr {$zr2-$zi2+$cr}]\n"
+    "        set n [expr {$n+1}]\n"
+    "    }\n"
+    "    return $maxiter\n"
+    "}\n"
+    "proc pixel {p} {mandel [lindex $p 0] [lindex $p 1] 100}\n"
+    "set pixels {}\n"
+    "set y 0\n"
+    "while {$y < 120} {\n"
+    "    set x 0\n"
+    "    while {$x < 300} {\n"
+    "        lappend pixels \"[expr {-2.0+$x*0.01}] [expr {-1.2+$y*0.02}]\"\n"
+    "        set x [expr {$x+1}]\n"
+    "    }\n"
+    "    set y [expr {$y+1}]\n"
+    "}\n";
+
+/* Sum of the iterations, to check that all the modes agree. */
+char *sum = "set sum 0; foreach n $r {set sum [expr {$sum+$n}]}; set sum";
+
+void run(struct picolInterp *i, char *mode, char *script, double *base) {
+    char sumbuf[64];
+    double start = now();
+    if (picolEval(i,script) != PICOL_OK) {
+        fprintf(stderr,"Error: %s\n",picolGetResult(i));
+        exit(1);
+    }
+    double elapsed = now()-start;
+    if (*base == 0) *base = elapsed;
+    picolEval(i,sum);
+    snprintf(sumbuf,sizeof(sumbuf),"%s",picolGetResult(i));
+    fprintf(stderr,"mode=%s ms=%.0f speedup=%.2f sum=%s\n",
+        mode,elapsed/1e6,*base/elapsed,sumbuf);
+}
+
+int main(int argc, char **argv) {
+    int maxthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    struct picolInterp *i = picolInitInterp();
+    double base = 0;
+    char mode[32], script[64];
+
+    picolRegisterCoreCommands(i);
+    if (picolEval(i,setup) != PICOL_OK) exit(1);
+    run(i,"serial","set r {}; foreach p $pixels {lappend r [pixel $p]}",&base);
+    for (int n = 1; n <= maxthreads; n++) {
+        snprintf(mode,sizeof(mode),"pmap-%d",n);
+        snprintf(script,sizeof(script),"set r [pmap pixel $pixels -threads %d]",n);
+        run(i,mode,script,&base);
+    }
+    picolFreeInterp(i);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/* Procedure call microbenchmark: 10 million calls of a procedure with three
+ * arguments, with an empty body and with a body using the arguments. */
+#include "bench.h"
+
+#define CALLS_PER_SCRIPT 1000
+#define RUNS 10000
+
+/* Return the ns per call of 'line', repeated CALLS_PER_SCRIPT times. */
+double bench(struct picolInterp *i, char *line) {
+    int len = strlen(line), j;
+    char *script = xmalloc(len*CALLS_PER_SCRIPT+1);
+    for (j = 0; j < CALLS_PER_SCRIPT; j++) memcpy(script+j*len,line,len);
+    script[len*CALLS_PER_SCRIPT] = '\0';
+    picolEval(i,script); /* Warmup: compile and fill call site caches. */
+    double start = now();
+    for (j = 0; j < RUNS; j++) picolEval(i,script);
+    double elapsed = now()-start;
+    free(script);
+    return elapsed/((double)RUNS*CALLS_PER_SCRIPT);
+}
+
+int main(void) {
+    struct picolInterp *i = picolInitInterp();
+    picolRegisterCoreCommands(i);
+    picolEval(i,"proc empty3 {a b c} {}");
+    picolEval(i,"proc add3 {a b c} { expr {$a+$b+$c} }");
+    printf("calls=%d empty_ns=%.1f add_ns=%.1f\n",CALLS_PER_SCRIPT*RUNS,
+        bench(i,"empty3 1 2 3\n"), bench(i,"add3 1 2 3\n"));
+    picolFreeInterp(i);
+    return 0;
+}
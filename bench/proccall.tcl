@@ -0,0 +1,7 @@
+# Procedure calls: the naive recursive fib of fib.tcl, 21891 calls.
+proc fib {x} {
+    if {$x <= 1} {return $x}
+    expr {[fib [expr {$x-1}]]+[fib [expr {$x-2}]]}
+}
+
+proc bench {} {fib 20}
@@ -0,0 +1,7 @@
+# Deep recursion: a non tail recursive procedure 50000 calls deep.
+proc depth {n} {
+    if {$n == 0} {return 0}
+    expr {[depth [expr {$n-1}]]+1}
+}
+
+proc bench {} {depth 50000}
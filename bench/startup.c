@@ -0,0 +1,84 @@
+/* Startup benchmark: a generated script of 50MB, loaded and evaluated with
+ * picolLoadSource() and picolEvalSource(), like [source] and the picol
+ * command line do, compared with reading the whole file into a buffer and
+ * calling picolEval(), that compiles it all before running it. The first
+ * command of the script records the time it starts executing. Results go
+ * to stderr. */
+#include "bench.h"
+
+#define SCRIPT "/tmp/picol_startup_bench.tcl"
+#define SCRIPT_SIZE (50*1024*1024)
+
+double started;
+
+int picolCommandMark(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    started = now();
+    return PICOL_OK;
+}
+
+/* A procedure, then many short commands calling it, like generated code. */
+void generate(void) {
+    FILE *fp = fopen(SCRIPT,"w");
+    long size = 0;
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    size += fprintf(fp,"mark\nproc add {a b} {expr {$a+$b}}\nset sum 0\n");
+    for (long j = 0; size < SCRIPT_SIZE; j++)
+        size += fprintf(fp,"set sum [add $sum %ld] ;# line %ld\n",j%100,j);
+    fclose(fp);
+}
+
+struct picolInterp *newInterp(void) {
+    struct picolInterp *i = picolInitInterp();
+    picolRegisterCoreCommands(i);
+    picolRegisterCommand(i,"mark",picolCommandMark);
+    return i;
+}
+
+void report(char *mode, double start, double loaded, double end, struct picolInterp *i) {
+    fprintf(stderr,"mode=%s load_ms=%.1f first_command_ms=%.1f total_ms=%.1f sum=%s\n",
+        mode,(loaded-start)/1e6,(started-start)/1e6,(end-start)/1e6,
+        picolGetString(picolGetVar(i,"sum")->val));
+}
+
+int main(void) {
+    struct picolInterp *i;
+    struct picolSource s;
+    double start, loaded, end;
+
+    generate();
+
+    /* Read into a buffer, compile everything, run. */
+    i = newInterp();
+    start = now();
+    FILE *fp = fopen(SCRIPT,"r");
+    fseek(fp,0,SEEK_END);
+    long len = ftell(fp);
+    rewind(fp);
+    char *buf = xmalloc(len+1);
+    if (fread(buf,1,len,fp) != (size_t)len) exit(1);
+    buf[len] = '\0';
+    fclose(fp);
+    loaded = now();
+    if (picolEval(i,buf) != PICOL_OK) exit(1);
+    end = now();
+    report("read+eval",start,loaded,end,i);
+    free(buf);
+    picolFreeInterp(i);
+
+    /* Map the file, compile and run in batches. */
+    i = newInterp();
+    start = now();
+    if (picolLoadSource(&s,SCRIPT) != PICOL_OK) exit(1);
+    loaded = now();
+    if (picolEvalSource(i,s.text,s.len) != PICOL_OK) exit(1);
+    end = now();
+    report("mmap+source",start,loaded,end,i);
+    picolFreeSource(&s);
+    picolFreeInterp(i);
+
+    unlink(SCRIPT);
+    return 0;
+}
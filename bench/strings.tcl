@@ -0,0 +1,13 @@
+# String building: interpolation, append, and lists of strings.
+proc bench {} {
+    set s ""
+    set l {}
+    set n 0
+    while {$n < 10000} {
+        set item "item-$n:[expr {$n*2}]"
+        append s $item ","
+        lappend l "<$item>"
+        set n [expr {$n+1}]
+    }
+    list [llength $l] [llength [lsort $l]]
+}
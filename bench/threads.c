@@ -0,0 +1,52 @@
+/* Thread scaling benchmark: 64 jobs, each computing fib 20 like fib.tcl,
+ * sent as messages to a pool of 1 to N worker threads, that send back the
+ * results. N is the number of online CPUs, or the first argument. Results
+ * go to stderr. */
+#include "bench.h"
+
+char *script =
+    "set workers {}\n"
+    "set n 0\n"
+    "while {$n < $Threads} {\n"
+    "    lappend workers [thread::create {\n"
+    "        proc fib {x} {if {$x <= 1} {return 1}; expr {[fib [expr {$x-1}]]+[fib [expr {$x-2}]]}}\n"
+    "        set parent [thread::recv]\n"
+    "        while {1} {\n"
+    "            set job [thread::recv]\n"
+    "            if {[llength $job] == 0} break\n"
+    "            thread::send $parent [fib $job]\n"
+    "        }\n"
+    "    }]\n"
+    "    thread::send [lindex $workers end] [thread::id]\n"
+    "    set n [expr {$n+1}]\n"
+    "}\n"
+    "set n 0\n"
+    "while {$n < 64} {thread::send [lindex $workers [expr {$n%$Threads}]] 20; set n [expr {$n+1}]}\n"
+    "set sum 0\n"
+    "set n 0\n"
+    "while {$n < 64} {set sum [expr {$sum+[thread::recv]}]; set n [expr {$n+1}]}\n"
+    "foreach w $workers {thread::send $w {}; thread::wait $w}\n"
+    "set sum\n";
+
+int main(int argc, char **argv) {
+    int maxthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    double base = 0;
+    for (int n = 1; n <= maxthreads; n++) {
+        struct picolInterp *i = picolInitInterp();
+        char buf[32];
+        picolRegisterCoreCommands(i);
+        snprintf(buf,sizeof(buf),"%d",n);
+        picolSetVar(i,"Threads",buf);
+        double start = now();
+        if (picolEval(i,script) != PICOL_OK) {
+            fprintf(stderr,"Error: %s\n",picolGetResult(i));
+            exit(1);
+        }
+        double elapsed = now()-start;
+        if (n == 1) base = elapsed;
+        fprintf(stderr,"threads=%d ms=%.0f speedup=%.2f sum=%s\n",
+            n,elapsed/1e6,base/elapsed,picolGetResult(i));
+        picolFreeInterp(i);
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+# Variables: many locals, a global, and variables created by name.
+set Total 0
+
+proc bench {} {
+    set a 1; set b 2; set c 3; set d 4
+    set v1 0; set v2 0; set v3 0; set v4 0
+    set n 0
+    while {$n < 10000} {
+        set e $a; set a $b; set b $c; set c $d; set d $e
+        set v$d $n
+        set Total [expr {$Total+[set v$a]}]
+        set n [expr {$n+1}]
+    }
+    set Total
+}
@@ -31,22 +31,201 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* =============================================================================
  * Memory allocation wrappers that abort on out of memory
  * ========================================================================== */
 
+#ifdef PICOL_COUNT_MALLOC
+_Thread_local unsigned long long picolMallocCalls = 0; /* See bench/allocs.c */
+#endif
+
+/* Memory accounting, compiled in with -DPICOL_MEM_STATS. Every block gets a
+ * header with its size, its category, and the counters of the interpreter
+ * that owns it: the one running in this thread when the block was
+ * allocated (see picolExecCode()), or else the last one created or run by
+ * the thread, so that [memstats] and picolMemStats()
+ * report the memory used by every interpreter: blocks, live bytes, peak,
+ * and live bytes by category. Blocks may be freed by other threads, like
+ * the messages of [thread::send], so counters are atomic. The counters of
+ * an interpreter are freed with its last block. Without the macro the
+ * header is not there, and picolMemTag() does nothing. */
+enum {PICOL_MEM_OTHER, PICOL_MEM_VALUES, PICOL_MEM_VARS, PICOL_MEM_FRAMES,
+      PICOL_MEM_COMMANDS, PICOL_MEM_ARENA, PICOL_MEM_CHANNELS,
+      PICOL_MEM_FREELISTS, PICOL_MEM_CATEGORIES};
+
+/* Names of the categories, as reported by [memstats]. Values are objects
+ * and their strings, lists and dicts, the arena holds parse trees and
+ * argument vectors, commands include the compiled code. */
+const char *picolMemCategoryNames[PICOL_MEM_CATEGORIES] = {
+    "other", "values", "variables", "frames", "commands", "arena",
+    "channels", "freelists"
+};
+
+/* Counters returned by picolMemStats(). */
+struct picolMemStats {
+    unsigned long long allocs, frees;   // Blocks allocated and freed.
+    size_t live, peak;                  // Bytes.
+    size_t category[PICOL_MEM_CATEGORIES];
+};
+
+#ifdef PICOL_MEM_STATS
+struct picolMemCounters {
+    atomic_ullong allocs, frees;
+    atomic_size_t live, peak;
+    atomic_size_t category[PICOL_MEM_CATEGORIES];
+    atomic_long refs;   // Live blocks, plus one while the interpreter lives.
+};
+
+union picolMemHeader {
+    struct {
+        struct picolMemCounters *owner;
+        size_t size;
+        int category;
+    } h;
+    max_align_t align;  // Blocks stay aligned like the ones of malloc().
+};
+
+/* Allocations outside of any interpreter, never freed. */
+struct picolMemCounters picolMemGlobal = {.refs = 1};
+_Thread_local struct picolMemCounters *picolMemCurrent = NULL;
+
+struct picolMemCounters *picolMemOwner(void) {
+    return picolMemCurrent ? picolMemCurrent : &picolMemGlobal;
+}
+
+void picolMemCharge(struct picolMemCounters *m, int category, size_t size, int sign) {
+    if (sign > 0) {
+        size_t live = atomic_fetch_add(&m->live,size)+size;
+        size_t peak = atomic_load(&m->peak);
+        while(live > peak && !atomic_compare_exchange_weak(&m->peak,&peak,live));
+        atomic_fetch_add(&m->category[category],size);
+    } else {
+        atomic_fetch_sub(&m->live,size);
+        atomic_fetch_sub(&m->category[category],size);
+    }
+}
+
+void picolMemRelease(struct picolMemCounters *m) {
+    if (atomic_fetch_sub(&m->refs,1) == 1) free(m);
+}
+
+/* Set the category of a block allocated by xmalloc(), charging it to the
+ * interpreter running in this thread if it was allocated by another one,
+ * like blocks reused from the free lists. */
+void picolMemTag(void *ptr, int category) {
+    union picolMemHeader *h = (union picolMemHeader*)ptr-1;
+    struct picolMemCounters *owner = picolMemOwner();
+    if (h->h.owner == owner && h->h.category == category) return;
+    picolMemCharge(h->h.owner,h->h.category,h->h.size,-1);
+    if (h->h.owner != owner) {
+        atomic_fetch_add(&owner->refs,1);
+        picolMemRelease(h->h.owner);
+        h->h.owner = owner;
+    }
+    h->h.category = category;
+    picolMemCharge(owner,category,h->h.size,1);
+}
+#else
+#define picolMemTag(ptr,category) ((void)0)
+#endif
+
 void *xrealloc(void *ptr, size_t size) {
+#ifdef PICOL_COUNT_MALLOC
+    picolMallocCalls++;
+#endif
+#ifdef PICOL_MEM_STATS
+    union picolMemHeader *h = ptr ? (union picolMemHeader*)ptr-1 : NULL;
+    size_t oldsize = h ? h->h.size : 0;
+    if (size > SIZE_MAX-sizeof(*h)) size = SIZE_MAX; // Fail below.
+    else size += sizeof(*h);
+    void *mem = realloc(h,size);
+    size -= sizeof(*h);
+#else
     void *mem = realloc(ptr,size);
+#endif
     if (!mem) {
         fprintf(stderr,"Out of memory realloc(%p,%zu)\n", ptr, size);
         exit(1);
     }
+#ifdef PICOL_MEM_STATS
+    h = mem;
+    if (ptr == NULL) {
+        h->h.owner = picolMemOwner();
+        h->h.category = PICOL_MEM_OTHER;
+        atomic_fetch_add(&h->h.owner->refs,1);
+        atomic_fetch_add(&h->h.owner->allocs,1);
+    } else {
+        picolMemCharge(h->h.owner,h->h.category,oldsize,-1);
+    }
+    h->h.size = size;
+    picolMemCharge(h->h.owner,h->h.category,size,1);
+    mem = h+1;
+#endif
     return mem;
 }
 
 #define xmalloc(size) xrealloc(NULL,size)
 
+/* Zeroed memory. Large blocks come from the kernel already zeroed, so they
+ * are cleared a page at a time when used, not all at once. */
+void *xcalloc(size_t count, size_t size) {
+#ifdef PICOL_COUNT_MALLOC
+    picolMallocCalls++;
+#endif
+#ifdef PICOL_MEM_STATS
+    union picolMemHeader *h = NULL;
+    if (size == 0 || count <= (SIZE_MAX-sizeof(*h))/size)
+        h = calloc(1,sizeof(*h)+count*size);
+    void *mem = h;
+#else
+    void *mem = calloc(count,size);
+#endif
+    if (!mem) {
+        fprintf(stderr,"Out of memory calloc(%zu,%zu)\n", count, size);
+        exit(1);
+    }
+#ifdef PICOL_MEM_STATS
+    h->h.owner = picolMemOwner();
+    h->h.category = PICOL_MEM_OTHER;
+    h->h.size = count*size;
+    atomic_fetch_add(&h->h.owner->refs,1);
+    atomic_fetch_add(&h->h.owner->allocs,1);
+    picolMemCharge(h->h.owner,h->h.category,h->h.size,1);
+    mem = h+1;
+#endif
+    return mem;
+}
+
+/* Free memory of xrealloc(), xcalloc() and the like. */
+void xfree(void *ptr) {
+#ifdef PICOL_MEM_STATS
+    if (ptr == NULL) return;
+    union picolMemHeader *h = (union picolMemHeader*)ptr-1;
+    struct picolMemCounters *owner = h->h.owner;
+    picolMemCharge(owner,h->h.category,h->h.size,-1);
+    atomic_fetch_add(&owner->frees,1);
+    picolMemRelease(owner);
+    ptr = h;
+#endif
+    free(ptr);
+}
+
 char *xstrdup(const char *s) {
     size_t l = strlen(s);
     char *dup = xmalloc(l+1);
@@ -54,13 +233,160 @@ char *xstrdup(const char *s) {
     return dup;
 }
 
+/* Objects, variables, call frames and most strings are small blocks that
+ * are allocated and freed all the time. Freed blocks are kept in per thread
+ * lists, one for every size class of 16 bytes, and reused without calling
+ * malloc() at all. The caller must free a block with the same size it
+ * requested. */
+#define PICOL_SMALL_MAX 128     /* Larger blocks just use malloc(). */
+#define PICOL_SMALL_KEEP 4096   /* Max free blocks kept for every class. */
+
+struct picolFreeBlock {
+    struct picolFreeBlock *next;
+};
+
+_Thread_local struct {
+    struct picolFreeBlock *head;
+    int count;
+} picolSmallFree[PICOL_SMALL_MAX/16];
+
+void *picolAllocSmall(size_t size) {
+    if (size > PICOL_SMALL_MAX) return xmalloc(size);
+    int class = (size-1)/16;
+    struct picolFreeBlock *b = picolSmallFree[class].head;
+    if (b == NULL) return xmalloc((class+1)*16);
+    picolSmallFree[class].head = b->next;
+    picolSmallFree[class].count--;
+    picolMemTag(b,PICOL_MEM_OTHER);
+    return b;
+}
+
+/* Return the free blocks of this thread to the system, before it exits. */
+void picolFreeSmallCache(void) {
+    for (int j = 0; j < PICOL_SMALL_MAX/16; j++) {
+        while(picolSmallFree[j].head) {
+            struct picolFreeBlock *b = picolSmallFree[j].head;
+            picolSmallFree[j].head = b->next;
+            xfree(b);
+        }
+        picolSmallFree[j].count = 0;
+    }
+}
+
+void picolFreeSmall(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    int class = (size-1)/16;
+    if (size > PICOL_SMALL_MAX || picolSmallFree[class].count == PICOL_SMALL_KEEP) {
+        xfree(ptr);
+        return;
+    }
+    struct picolFreeBlock *b = ptr;
+    picolMemTag(b,PICOL_MEM_FREELISTS);
+    b->next = picolSmallFree[class].head;
+    picolSmallFree[class].head = b;
+    picolSmallFree[class].count++;
+}
+
+/* The arena is used for the temporary allocations of the parser and of the
+ * command calls, that are all released together: the parse tree of a script
+ * once it is compiled, argument vectors when the call returns. Allocating
+ * is just a matter of incrementing a pointer, and picolArenaReset() frees
+ * everything allocated after picolArenaMark() was called. */
+#define PICOL_ARENA_CHUNK 65536
+
+struct picolArenaChunk {
+    struct picolArenaChunk *next;
+    size_t size, used;
+    char data[];
+};
+
+struct picolArena {
+    struct picolArenaChunk *first;
+    struct picolArenaChunk *cur; /* NULL if nothing is allocated. */
+};
+
+struct picolArenaMark {
+    struct picolArenaChunk *chunk;
+    size_t used;
+};
+
+void *picolArenaAlloc(struct picolArena *a, size_t size) {
+    struct picolArenaChunk *c = a->cur;
+    size = (size+7) & ~(size_t)7;
+    while (c == NULL || c->used+size > c->size) {
+        /* Chunks after the current one are free, reuse them if possible. */
+        struct picolArenaChunk *next = c ? c->next : a->first;
+        if (next == NULL || next->size < size) {
+            size_t csize = size > PICOL_ARENA_CHUNK ? size : PICOL_ARENA_CHUNK;
+            struct picolArenaChunk *n = xmalloc(sizeof(*n)+csize);
+            picolMemTag(n,PICOL_MEM_ARENA);
+            n->size = csize;
+            n->next = next;
+            if (c) c->next = n; else a->first = n;
+            next = n;
+        }
+        next->used = 0;
+        c = next;
+    }
+    a->cur = c;
+    c->used += size;
+    return c->data+c->used-size;
+}
+
+/* Make room for one more element in the arena allocated array 'ptr' of 'n'
+ * elements of 'size' bytes. The capacity is implicitly the next power of
+ * two, so the array is copied just log2(n) times. */
+void *picolArenaGrowArray(struct picolArena *a, void *ptr, int n, size_t size) {
+    if (n & (n-1)) return ptr;
+    void *new = picolArenaAlloc(a,size*(n ? n*2 : 1));
+    if (n) memcpy(new,ptr,size*n);
+    return new;
+}
+
+struct picolArenaMark picolArenaMark(struct picolArena *a) {
+    struct picolArenaMark m;
+    m.chunk = a->cur;
+    m.used = a->cur ? a->cur->used : 0;
+    return m;
+}
+
+/* Release what was allocated after the mark 'm'. A single free chunk of
+ * the default size is kept for the next allocations, the others are
+ * returned to the system. */
+void picolArenaReset(struct picolArena *a, struct picolArenaMark m) {
+    struct picolArenaChunk **link = m.chunk ? &m.chunk->next : &a->first;
+    a->cur = m.chunk;
+    if (m.chunk) m.chunk->used = m.used;
+    if (*link && (*link)->size == PICOL_ARENA_CHUNK) link = &(*link)->next;
+    while (*link) {
+        struct picolArenaChunk *next = (*link)->next;
+        xfree(*link);
+        *link = next;
+    }
+}
+
+void picolFreeArena(struct picolArena *a) {
+    while (a->first) {
+        struct picolArenaChunk *next = a->first->next;
+        xfree(a->first);
+        a->first = next;
+    }
+    a->cur = NULL;
+}
+
 /* =============================================================================
  * Data structures
  * ========================================================================== */
 
-#define PICOL_MAX_RECURSION_LEVEL 128
+#define PICOL_MAX_RECURSION_LEVEL 128 /* Nesting on the C stack. */
+#define PICOL_MAX_LEVEL 200000 /* Default procedure calls depth limit. */
+
+#define PICOL_LIMIT_INTERVAL 1000 /* Checkpoints between limit checks. */
 
-enum {PICOL_OK, PICOL_ERR, PICOL_RETURN, PICOL_BREAK, PICOL_CONTINUE};
+/* PICOL_LIMIT is returned when a limit set with picolSetBudget() or
+ * picolSetTimeLimit() is exceeded, or picolInterrupt() was called. No
+ * command catches it. */
+enum {PICOL_OK, PICOL_ERR, PICOL_RETURN, PICOL_BREAK, PICOL_CONTINUE, PICOL_LIMIT};
 enum {
     PT_ESC, // String that may contain escapes (that should be processed)
     PT_STR, // String without escapes, no post processing needed.
@@ -71,6 +397,61 @@ enum {
     PT_EOF  // End of file (stops the parsing loop)
 };
 
+/* Values are reference counted objects with a string representation and,
+ * optionally, a cached numeric one. The string may be missing too: numbers
+ * computed by expr are formatted only if somebody asks for the string.
+ * Objects are shared, so an object with refcount > 1 must never change. */
+enum {PICOL_OBJ_STRING, PICOL_OBJ_DOUBLE, PICOL_OBJ_INT, PICOL_OBJ_LIST,
+      PICOL_OBJ_DICT};
+
+struct picolObj {
+    int refcount;
+    int type;           // Cached representation, PICOL_OBJ_...
+    char *str;          // String representation, or NULL if not computed.
+    int len;            // Length of 'str'.
+    int size;           // Allocated bytes of 'str', at least len+1, or
+                        // minus the size of its mapping, see picolMapFile().
+    double dval;        // Valid if type is PICOL_OBJ_DOUBLE.
+    long long ival;     // Valid if type is PICOL_OBJ_INT.
+    struct picolList *list; // Valid if type is PICOL_OBJ_LIST.
+    struct picolDict *dict; // Valid if type is PICOL_OBJ_DICT.
+};
+
+/* The elements of a list value, parsed once. */
+struct picolList {
+    int len, cap;
+    struct picolObj **elem;
+};
+
+/* Dictionaries are open addressing hash tables of entries, that are also
+ * linked in insertion order. When a table must grow, the entries are moved
+ * to the new one a few at every operation, so that no single insertion
+ * pays for rehashing all of them: see picolDictRehashStep(). */
+struct picolDictEntry {
+    struct picolObj *key, *val;
+    unsigned int hash;
+    struct picolDictEntry *prev, *next; // Insertion order.
+};
+
+struct picolDictTable {
+    struct picolDictEntry **slot;
+    unsigned int size, used; // Size is a power of two, used counts tombstones.
+};
+
+struct picolDict {
+    struct picolDictTable t[2]; // While rehashing t[1] is the new table.
+    int rehashidx;      // Next slot of t[0] to move, or -1.
+    int len;
+    struct picolDictEntry *head, *tail;
+};
+
+/* Numbers as seen by expressions: 64 bit integers, or doubles. */
+struct picolNumber {
+    int type;           // PICOL_OBJ_INT or PICOL_OBJ_DOUBLE.
+    long long i;
+    double d;
+};
+
 struct picolParser {
     char *text;         // The program to parse
     char *p;            // Current parsing position in 'text'
@@ -81,46 +462,280 @@ struct picolParser {
     int insidequote;    // True if inside " "
 };
 
+/* A script is parsed once into a list of commands, each command being a
+ * list of words, and each word a list of parts to concatenate. Escapes are
+ * already resolved at parse time, so only $var and [cmd] parts require work
+ * when the script is executed. This is the input of the compiler. */
+struct picolPart {
+    int type;                   // PT_STR, PT_VAR or PT_CMD
+    char *str;                  // Literal text, var name or command text
+};
+
+struct picolWord {
+    int numparts;
+    struct picolPart *parts;
+};
+
+struct picolScriptCmd {
+    int argc;
+    struct picolWord *words;
+};
+
+struct picolScript {
+    int numcmds;
+    struct picolScriptCmd *cmds;
+};
+
+/* Expressions are parsed into a tree, then compiled into VM code. Variables
+ * and [commands] are operands like numbers: their value is never parsed
+ * again as an expression. */
+enum {EXPR_NUM, EXPR_VAR, EXPR_CMD, EXPR_OP};
+
+struct picolExprNode {
+    int type;                   // EXPR_...
+    int op;                     // Operator of EXPR_OP nodes, see picolMathOp().
+    char *str;                  // Number, variable name or command text.
+    struct picolExprNode *left, *right; // Operands. Unary ops: right is NULL.
+};
+
+/* Scripts are compiled into code for a small stack based virtual machine.
+ * Opcodes are followed by their operand, if any, in the 'ops' array. */
+enum {
+    OP_PUSH,        // PUSH <const>: push a literal.
+    OP_LOAD,        // LOAD <const>: push the value of the named variable.
+    OP_LOADLOCAL,   // LOADLOCAL <slot>: push the value of a local variable.
+    OP_STORE,       // STORE <const>: pop a value, set it to the variable.
+    OP_STORELOCAL,  // STORELOCAL <slot>: pop a value, set it to the local.
+    OP_CONCAT,      // CONCAT <n>: replace n values with their concatenation.
+    OP_INVOKE,      // INVOKE <argc>: call a command with argc values as argv.
+    OP_CALL,        // CALL <argc> <site>: like INVOKE, cached command lookup.
+    OP_RESULT,      // RESULT: push the interpreter result.
+    OP_CLEARRESULT, // CLEARRESULT: set the result to the empty string.
+    OP_JUMP,        // JUMP <target>
+    OP_JUMPFALSE,   // JUMPFALSE <target>: jump if the result is zero.
+    OP_JUMPTRUE,    // JUMPTRUE <target>: jump if the result is not zero.
+    OP_FOREACH,     // FOREACH <target> <numlists> {<numvars> <var>...}...:
+                    // set the variables to the next values of the lists
+                    // and jump, or go on if there are none, see below.
+    OP_DICTITEMS,   // DICTITEMS: replace the dict below the top value with
+                    // the list of its keys and values.
+    OP_POP,         // POP <n>: pop n values.
+    OP_MATH,        // MATH <op>: replace the operands with the result of op.
+    OP_ANDOR,       // ANDOR <op> <target>: jump if the top value decides the
+                    // result of op (&& or ||), or pop it and go on.
+    OP_POPJUMPFALSE,// POPJUMPFALSE <target>: pop a number, jump if it is zero.
+    OP_POPRESULT,   // POPRESULT: pop a value and make it the result.
+    OP_BREAK,       // BREAK: exit the innermost loop.
+    OP_CONTINUE,    // CONTINUE: restart the innermost loop.
+    OP_RETURN,      // RETURN <hasval>: return, the value is on the stack.
+    OP_ERROR,       // ERROR <const>: fail with the given message.
+    OP_DEOPT        // DEOPT: call an inlined command that was redefined.
+};
+
+/* Inlined loops, so that break/continue codes can be turned into jumps. */
+struct picolLoop {
+    int start, end;     // Body of the loop: ops in the start..end-1 range.
+    int contpc;         // Where to jump on continue.
+    int breakpc;        // Where to jump on break.
+    int depth;          // Stack depth to restore before jumping.
+};
+
+/* Call sites of commands with a literal name remember the command found
+ * the last time, valid until any command is (re)defined. */
+struct picolCallSite {
+    struct picolCmd *cmd;
+    int epoch;          // Interpreter cmdepoch at lookup time.
+};
+
+/* Inlined commands, so that they can be called normally if they are
+ * redefined while the code runs, see picolDeoptimize(). */
+struct picolInlined {
+    struct picolCmd *cmd;
+    int start;          // Op replaced by OP_DEOPT.
+    int end;            // Where the inlined code ends.
+    int args, numargs;  // Constants with the leading literal arguments.
+    int onstack;        // Arguments pushed by the code before 'start', that
+                        // follow the literal ones.
+};
+
+struct picolCode {
+    int refcount;       // Code may be freed while executing.
+    int epoch;          // Interpreter epoch at compile or patch time.
+    char *src;          // Source, in order to recompile it if needed.
+    int isexpr;         // True if 'src' is an expression, not a script.
+    struct picolLocals *locals; // Procedure locals, or NULL.
+    int *ops, len;
+    struct picolObj **consts;
+    int numconsts;
+    struct picolLoop *loops;
+    int numloops;
+    struct picolCallSite *sites;
+    int numsites;
+    struct picolInlined *inlined; // Sorted by start.
+    int numinlined;
+    int maxstack;       // Max number of stack entries used.
+};
+
+/* Compiled scripts passed to picolEval() as strings (if/while bodies and so
+ * forth) are cached by content in a small direct mapped table. Expressions
+ * evaluated by picolEvalExpr() have their own table. */
+#define PICOL_SCRIPT_CACHE_SIZE 256
+#define PICOL_FRAME_POOL 256 /* Max dropped call frames kept for reuse. */
+
+struct picolScriptCacheEntry {
+    unsigned int hash;
+    struct picolCode *code;
+};
+
 struct picolVar {
-    char *name, *val;
-    struct picolVar *next;
+    char *name;
+    struct picolObj *val; // NULL for unset local slots.
+    unsigned int hash;  // Hash of the name, see picolHashString().
+};
+
+/* Local variables of a procedure, resolved to slots at compile time. The
+ * first 'numargs' locals are the procedure arguments. */
+struct picolLocals {
+    int refcount;       // Referenced by the code and by its call frames.
+    int numargs;
+    int numlocals;
+    int globalarg;      // Index of an argument named like a global, or -1.
+    char **names;
+    unsigned int *hashes;
 };
 
 struct picolInterp;     // Forward declarations
 struct picolCmd;
 typedef int (*picolCmdFunc)(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd);
+typedef int (*picolObjCmdFunc)(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
 
+/* Commands are implemented either by a function taking the arguments as C
+ * strings (func), or as objects (objfunc). The other pointer is NULL. */
 struct picolCmd {
     char *name;
+    unsigned int hash;  // Hash of the name, see picolHashString().
     picolCmdFunc func;
-    struct picolCmd *next;
+    picolObjCmdFunc objfunc;
     // Aux data for user defined procedures:
     char *arglist;
     char *body;
+    struct picolCode *code; // Compiled body
+    struct picolMemo *memo; // Cached results, or NULL, see [memoize].
+};
+
+/* Results of a memoized procedure, keyed by the arguments. The insertion
+ * order of the dict is the LRU order: hits move the entry to the end, and
+ * the first one is evicted when the cache is full. */
+struct picolMemo {
+    struct picolDict *cache;
+    int maxlen;
+    long long hits, misses, evictions;
 };
 
 struct picolCallFrame {
-    struct picolVar *vars;
+    struct picolVar *slots;     /* Procedure locals, see picolLocals. */
+    int numslots;               /* Allocated slots: frames are reused. */
+    struct picolLocals *locals; /* Names of the slots, NULL at top level. */
+    struct picolVar **vars;     /* Hash table of the other variables. */
+    int varslots, numvars;      /* Table size (power of two) and used slots. */
     struct picolCallFrame *parent; /* parent is NULL at top level */
 };
 
+/* Procedures called by compiled code run in the same picolExecCode() loop,
+ * without C recursion: this is where the caller state is saved meanwhile. */
+struct picolExecFrame {
+    struct picolCode *code;
+    int pc, ip;     /* Next instruction, and the call instruction. */
+    int base;       /* Stack base of the caller. */
+    int objc;       /* Arguments of the call, to pop on return. */
+    struct picolCmd *cmd;       /* Called procedure. */
+    struct picolObj *memokey;   /* Key of the result, if memoized. */
+    int profiled;   /* True if the call is timed by the profiler. */
+};
+
+/* Channels: stdin, stdout, the files opened by [open] and the sockets of
+ * [socket]. Writes are collected in 'buf', and passed to the handler set
+ * with picolSetOutputHandler(), or written to 'fp' or 'fd', when the buffer
+ * is full, at every newline with line buffering, or on [flush]. Reads fill
+ * 'rbuf', and lines are taken from there, see picolReadLine(). */
+enum {PICOL_BUF_NONE, PICOL_BUF_LINE, PICOL_BUF_FULL};
+enum {PICOL_READABLE = 1, PICOL_WRITABLE = 2};
+#define PICOL_CHANNEL_BUFSIZE 65536
+#define PICOL_SOCKET_BUFSIZE 4096 /* Smaller, there may be thousands. */
+
+typedef void (*picolOutputFunc)(void *privdata, const char *buf, int len);
+
+struct picolChannel {
+    char *name;
+    int fd;
+    char *buf;              // Allocated on the first write.
+    int len, size;
+    int buffering;          // PICOL_BUF_...
+    int access;             // PICOL_READABLE and/or PICOL_WRITABLE.
+    FILE *fp;               // If not NULL, written instead of 'fd'.
+    picolOutputFunc handler;
+    void *privdata;
+    char *rbuf;             // Input, unread bytes are rbuf[rpos..rlen-1].
+    int rpos, rlen, rsize;
+    int eof;                // True if the last read found the end of file.
+    int blocked;            // True if the last read would have blocked.
+    int slot;               // Index in the files of the interpreter, or -1.
+    int stream;             // Socket or pipe: not seekable.
+    int nonblocking;        // Never blocks, see picolFlushChannel().
+    int watched;            // Epoll events waited for, see picolWatchChannel().
+    struct picolCode *onreadable, *onwritable; // Scripts of [fileevent].
+    struct picolObj *onaccept;  // Command of a server socket, or NULL.
+};
+
 struct picolInterp {
-    int level; /* Level of nesting */
+    int level; /* Depth of procedure calls */
+    int maxlevel; /* Max depth, see [interp recursionlimit]. */
+    int nesting; /* Recursion on the C stack, see PICOL_MAX_RECURSION_LEVEL. */
     struct picolCallFrame *callframe;
-    struct picolCmd *commands;
-    char *result;
+    struct picolCallFrame *rootframe; /* Where globals live. */
+    struct picolCmd **commands; /* Open addressing hash table of commands. */
+    int cmdslots, numcmds; /* Table size (power of two) and used slots. */
+    int cmdepoch; /* Incremented on every command (re)definition. */
+    struct picolObj *result;
+    struct picolObj *emptyobj; /* Shared empty string. */
+    int epoch; /* Incremented when inlined commands are redefined. */
+    struct picolScriptCacheEntry scriptcache[PICOL_SCRIPT_CACHE_SIZE];
+    struct picolScriptCacheEntry exprcache[PICOL_SCRIPT_CACHE_SIZE];
+    struct picolObj **stack; /* VM stack, shared by all the calls. */
+    int sp, stacklen;
+    struct picolArena arena; /* Parse trees and argument vectors. */
+    struct picolCallFrame *framepool; /* Dropped frames, linked by parent. */
+    int numpooled;
+    struct picolExecFrame *execstack; /* Callers of the running procedures. */
+    int execdepth, execlen;
+    struct picolChannel in, out; /* Standard input and output. */
+    struct picolChannel **files; /* Channels of [open], "fileN" is files[N]. */
+    int numfiles;
+    struct picolThread *thread; /* Mailbox, created when first needed. */
+    struct picolPmap *pmap; /* Workers of [pmap], created when first needed. */
+    int profiling; /* True if calls are timed, see [profile]. */
+    struct picolProfile *profile; /* Data of the profiler, or NULL. */
+    struct picolMemCounters *mem; /* Memory accounting, see picolMemStats(). */
+    int ticks; /* Checkpoints left before the limits are checked. */
+    long long budget; /* Checkpoints left to run, or -1 if unlimited. */
+    double deadline; /* CLOCK_MONOTONIC nanoseconds, or 0 if none. */
+    atomic_int interrupted; /* Set by picolInterrupt(). */
+    struct picolEvents *events; /* Event loop, created when first needed. */
 };
 
-void picolInitParser(struct picolParser *p, char *text) {
+/* Parse 'len' bytes at 'text', or up to the null terminator if len is -1.
+ * The parser never looks past the given length, so the text of a file
+ * mapped in memory can be parsed in place. */
+void picolInitParser(struct picolParser *p, char *text, int len) {
     p->text = p->p = text;
-    p->len = strlen(text);
+    p->len = len == -1 ? (int)strlen(text) : len;
     p->start = 0; p->end = 0; p->insidequote = 0;
     p->type = PT_EOL;
 }
 
 int picolParseSep(struct picolParser *p) {
     p->start = p->p;
-    while(*p->p == ' ' || *p->p == '\t') {
+    while(p->len && (*p->p == ' ' || *p->p == '\t')) {
         p->p++; p->len--;
     }
     p->end = p->p-1;
@@ -130,8 +745,8 @@ int picolParseSep(struct picolParser *p) {
 
 int picolParseEol(struct picolParser *p) {
     p->start = p->p;
-    while(*p->p == ' ' || *p->p == '\t' || *p->p == '\n' || *p->p == '\r' ||
-          *p->p == ';')
+    while(p->len && (*p->p == ' ' || *p->p == '\t' || *p->p == '\n' ||
+                     *p->p == '\r' || *p->p == ';'))
     {
         p->p++; p->len--;
     }
@@ -164,7 +779,7 @@ int picolParseCommand(struct picolParser *p) {
     }
     p->end = p->p-1;
     p->type = PT_CMD;
-    if (*p->p == ']') {
+    if (p->len && *p->p == ']') {
         p->p++; p->len--;
     }
     return PICOL_OK;
@@ -172,7 +787,7 @@ int picolParseCommand(struct picolParser *p) {
 
 int picolParseVar(struct picolParser *p) {
     p->start = ++p->p; p->len--; /* skip the $ */
-    while(1) {
+    while(p->len) {
         if ((*p->p >= 'a' && *p->p <= 'z') || (*p->p >= 'A' && *p->p <= 'Z') ||
             (*p->p >= '0' && *p->p <= '9') || *p->p == '_')
         {
@@ -299,347 +914,4682 @@ int picolGetToken(struct picolParser *p) {
     return PICOL_OK; /* unreached */
 }
 
+/* Turn \<something> into a single char, in place: the result is always
+ * equal or shorter than the original string. */
+void picolProcessEscapes(char *t) {
+    char *src = t, *dst = t;
+    while (*src) {
+        if (*src == '\\' && *(src+1)) {
+            src++; // skip the "\"
+            switch(*src) {
+            case 'n': *dst++ = '\n'; break;
+            case 't': *dst++ = '\t'; break;
+            case 'r': *dst++ = '\r'; break;
+            default: *dst++ = *src; break;
+            }
+        } else *dst++ = *src;
+        src++;
+    }
+    *dst = '\0';
+}
+
+/* Append a part to the word 'w'. Adjacent literal parts are merged, so that
+ * a word without substitutions is always made of a single PT_STR part. */
+void picolWordAppendPart(struct picolArena *a, struct picolWord *w, int type, char *str) {
+    struct picolPart *last = w->numparts ? w->parts+w->numparts-1 : NULL;
+    if (type == PT_STR && last && last->type == PT_STR) {
+        int oldlen = strlen(last->str), len = strlen(str);
+        char *merged = picolArenaAlloc(a,oldlen+len+1);
+        memcpy(merged,last->str,oldlen);
+        memcpy(merged+oldlen,str,len+1);
+        last->str = merged;
+        return;
+    }
+    w->parts = picolArenaGrowArray(a,w->parts,w->numparts,sizeof(struct picolPart));
+    w->parts[w->numparts].type = type;
+    w->parts[w->numparts].str = str;
+    w->numparts++;
+}
+
+/* Parse the program of the parser 'p' into a picolScript, using the same
+ * token merging rules picolEval() always used: a token following a separator
+ * starts a new word, otherwise it is interpolated into the previous one.
+ * If 'maxcmds' is not zero, parsing stops after that many commands, and it
+ * can be resumed with another call: p->type is PT_EOF once the program is
+ * over. The script is allocated in the arena 'a', and it is released with
+ * it. */
+struct picolScript *picolParseCommands(struct picolArena *a, struct picolParser *p, int maxcmds) {
+    struct picolScript *s = picolArenaAlloc(a,sizeof(*s));
+    struct picolScriptCmd *sc = NULL;
+    s->numcmds = 0;
+    s->cmds = NULL;
+    while(1) {
+        int prevtype = p->type, tlen, type;
+        char *tok;
+        picolGetToken(p);
+        if (p->type == PT_EOF) break;
+        if (p->type == PT_SEP) continue;
+        if (p->type == PT_EOL) {
+            sc = NULL; // Next token starts a new command.
+            if (maxcmds && s->numcmds == maxcmds) break;
+            continue;
+        }
+        tlen = p->end-p->start+1;
+        if (tlen < 0) tlen = 0;
+        tok = picolArenaAlloc(a,tlen+1);
+        memcpy(tok,p->start,tlen);
+        tok[tlen] = '\0';
+        type = p->type;
+        if (type == PT_ESC) {
+            picolProcessEscapes(tok);
+            type = PT_STR;
+        }
+        if (sc == NULL) {
+            s->cmds = picolArenaGrowArray(a,s->cmds,s->numcmds,sizeof(*sc));
+            sc = s->cmds+s->numcmds++;
+            sc->argc = 0;
+            sc->words = NULL;
+        }
+        if (prevtype == PT_SEP || prevtype == PT_EOL) {
+            /* New argument of the current command. */
+            sc->words = picolArenaGrowArray(a,sc->words,sc->argc,sizeof(struct picolWord));
+            sc->words[sc->argc].numparts = 0;
+            sc->words[sc->argc].parts = NULL;
+            sc->argc++;
+        }
+        picolWordAppendPart(a,sc->words+sc->argc-1,type,tok);
+    }
+    return s;
+}
+
+/* Parse the whole null terminated program 't'. */
+struct picolScript *picolParseScript(struct picolArena *a, char *t) {
+    struct picolParser p;
+    picolInitParser(&p,t,-1);
+    return picolParseCommands(a,&p,0);
+}
+
 /* =============================================================================
- * Eval and related functions
+ * Values
  * ========================================================================== */
 
-struct picolInterp *picolInitInterp(void) {
-    struct picolInterp *i = xmalloc(sizeof(*i));
-    i->level = 0;
-    i->callframe = xmalloc(sizeof(struct picolCallFrame));
-    i->result = xstrdup("");
-    i->callframe->vars = NULL;
-    i->callframe->parent = NULL;
-    i->commands = NULL;
-    return i;
+/* Create a string object. If len is -1 the length is computed with strlen.
+ * If 's' is NULL the string is left uninitialized, for the caller to fill.
+ * The new object has refcount 0: whoever stores it increments it. Strings
+ * are small blocks of len+1 bytes, see picolAllocSmall(). */
+struct picolObj *picolNewStringObj(const char *s, int len) {
+    struct picolObj *o = picolAllocSmall(sizeof(*o));
+    picolMemTag(o,PICOL_MEM_VALUES);
+    if (len == -1) len = strlen(s);
+    o->refcount = 0;
+    o->str = picolAllocSmall(len+1);
+    picolMemTag(o->str,PICOL_MEM_VALUES);
+    if (s) memcpy(o->str,s,len);
+    o->str[len] = '\0';
+    o->len = len;
+    o->size = len+1;
+    o->type = PICOL_OBJ_STRING;
+    return o;
 }
 
-void picolSetResult(struct picolInterp *i, char *s) {
-    free(i->result);
-    i->result = xstrdup(s);
+struct picolObj *picolNewDoubleObj(double d) {
+    struct picolObj *o = picolAllocSmall(sizeof(*o));
+    picolMemTag(o,PICOL_MEM_VALUES);
+    o->refcount = 0;
+    o->str = NULL;
+    o->len = o->size = 0;
+    o->type = PICOL_OBJ_DOUBLE;
+    o->dval = d;
+    return o;
 }
 
-struct picolVar *picolGetVar(struct picolInterp *i, char *name) {
-    struct picolCallFrame *cf = i->callframe;
-    if (isupper(name[0])) while(cf->parent) cf = cf->parent;
-    struct picolVar *v = cf->vars;
-    while(v) {
-        if (strcmp(v->name,name) == 0) return v;
-        v = v->next;
-    }
-    return NULL;
+struct picolObj *picolNewIntObj(long long v) {
+    struct picolObj *o = picolNewDoubleObj(0);
+    o->type = PICOL_OBJ_INT;
+    o->ival = v;
+    return o;
 }
 
-void picolSetVar(struct picolInterp *i, char *name, char *val) {
-    struct picolVar *v = picolGetVar(i,name);
-    if (v) {
-        free(v->val);
-        v->val = xstrdup(val);
+struct picolObj *picolNewNumberObj(struct picolNumber *n) {
+    return n->type == PICOL_OBJ_INT ? picolNewIntObj(n->i) : picolNewDoubleObj(n->d);
+}
+
+#define picolIncrRefCount(o) ((o)->refcount++)
+
+void picolFreeIntRep(struct picolObj *o);
+
+/* Free the string of 'o', that must exist. Strings read from big files may
+ * be mapped in memory instead of allocated, see picolMapFile(). */
+void picolFreeString(struct picolObj *o) {
+    if (o->size < 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        munmap((void*)((unsigned long)o->str & ~(page-1)),-o->size);
     } else {
-        v = xmalloc(sizeof(*v));
-        v->name = xstrdup(name);
-        v->val = xstrdup(val);
-        struct picolCallFrame *cf = i->callframe;
-        if (isupper(name[0])) while(cf->parent) cf = cf->parent;
-        v->next = cf->vars;
-        cf->vars = v;
+        picolFreeSmall(o->str,o->size);
     }
 }
 
-struct picolCmd *picolGetCommand(struct picolInterp *i, char *name) {
-    struct picolCmd *c = i->commands;
-    while(c) {
-        if (strcmp(c->name,name) == 0) return c;
-        c = c->next;
-    }
-    return NULL;
+void picolDecrRefCount(struct picolObj *o) {
+    if (--o->refcount > 0) return;
+    picolFreeIntRep(o);
+    if (o->str) picolFreeString(o);
+    picolFreeSmall(o,sizeof(*o));
 }
 
-void picolRegisterCommand(struct picolInterp *i, char *name, picolCmdFunc f) {
-    struct picolCmd *c = picolGetCommand(i,name);
-    int existing = c != NULL;
+/* Write the decimal representation of 'v' in 'buf', that must be at least
+ * 21 bytes. Returns the length. Much faster than snprintf(). */
+int picolItoa(long long v, char *buf) {
+    char tmp[20];
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    int len = 0, j = 0;
+    do {
+        tmp[len++] = '0'+(u%10);
+        u /= 10;
+    } while(u);
+    if (v < 0) buf[j++] = '-';
+    while(len) buf[j++] = tmp[--len];
+    buf[j] = '\0';
+    return j;
+}
 
-    if (!existing) {
-        c = xmalloc(sizeof(*c));
-        c->name = NULL;
-        c->arglist = NULL;
-        c->body = NULL;
-    } else {
-        free(c->arglist);
-        free(c->body);
-        c->arglist = NULL;
-        c->body = NULL;
-    }
-    if (!c->name) c->name = xstrdup(name);
-    c->func = f;
-    if (!existing) {
-        c->next = i->commands;
-        i->commands = c;
+void picolUpdateListString(struct picolObj *o);
+void picolUpdateDictString(struct picolObj *o);
+
+/* Return the string representation, creating it if needed. */
+char *picolGetString(struct picolObj *o) {
+    if (o->str == NULL && o->type == PICOL_OBJ_LIST) {
+        picolUpdateListString(o);
+    } else if (o->str == NULL && o->type == PICOL_OBJ_DICT) {
+        picolUpdateDictString(o);
+    } else if (o->str == NULL) {
+        char buf[64];
+        if (o->type == PICOL_OBJ_INT)
+            o->len = picolItoa(o->ival,buf);
+        else
+            o->len = snprintf(buf,sizeof(buf),"%.12g",o->dval);
+        o->size = o->len+1;
+        o->str = picolAllocSmall(o->size);
+        picolMemTag(o->str,PICOL_MEM_VALUES);
+        memcpy(o->str,buf,o->size);
     }
+    return o->str;
 }
 
-/* EVAL! */
-int picolEval(struct picolInterp *i, char *t) {
-    struct picolParser p;
-    int argc = 0, j;
-    char **argv = NULL;
-    char errbuf[1024];
-    int retcode = PICOL_OK;
-    picolSetResult(i,"");
-    if (++i->level > PICOL_MAX_RECURSION_LEVEL) {
-        i->level--;
-        picolSetResult(i,"Nesting too deep");
-        return PICOL_ERR;
-    }
-    picolInitParser(&p,t);
-    while(1) {
-        char *t;
-        int tlen;
-        int prevtype = p.type;
-        picolGetToken(&p);
-        if (p.type == PT_EOF) break;
-        tlen = p.end-p.start+1;
-        if (tlen < 0) tlen = 0;
-        t = xmalloc(tlen+1);
-        memcpy(t, p.start, tlen);
-        t[tlen] = '\0';
-        if (p.type == PT_VAR) {
-            struct picolVar *v = picolGetVar(i,t);
-            if (!v) {
-                snprintf(errbuf,sizeof(errbuf),"No such variable '%s'",t);
-                free(t);
-                picolSetResult(i,errbuf);
-                retcode = PICOL_ERR;
-                goto err;
-            }
-            free(t);
-            t = xstrdup(v->val);
-        } else if (p.type == PT_CMD) {
-            retcode = picolEval(i,t);
-            free(t);
-            if (retcode != PICOL_OK) goto err;
-            t = xstrdup(i->result);
-        } else if (p.type == PT_ESC) {
-            /* Process escapes turning \<something> into
-             * a single char. No need for a second buffer, the result
-             * is always equal or shorter than the original string. */
-            char *src = t, *dst = t;
-            while (*src) {
-                if (*src == '\\' && *(src+1)) {
-                    src++; // skip the "\"
-                    switch(*src) {
-                    case 'n': *dst++ = '\n'; break;
-                    case 't': *dst++ = '\t'; break;
-                    case 'r': *dst++ = '\r'; break;
-                    default: *dst++ = *src; break;
-                    }
-                } else *dst++ = *src;
-                src++;
-            }
-            *dst = '\0';
-        } else if (p.type == PT_SEP) {
-            prevtype = p.type;
-            free(t);
-            continue;
-        }
-        /* We have a complete command + args. Call it! */
-        if (p.type == PT_EOL) {
-            struct picolCmd *c;
-            free(t);
-            prevtype = p.type;
-            if (argc) {
-                if ((c = picolGetCommand(i,argv[0])) == NULL) {
-                    snprintf(errbuf,sizeof(errbuf),"No such command '%s'",argv[0]);
-                    picolSetResult(i,errbuf);
-                    retcode = PICOL_ERR;
-                    goto err;
-                }
-                retcode = c->func(i,argc,argv,c);
-                if (retcode != PICOL_OK) goto err;
-            }
-            /* Prepare for the next command */
-            for (j = 0; j < argc; j++) free(argv[j]);
-            free(argv);
-            argv = NULL;
-            argc = 0;
-            continue;
-        }
-        /* We have a new token, append to the previous or as new arg? */
-        if (prevtype == PT_SEP || prevtype == PT_EOL) {
-            /* New argument of the current command. */
-            argv = xrealloc(argv, sizeof(char*)*(argc+1));
-            argv[argc] = t;
-            argc++;
+/* Append 'len' bytes at 's' to the string of the object 'o', that must not
+ * be shared. The buffer grows geometrically, so that building a string
+ * with many appends takes linear time. */
+void picolAppendString(struct picolObj *o, const char *s, int len) {
+    picolGetString(o);
+    if (o->len+len+1 > o->size) {
+        int size = (o->len+len+1)*2;
+        if (o->size > PICOL_SMALL_MAX) {
+            o->str = xrealloc(o->str,size);
         } else {
-            /* Interpolation: concatenate to the old argument. */
-            int oldlen = strlen(argv[argc-1]), tlen = strlen(t);
-            argv[argc-1] = xrealloc(argv[argc-1], oldlen+tlen+1);
-            memcpy(argv[argc-1]+oldlen, t, tlen);
-            argv[argc-1][oldlen+tlen]='\0';
-            free(t);
+            char *str = picolAllocSmall(size);
+            picolMemTag(str,PICOL_MEM_VALUES);
+            memcpy(str,o->str,o->len);
+            picolFreeString(o);
+            o->str = str;
         }
-        prevtype = p.type;
+        o->size = size;
     }
-err:
-    for (j = 0; j < argc; j++) free(argv[j]);
-    free(argv);
-    i->level--;
-    return retcode;
+    memcpy(o->str+o->len,s,len);
+    o->len += len;
+    o->str[o->len] = '\0';
+    picolFreeIntRep(o);
+    o->type = PICOL_OBJ_STRING; // The number, list or dict it was changed.
 }
 
-/* This is a "Pratt style parser" for expressions: precedence is encoded in a
- * single recursive function. Basically the C call stack replaces the explicit
- * stack here.
- *
- * Precedences:
- *  0 ||, 1 &&, 2 comparisons, 3 add/sub, 4 mul/div, 5 unary.
- *
- * Note: picolExpr() is designed to be simple, not fully functional, so it
- * does not expand $vars and [commands]. [expr $a + [foo]] works, but
- * [expr {$a + [foo]}] will not. Also: no short circuits with && ||
- */
-double picolExpr(struct picolInterp *i, char **p, int *err, int prec) {
-    double a; char *e;
-
-    if (++i->level > PICOL_MAX_RECURSION_LEVEL) {
-        i->level--;
-        *err = 1; // Will be reported as error in expression, instead of
-        return 0; // recursion limit. Requires a pathological expression anyway.
+/* Parse the number at 'p' into 'n', returning a pointer to the first
+ * character after it, that is 'p' itself if there is no number. Decimal
+ * integers that fit 64 bits are integers, everything else is a double. */
+char *picolScanNumber(char *p, struct picolNumber *n) {
+    char *end;
+    errno = 0;
+    n->i = strtoll(p,&end,10);
+    if (end != p && errno != ERANGE &&
+        (*end == '\0' || strchr(".eExX",*end) == NULL))
+    {
+        n->type = PICOL_OBJ_INT;
+        return end;
     }
+    n->type = PICOL_OBJ_DOUBLE;
+    n->d = strtod(p,&end);
+    return end;
+}
 
-    /* Step 1: parse the left operand. */
-    while (**p && strchr(" \t\r\n", **p)) (*p)++;
-    if (**p == '(') {
-        (*p)++; a = picolExpr(i,p,err,0);
-        while (**p && strchr(" \t\r\n", **p)) (*p)++;
-        if (**p == ')') (*p)++; else *err = 1;
-    } else if (**p == '-') { (*p)++; a = -picolExpr(i,p,err,5);
-    } else if (**p == '+') { (*p)++; a = picolExpr(i,p,err,5);
-    } else { a = strtod(*p,&e); if (e == *p) *err = 1; *p = e; }
-    while (**p && strchr(" \t\r\n", **p)) (*p)++;
+/* Store in *n the value of the object as a number, parsing it the first
+ * time. Returns PICOL_ERR if the object is not a number. */
+int picolGetNumber(struct picolObj *o, struct picolNumber *n) {
+    if (o->type != PICOL_OBJ_INT && o->type != PICOL_OBJ_DOUBLE) {
+        char *str = picolGetString(o);
+        char *end = picolScanNumber(str,n);
+        if (end == str) return PICOL_ERR;
+        while(*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+            end++;
+        if (*end) return PICOL_ERR;
+        picolFreeIntRep(o);
+        o->type = n->type;
+        o->ival = n->i;
+        o->dval = n->d;
+    }
+    n->type = o->type;
+    n->i = o->ival;
+    n->d = o->dval;
+    return PICOL_OK;
+}
 
-    while (1) {
-        /* Step 2: parse the operator */
-        int op, oprec, len = 1;
-        if (**p == '|' && *(*p+1) == '|') { op = 'o'; oprec = 0; len = 2; }
-        else if (**p == '&' && *(*p+1) == '&') { op = 'a'; oprec = 1; len = 2; }
-        else if (**p == '*' || **p == '/') { op = **p; oprec = 4; }
-        else if (**p == '+' || **p == '-') { op = **p; oprec = 3; }
-        else if (**p == '<' && *(*p+1) == '=') { op = 'L'; oprec = 2; len = 2; }
-        else if (**p == '>' && *(*p+1) == '=') { op = 'G'; oprec = 2; len = 2; }
-        else if (**p == '=' && *(*p+1) == '=') { op = 'E'; oprec = 2; len = 2; }
-        else if (**p == '!' && *(*p+1) == '=') { op = 'N'; oprec = 2; len = 2; }
-        else if (**p == '<') { op = '<'; oprec = 2; }
-        else if (**p == '>') { op = '>'; oprec = 2; }
-        else break; // No more operators to consume: \0, ), or syntax error.
+/* Like picolGetNumber(), but integers are converted to doubles. */
+int picolGetDouble(struct picolObj *o, double *d) {
+    struct picolNumber n;
+    if (picolGetNumber(o,&n) != PICOL_OK) return PICOL_ERR;
+    *d = (n.type == PICOL_OBJ_INT) ? n.i : n.d;
+    return PICOL_OK;
+}
 
-        /* Step 3: if the operator has high enough precedence, parse the right
-         * operand with a recursive call (effectively processing higher
-         * precedence operators in the recursive call), and execute the
-         * operation. */
-        if (oprec < prec) break;
-        *p += len;
-        double b = picolExpr(i,p,err,oprec+1);
-        switch(op) {
-        case '+': a += b; break; case '-': a -= b; break;
-        case '*': a *= b; break; case '/': a /= b; break;
-        case '<': a = a < b; break; case '>': a = a > b; break;
-        case 'L': a = a <= b; break; case 'G': a = a >= b; break;
-        case 'E': a = a == b; break; case 'N': a = a != b; break;
-        case 'o': a = a || b; break; case 'a': a = a && b; break;
-        }
-        while (**p && strchr(" \t\r\n", **p)) (*p)++;
-    }
-    i->level--;
-    return a;
-}
-
-/* Trick: wrap 's' as "expr <s>" and evaluate it, so that picolEval handles
- * $var and [cmd] substitution before expr parses pure math expression.
- * This is used in [if] and [while] condition evaluation. */
-int picolExprExpansion(struct picolInterp *i, char *s) {
-    int len = strlen(s);
-    char *e = xmalloc(len+6); /* "expr " + s + \0 */
-    memcpy(e,"expr ",5);
-    memcpy(e+5,s,len+1);
-    int retcode = picolEval(i,e);
-    free(e);
-    return retcode;
+/* Truth value of an object, like strtod() would do with its string. */
+int picolIsTrue(struct picolObj *o) {
+    double d;
+    if (picolGetDouble(o,&d) == PICOL_OK) return d != 0;
+    return strtod(picolGetString(o),NULL) != 0;
 }
 
 /* =============================================================================
- * Standard library of commands
+ * Lists
  * ========================================================================== */
 
-int picolArityErr(struct picolInterp *i, char *name) {
-    char buf[1024];
-    snprintf(buf,sizeof(buf),"Wrong number of args for %s",name);
-    picolSetResult(i,buf);
-    return PICOL_ERR;
+void picolFreeDict(struct picolDict *d);
+
+/* Free the elements of the list or dict 'o', if it is one, turning it into
+ * a plain string. The string must be valid. */
+void picolFreeIntRep(struct picolObj *o) {
+    if (o->type == PICOL_OBJ_DICT) {
+        picolFreeDict(o->dict);
+        o->type = PICOL_OBJ_STRING;
+    }
+    if (o->type != PICOL_OBJ_LIST) return;
+    for (int j = 0; j < o->list->len; j++) picolDecrRefCount(o->list->elem[j]);
+    xfree(o->list->elem);
+    picolFreeSmall(o->list,sizeof(struct picolList));
+    o->type = PICOL_OBJ_STRING;
 }
 
-/* expr a + b * c ... (no var or command expansions! Don't quote expressions) */
-int picolCommandExpr(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
-    char buf[64]; int err = 0, j, len = 0;
-    if (argc < 2) return picolArityErr(i,argv[0]);
-    for (j = 1; j < argc; j++) len += strlen(argv[j]) + 1;
-    char *expr = xmalloc(len), *p = expr;
-    for (j = 1; j < argc; j++) {
-        int l = strlen(argv[j]);
-        if (j > 1) *p++ = ' ';
-        memcpy(p,argv[j],l); p += l;
-    }
-    *p = '\0'; p = expr;
-    double v = picolExpr(i,&p,&err,0);
-    while (*p == ' ') p++;
-    if (*p != '\0') err = 1;
-    free(expr);
-    if (err) { picolSetResult(i,"Error in expression"); return PICOL_ERR; }
-    snprintf(buf,sizeof(buf),"%.12g",v);
-    picolSetResult(i,buf); return PICOL_OK;
+/* Free the string of the list 'o', after its elements were modified. */
+void picolInvalidateString(struct picolObj *o) {
+    if (o->str == NULL) return;
+    picolFreeString(o);
+    o->str = NULL;
+    o->len = o->size = 0;
 }
 
-/* set var ?value? */
-int picolCommandSet(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
-    if (argc == 3) {
-        picolSetVar(i,argv[1],argv[2]);
-        picolSetResult(i,argv[2]);
-    } else if (argc == 2) {
-        struct picolVar *v = picolGetVar(i,argv[1]);
-        if (v == NULL) {
-            char buf[1024];
-            snprintf(buf,sizeof(buf),
-                "Can't read \"%s\": no such variable",argv[1]);
-            picolSetResult(i,buf);
-            return PICOL_ERR;
-        } else {
-            picolSetResult(i,v->val);
-        }
-    } else {
-        return picolArityErr(i,argv[0]);
+/* Add 'e' at the end of 'l', that takes a reference to it. The capacity
+ * grows geometrically. */
+void picolListPush(struct picolList *l, struct picolObj *e) {
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap*2 : 4;
+        l->elem = xrealloc(l->elem,sizeof(struct picolObj*)*l->cap);
+        picolMemTag(l->elem,PICOL_MEM_VALUES);
     }
-    return PICOL_OK;
+    picolIncrRefCount(e);
+    l->elem[l->len++] = e;
 }
 
-/* puts ?-nonewline? string */
-int picolCommandPuts(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
-    int nonl = (argc == 3 && !strcmp(argv[1],"-nonewline"));
-    if (argc != 2 && !nonl) return picolArityErr(i,argv[0]);
-    printf("%s%s", argv[nonl?2:1], nonl ? "" : "\n");
-    return PICOL_OK;
+/* Create a list object with the 'len' elements at 'elem'. */
+struct picolObj *picolNewListObj(int len, struct picolObj **elem) {
+    struct picolObj *o = picolNewDoubleObj(0);
+    o->type = PICOL_OBJ_LIST;
+    o->list = picolAllocSmall(sizeof(struct picolList));
+    picolMemTag(o->list,PICOL_MEM_VALUES);
+    o->list->len = o->list->cap = 0;
+    o->list->elem = NULL;
+    for (int j = 0; j < len; j++) picolListPush(o->list,elem[j]);
+    return o;
 }
 
-/* if cond body ?elseif cond body ...? ?else body? */
+/* Return the elements of 'o', parsing its string the first time. Elements
+ * are separated by spaces, and like in scripts they can be grouped with
+ * braces, where nothing is processed (see picolParseBrace()), or with
+ * quotes, where escapes are processed. Parsing never fails. */
+struct picolList *picolGetList(struct picolObj *o) {
+    if (o->type == PICOL_OBJ_LIST) return o->list;
+    char *p = picolGetString(o), *end = p+o->len;
+    picolFreeIntRep(o); // The dict it was, if any, is lost.
+    struct picolList *l = picolAllocSmall(sizeof(*l));
+    picolMemTag(l,PICOL_MEM_VALUES);
+    l->len = l->cap = 0;
+    l->elem = NULL;
+    while(1) {
+        struct picolObj *e;
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            p++;
+        if (p == end) break;
+        if (*p == '{') {
+            struct picolParser parser;
+            parser.p = p;
+            parser.len = end-p;
+            picolParseBrace(&parser);
+            e = picolNewStringObj(parser.start,parser.end-parser.start+1);
+            p = parser.p;
+        } else {
+            int quoted = *p == '"';
+            char *start = p += quoted;
+            while(p < end) {
+                if (*p == '\\' && p+1 < end) p++;
+                else if (quoted ? *p == '"' : (*p == ' ' || *p == '\t' ||
+                                              *p == '\n' || *p == '\r')) break;
+                p++;
+            }
+            e = picolNewStringObj(start,p-start);
+            if (memchr(e->str,'\\',e->len)) {
+                picolProcessEscapes(e->str);
+                e->len = strlen(e->str);
+            }
+            if (quoted && p < end) p++;
+        }
+        picolListPush(l,e);
+    }
+    o->type = PICOL_OBJ_LIST; // The number it was, if any, is lost.
+    o->list = l;
+    return l;
+}
+
+/* How the list element 's' must be quoted: 0 if not at all, 1 if with
+ * braces, 2 with backslashes, when braces are unbalanced. */
+int picolListQuoting(const char *s, int len) {
+    int level = 0, quote = (len == 0 || s[0] == '#');
+    for (int j = 0; j < len; j++) {
+        switch(s[j]) {
+        case '{': level++; quote = 1; break;
+        case '}': if (--level < 0) return 2; quote = 1; break;
+        case '\\': if (j == len-1) return 2; j++; quote = 1; break;
+        case ' ': case '\t': case '\n': case '\r': case '"': case '$':
+        case '[': case ']': case ';': quote = 1; break;
+        }
+    }
+    return level ? 2 : quote;
+}
+
+/* Set the string of 'o' to the list of the elements of 'l'. */
+void picolFormatList(struct picolObj *o, struct picolList *l) {
+    int size = 1, j, k;
+    for (j = 0; j < l->len; j++) {
+        picolGetString(l->elem[j]);
+        size += l->elem[j]->len*2+3;
+    }
+    char *p = o->str = picolAllocSmall(size);
+    picolMemTag(p,PICOL_MEM_VALUES);
+    o->size = size;
+    for (j = 0; j < l->len; j++) {
+        struct picolObj *e = l->elem[j];
+        int quote = picolListQuoting(e->str,e->len);
+        if (j) *p++ = ' ';
+        if (quote == 1) *p++ = '{';
+        for (k = 0; k < e->len; k++) {
+            char c = e->str[k];
+            if (quote == 2 && c && strchr(" \t\n\r{}\"\\$[];#",c)) {
+                *p++ = '\\';
+                if (c == '\n') c = 'n';
+                else if (c == '\t') c = 't';
+                else if (c == '\r') c = 'r';
+            }
+            *p++ = c;
+        }
+        if (quote == 1) *p++ = '}';
+    }
+    *p = '\0';
+    o->len = p-o->str;
+}
+
+/* Create the string of the list 'o' from its elements. */
+void picolUpdateListString(struct picolObj *o) {
+    picolFormatList(o,o->list);
+}
+
+/* =============================================================================
+ * Dicts
+ * ========================================================================== */
+
+#define PICOL_DICT_MIN_SIZE 8
+#define PICOL_DICT_REHASH_STEP 16 /* Slots of the old table moved per access. */
+
+unsigned int picolHashString(const char *s);
+
+/* Stored in the slots of deleted entries, and of the entries already moved
+ * to the new table, so that lookups don't stop there. */
+struct picolDictEntry picolDictTombstone;
+
+struct picolDict *picolNewDict(void) {
+    struct picolDict *d = picolAllocSmall(sizeof(*d));
+    picolMemTag(d,PICOL_MEM_VALUES);
+    memset(d,0,sizeof(*d));
+    d->rehashidx = -1;
+    return d;
+}
+
+void picolInitDictTable(struct picolDictTable *t, unsigned int size) {
+    t->slot = xcalloc(size,sizeof(struct picolDictEntry*));
+    picolMemTag(t->slot,PICOL_MEM_VALUES);
+    t->size = size;
+    t->used = 0;
+}
+
+/* Store 'e' in the first free slot of its probe sequence. */
+void picolDictTableAdd(struct picolDictTable *t, struct picolDictEntry *e) {
+    unsigned int mask = t->size-1, j = e->hash & mask;
+    while(t->slot[j] && t->slot[j] != &picolDictTombstone) j = (j+1) & mask;
+    if (t->slot[j] == NULL) t->used++;
+    t->slot[j] = e;
+}
+
+/* Return the slot of 't' holding the entry with the given key, or NULL.
+ * Tables are never full, since 'used' counts tombstones too. */
+struct picolDictEntry **picolDictTableFind(struct picolDictTable *t, const char *key, int len, unsigned int h) {
+    if (t->size == 0) return NULL;
+    unsigned int mask = t->size-1, j = h & mask;
+    while(t->slot[j]) {
+        struct picolDictEntry *e = t->slot[j];
+        if (e != &picolDictTombstone && e->hash == h && e->key->len == len &&
+            memcmp(e->key->str,key,len) == 0) return t->slot+j;
+        j = (j+1) & mask;
+    }
+    return NULL;
+}
+
+/* Start moving the entries to a new table, with room for twice the
+ * entries. If the previous rehashing is still in progress, that happens
+ * only after many deletions, all the entries are added to a single new
+ * table at once. */
+void picolDictGrow(struct picolDict *d) {
+    unsigned int size = PICOL_DICT_MIN_SIZE;
+    while(size < (unsigned int)(d->len+1)*2) size *= 2;
+    if (d->rehashidx != -1) {
+        xfree(d->t[0].slot);
+        xfree(d->t[1].slot);
+        memset(d->t+1,0,sizeof(d->t[1]));
+        picolInitDictTable(d->t,size);
+        for (struct picolDictEntry *e = d->head; e; e = e->next)
+            picolDictTableAdd(d->t,e);
+        d->rehashidx = -1;
+    } else if (d->t[0].size == 0) {
+        picolInitDictTable(d->t,size);
+    } else {
+        picolInitDictTable(d->t+1,size);
+        d->rehashidx = 0;
+    }
+}
+
+/* Move the next few slots of the old table to the new one, if the dict is
+ * being rehashed. Called at every access, so a table of N entries is moved
+ * in N/PICOL_DICT_REHASH_STEP operations, and the new table, twice as big,
+ * can't fill up in the meantime. */
+void picolDictRehashStep(struct picolDict *d) {
+    if (d->rehashidx == -1) return;
+    struct picolDictTable *old = d->t, *new = d->t+1;
+    for (int j = 0; j < PICOL_DICT_REHASH_STEP && d->rehashidx < (int)old->size; j++) {
+        struct picolDictEntry **slot = old->slot+d->rehashidx++;
+        if (*slot == NULL || *slot == &picolDictTombstone) continue;
+        if ((new->used+1)*4 > new->size*3) {
+            picolDictGrow(d);
+            return;
+        }
+        picolDictTableAdd(new,*slot);
+        *slot = &picolDictTombstone;
+    }
+    if (d->rehashidx == (int)old->size) {
+        xfree(old->slot);
+        *old = *new;
+        memset(new,0,sizeof(*new));
+        d->rehashidx = -1;
+    }
+}
+
+struct picolDictEntry **picolDictFind(struct picolDict *d, const char *key, int len, unsigned int h) {
+    picolDictRehashStep(d);
+    struct picolDictEntry **slot = picolDictTableFind(d->t,key,len,h);
+    if (slot == NULL && d->rehashidx != -1) slot = picolDictTableFind(d->t+1,key,len,h);
+    return slot;
+}
+
+/* Return the value of 'key', or NULL if it is not in the dict. */
+struct picolObj *picolDictGet(struct picolDict *d, struct picolObj *key) {
+    char *k = picolGetString(key);
+    struct picolDictEntry **slot = picolDictFind(d,k,key->len,picolHashString(k));
+    return slot ? (*slot)->val : NULL;
+}
+
+/* Set 'key' to 'val', taking references to both. New keys are added at the
+ * end of the insertion order. */
+void picolDictSet(struct picolDict *d, struct picolObj *key, struct picolObj *val) {
+    char *k = picolGetString(key);
+    unsigned int h = picolHashString(k);
+    struct picolDictEntry **slot = picolDictFind(d,k,key->len,h), *e;
+    picolIncrRefCount(val);
+    if (slot) {
+        picolDecrRefCount((*slot)->val);
+        (*slot)->val = val;
+        return;
+    }
+    /* New entries always go in the new table, if there is one. */
+    struct picolDictTable *t = d->t+(d->rehashidx != -1);
+    if ((t->used+1)*4 > t->size*3) {
+        picolDictGrow(d);
+        t = d->t+(d->rehashidx != -1);
+    }
+    e = picolAllocSmall(sizeof(*e));
+    picolMemTag(e,PICOL_MEM_VALUES);
+    e->key = key;
+    picolIncrRefCount(key);
+    e->val = val;
+    e->hash = h;
+    e->prev = d->tail;
+    e->next = NULL;
+    if (d->tail) d->tail->next = e; else d->head = e;
+    d->tail = e;
+    picolDictTableAdd(t,e);
+    d->len++;
+}
+
+/* Remove 'key' from the dict. Returns 0 if it was not there. */
+int picolDictUnset(struct picolDict *d, struct picolObj *key) {
+    char *k = picolGetString(key);
+    struct picolDictEntry **slot = picolDictFind(d,k,key->len,picolHashString(k)), *e;
+    if (slot == NULL) return 0;
+    e = *slot;
+    *slot = &picolDictTombstone;
+    if (e->prev) e->prev->next = e->next; else d->head = e->next;
+    if (e->next) e->next->prev = e->prev; else d->tail = e->prev;
+    picolDecrRefCount(e->key);
+    picolDecrRefCount(e->val);
+    picolFreeSmall(e,sizeof(*e));
+    d->len--;
+    return 1;
+}
+
+void picolFreeDict(struct picolDict *d) {
+    struct picolDictEntry *e = d->head, *next;
+    while(e) {
+        next = e->next;
+        picolDecrRefCount(e->key);
+        picolDecrRefCount(e->val);
+        picolFreeSmall(e,sizeof(*e));
+        e = next;
+    }
+    xfree(d->t[0].slot);
+    xfree(d->t[1].slot);
+    picolFreeSmall(d,sizeof(*d));
+}
+
+/* Move 'e' to the end of the insertion order. */
+void picolDictMoveToEnd(struct picolDict *d, struct picolDictEntry *e) {
+    if (e == d->tail) return;
+    if (e->prev) e->prev->next = e->next; else d->head = e->next;
+    e->next->prev = e->prev;
+    e->prev = d->tail;
+    e->next = NULL;
+    d->tail->next = e;
+    d->tail = e;
+}
+
+/* Create a dict object, empty or with the entries of 'd' if not NULL. */
+struct picolObj *picolNewDictObj(struct picolDict *d) {
+    struct picolObj *o = picolNewDoubleObj(0);
+    o->type = PICOL_OBJ_DICT;
+    o->dict = picolNewDict();
+    for (struct picolDictEntry *e = d ? d->head : NULL; e; e = e->next)
+        picolDictSet(o->dict,e->key,e->val);
+    return o;
+}
+
+/* Create the string of the dict 'o', the list of its keys and values. */
+void picolUpdateDictString(struct picolObj *o) {
+    struct picolList l;
+    int j = 0;
+    l.len = l.cap = o->dict->len*2;
+    l.elem = xmalloc(sizeof(struct picolObj*)*(l.len+1));
+    for (struct picolDictEntry *e = o->dict->head; e; e = e->next) {
+        l.elem[j++] = e->key;
+        l.elem[j++] = e->val;
+    }
+    picolFormatList(o,&l);
+    xfree(l.elem);
+}
+
+/* =============================================================================
+ * Memoization
+ * ========================================================================== */
+
+#define PICOL_MEMO_SIZE 1000 /* Default max results kept by [memoize]. */
+
+struct picolMemo *picolNewMemo(int maxlen) {
+    struct picolMemo *m = picolAllocSmall(sizeof(*m));
+    picolMemTag(m,PICOL_MEM_VALUES);
+    m->cache = picolNewDict();
+    m->maxlen = maxlen;
+    m->hits = m->misses = m->evictions = 0;
+    return m;
+}
+
+void picolFreeMemo(struct picolMemo *m) {
+    if (m == NULL) return;
+    picolFreeDict(m->cache);
+    picolFreeSmall(m,sizeof(*m));
+}
+
+/* Look up the result of the call of the memoized procedure 'cmd' with the
+ * arguments argv[1..argc-1]. Returns the cached result, or NULL setting
+ * *key to the key to pass to picolMemoDone() after the call. Procedures
+ * have a fixed number of arguments, so a single argument is its own key.
+ * Calls with the wrong number of arguments are not looked up, they fail. */
+struct picolObj *picolMemoLookup(struct picolCmd *cmd, int argc, struct picolObj **argv, struct picolObj **key) {
+    struct picolMemo *m = cmd->memo;
+    *key = NULL;
+    if (argc-1 != cmd->code->locals->numargs) return NULL;
+    struct picolObj *k = argc == 2 ? argv[1] : picolNewListObj(argc-1,argv+1);
+    char *s = picolGetString(k);
+    picolIncrRefCount(k);
+    struct picolDictEntry **slot = picolDictFind(m->cache,s,k->len,picolHashString(s));
+    if (slot) {
+        m->hits++;
+        picolDictMoveToEnd(m->cache,*slot);
+        picolDecrRefCount(k);
+        return (*slot)->val;
+    }
+    m->misses++;
+    *key = k;
+    return NULL;
+}
+
+/* Cache 'result' for 'key', after the memoized procedure 'cmd' run 'code'
+ * returning 'retcode'. Nothing is cached on errors, or if the procedure was
+ * redefined meanwhile. The key is released. */
+void picolMemoDone(struct picolCmd *cmd, struct picolCode *code, struct picolObj *key, int retcode, struct picolObj *result) {
+    struct picolMemo *m = cmd->memo;
+    if ((retcode == PICOL_OK || retcode == PICOL_RETURN) && m && cmd->code == code) {
+        if (m->cache->len >= m->maxlen) {
+            picolDictUnset(m->cache,m->cache->head->key);
+            m->evictions++;
+        }
+        picolDictSet(m->cache,key,result);
+    }
+    picolDecrRefCount(key);
+}
+
+/* =============================================================================
+ * Channels
+ * ========================================================================== */
+
+#define PICOL_MAP_MIN (1024*1024) /* Smaller files are read, not mapped. */
+
+void picolInitChannel(struct picolChannel *ch, char *name, int fd, int buffering) {
+    memset(ch,0,sizeof(*ch));
+    ch->name = xstrdup(name);
+    picolMemTag(ch->name,PICOL_MEM_CHANNELS);
+    ch->fd = fd;
+    ch->size = PICOL_CHANNEL_BUFSIZE;
+    ch->buffering = buffering;
+    ch->access = PICOL_READABLE|PICOL_WRITABLE;
+    ch->slot = -1;
+}
+
+/* Pass 'len' bytes to the destination of the channel, without buffering.
+ * Returns PICOL_ERR, with errno set, if the write failed. */
+int picolWriteChannelRaw(struct picolChannel *ch, const char *s, int len) {
+    if (len == 0) return PICOL_OK;
+    if (ch->handler) {
+        ch->handler(ch->privdata,s,len);
+    } else if (ch->fp) {
+        if (fwrite(s,1,len,ch->fp) != (size_t)len || fflush(ch->fp) == EOF)
+            return PICOL_ERR;
+    } else {
+        while(len) {
+            ssize_t n = write(ch->fd,s,len);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) return PICOL_ERR;
+            s += n;
+            len -= n;
+        }
+    }
+    return PICOL_OK;
+}
+
+/* Write the buffered output. Non blocking channels write what they can,
+ * and keep the rest at the start of the buffer, for the event loop to write
+ * when the channel is writable, see picolWatchChannel(). */
+int picolFlushChannel(struct picolChannel *ch) {
+    if (ch->nonblocking) {
+        int done = 0;
+        while(done < ch->len) {
+            ssize_t n = write(ch->fd,ch->buf+done,ch->len-done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n == -1) {
+                ch->len = 0;
+                return PICOL_ERR;
+            }
+            done += n;
+        }
+        if (done == 0) return PICOL_OK;
+        memmove(ch->buf,ch->buf+done,ch->len-done);
+        ch->len -= done;
+        return PICOL_OK;
+    }
+    int retcode = picolWriteChannelRaw(ch,ch->buf,ch->len);
+    ch->len = 0;
+    return retcode;
+}
+
+/* Forget the input read in advance, moving the file offset back to the
+ * first byte not consumed yet. Sockets and pipes have independent input
+ * and output, so their input is kept. */
+void picolDropInput(struct picolChannel *ch) {
+    if (ch->stream) return;
+    if (ch->rpos != ch->rlen) lseek(ch->fd,ch->rpos-ch->rlen,SEEK_CUR);
+    ch->rpos = ch->rlen = 0;
+}
+
+/* Write 'len' bytes to the channel, buffering them if possible. Returns
+ * PICOL_ERR with errno set if a write failed. */
+int picolWriteChannel(struct picolChannel *ch, const char *s, int len) {
+    picolDropInput(ch); // Write where the reads stopped.
+    if (ch->len+len > ch->size && picolFlushChannel(ch) != PICOL_OK)
+        return PICOL_ERR;
+    if (ch->nonblocking) {
+        /* What can't be written now is buffered anyway. */
+        if (ch->len+len > ch->size) {
+            ch->size = ch->size*2 > ch->len+len ? ch->size*2 : ch->len+len;
+            if (ch->buf) ch->buf = xrealloc(ch->buf,ch->size);
+        }
+    } else if (ch->buffering == PICOL_BUF_NONE || len > ch->size) {
+        return picolWriteChannelRaw(ch,s,len);
+    }
+    if (ch->buf == NULL) {
+        ch->buf = xmalloc(ch->size);
+        picolMemTag(ch->buf,PICOL_MEM_CHANNELS);
+    }
+    memcpy(ch->buf+ch->len,s,len);
+    ch->len += len;
+    if (ch->buffering == PICOL_BUF_NONE ||
+        (ch->buffering == PICOL_BUF_LINE && memchr(s,'\n',len)))
+        return picolFlushChannel(ch);
+    return PICOL_OK;
+}
+
+/* Read more input after the unread bytes, that are moved at the start of
+ * the buffer first. The buffer doubles when full, so it can hold lines of
+ * any length. Returns the bytes read, 0 at the end of file, or -1 on
+ * errors, with errno set, or if a non blocking channel has no input now,
+ * setting ch->blocked. Pending output is written first. */
+int picolFillChannel(struct picolChannel *ch) {
+    ssize_t n;
+    if (picolFlushChannel(ch) != PICOL_OK) return -1;
+    if (ch->rpos) {
+        memmove(ch->rbuf,ch->rbuf+ch->rpos,ch->rlen-ch->rpos);
+        ch->rlen -= ch->rpos;
+        ch->rpos = 0;
+    }
+    if (ch->rlen == ch->rsize) {
+        if (ch->rsize > INT_MAX/2) {
+            errno = EFBIG;
+            return -1;
+        }
+        ch->rsize = ch->rsize ? ch->rsize*2 : ch->size;
+        ch->rbuf = xrealloc(ch->rbuf,ch->rsize);
+        picolMemTag(ch->rbuf,PICOL_MEM_CHANNELS);
+    }
+    do {
+        n = read(ch->fd,ch->rbuf+ch->rlen,ch->rsize-ch->rlen);
+    } while(n == -1 && errno == EINTR);
+    if (n > 0) ch->rlen += n;
+    if (n != -1) ch->eof = n == 0;
+    ch->blocked = n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    return n;
+}
+
+/* Return the next line of the channel, without the newline, setting *len.
+ * The line is not copied: it points inside the input buffer, and it is
+ * valid until the next read. The last line may lack the newline. Returns
+ * NULL at the end of file, or on errors, with errno set, or if only part
+ * of a line arrived on a non blocking channel, see picolFillChannel(). */
+char *picolReadLine(struct picolChannel *ch, int *len) {
+    int scanned = 0; // Bytes already searched for the newline.
+    errno = 0;
+    while(1) {
+        char *line = ch->rbuf+ch->rpos, *nl = NULL;
+        int avail = ch->rlen-ch->rpos, n;
+        if (avail > scanned) nl = memchr(line+scanned,'\n',avail-scanned);
+        if (nl) {
+            *len = nl-line;
+            ch->rpos += *len+1;
+            return line;
+        }
+        scanned = avail;
+        if ((n = picolFillChannel(ch)) == -1) return NULL;
+        if (n == 0) {
+            if (avail == 0) return NULL;
+            *len = avail;
+            ch->rpos = ch->rlen;
+            return ch->rbuf;
+        }
+    }
+}
+
+/* Return the rest of the file of the channel as a string object that is the
+ * file itself mapped in memory, not a copy, or NULL if the file can't be
+ * mapped: it is not a regular file, or it is too small or too big, or some
+ * input was already buffered. The mapping is private, so the string can be
+ * modified without changing the file, and it is followed by an anonymous
+ * page, so the string is null terminated. Like with any mapping, changes
+ * made to the file meanwhile by others may show up in the string. */
+struct picolObj *picolMapFile(struct picolChannel *ch) {
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    off_t pos;
+    if (ch->rpos != ch->rlen || ch->fp || fstat(ch->fd,&st) == -1 ||
+        !S_ISREG(st.st_mode) || (pos = lseek(ch->fd,0,SEEK_CUR)) == -1 ||
+        st.st_size-pos < PICOL_MAP_MIN || st.st_size-pos > INT_MAX-2*page)
+        return NULL;
+    off_t start = pos & ~(off_t)(page-1);
+    size_t maplen = st.st_size-start+1;
+    char *base = mmap(NULL,maplen,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (base == MAP_FAILED) return NULL;
+    if (mmap(base,maplen-1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,ch->fd,start) == MAP_FAILED) {
+        munmap(base,maplen);
+        return NULL;
+    }
+    madvise(base,maplen,MADV_SEQUENTIAL);
+    struct picolObj *o = picolNewDoubleObj(0);
+    o->type = PICOL_OBJ_STRING;
+    o->str = base+(pos-start);
+    o->len = st.st_size-pos;
+    o->size = -(int)maplen;
+    lseek(ch->fd,st.st_size,SEEK_SET);
+    ch->eof = 1;
+    return o;
+}
+
+/* Return the rest of the input of the channel as a string object, or NULL
+ * on errors, with errno set. Non blocking channels return the input that
+ * arrived so far. Large files are mapped, see picolMapFile(), otherwise
+ * the input buffer itself becomes the string when it is mostly used, so
+ * it is not copied either. */
+struct picolObj *picolReadAll(struct picolChannel *ch) {
+    struct picolObj *o = picolMapFile(ch);
+    int n;
+    if (o) return o;
+    while((n = picolFillChannel(ch)) > 0);
+    if (n == -1 && !ch->blocked) return NULL;
+    if (ch->rlen < ch->rsize/4) {
+        o = picolNewStringObj(ch->rbuf,ch->rlen);
+        ch->rpos = ch->rlen = 0;
+        return o;
+    }
+    if (ch->rlen == ch->rsize) ch->rbuf = xrealloc(ch->rbuf,++ch->rsize);
+    o = picolNewDoubleObj(0);
+    o->type = PICOL_OBJ_STRING;
+    o->str = ch->rbuf;
+    o->str[ch->rlen] = '\0';
+    o->len = ch->rlen;
+    o->size = ch->rsize;
+    ch->rbuf = NULL;
+    ch->rpos = ch->rlen = ch->rsize = 0;
+    return o;
+}
+
+/* Make the channel blocking or not. Non blocking channels write all their
+ * pending output before blocking again. Returns PICOL_ERR with errno set
+ * on errors. */
+int picolSetChannelBlocking(struct picolChannel *ch, int blocking) {
+    int flags = fcntl(ch->fd,F_GETFL);
+    if (flags == -1) return PICOL_ERR;
+    flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+    if (fcntl(ch->fd,F_SETFL,flags) == -1) return PICOL_ERR;
+    ch->nonblocking = !blocking;
+    return blocking ? picolFlushChannel(ch) : PICOL_OK;
+}
+
+/* Free the buffers of the channel, flushing it first. The file is not
+ * closed. */
+void picolFreeChannel(struct picolChannel *ch) {
+    picolFlushChannel(ch);
+    xfree(ch->buf);
+    xfree(ch->rbuf);
+    xfree(ch->name);
+}
+
+/* Set the size of the channel buffer, flushing it. */
+void picolSetChannelBufferSize(struct picolChannel *ch, int size) {
+    picolFlushChannel(ch);
+    if (ch->len) {
+        /* Output that a non blocking channel could not write yet. */
+        if (size < ch->len) size = ch->len;
+        ch->buf = xrealloc(ch->buf,size);
+    } else {
+        xfree(ch->buf);
+        ch->buf = NULL;
+    }
+    ch->size = size;
+}
+
+/* Send the output of [puts] to 'handler', called with 'privdata', the
+ * output and its length, instead of stdout. A NULL handler restores
+ * stdout. Pending output goes to the previous destination first. */
+void picolSetOutputHandler(struct picolInterp *i, picolOutputFunc handler, void *privdata) {
+    picolFlushChannel(&i->out);
+    i->out.handler = handler;
+    i->out.privdata = privdata;
+}
+
+/* =============================================================================
+ * Script files
+ * ========================================================================== */
+
+/* A script file loaded in memory, see picolLoadSource(). The text is not
+ * null terminated. */
+struct picolSource {
+    char *text;
+    int len;
+    int mapped;     // True if 'text' is mapped with mmap(), not allocated.
+};
+
+/* Load the file 'filename'. Regular files are mapped in memory, so they are
+ * never copied, the others (pipes, terminals, empty /proc files...) are read
+ * into a buffer that grows geometrically. Returns PICOL_ERR with errno set
+ * on errors. */
+int picolLoadSource(struct picolSource *s, char *filename) {
+    struct stat st;
+    size_t len = 0, size = 0;
+    int fd = open(filename,O_RDONLY);
+    s->text = NULL;
+    s->len = s->mapped = 0;
+    if (fd == -1) return PICOL_ERR;
+    if (fstat(fd,&st) == -1) goto err;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (st.st_size > INT_MAX) {
+            errno = EFBIG;
+            goto err;
+        }
+        void *m = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (m != MAP_FAILED) {
+            madvise(m,st.st_size,MADV_SEQUENTIAL);
+            s->text = m;
+            s->len = st.st_size;
+            s->mapped = 1;
+            close(fd);
+            return PICOL_OK;
+        }
+    }
+    while(1) {
+        if (len == size) {
+            if (size > INT_MAX/2) {
+                errno = EFBIG;
+                goto err;
+            }
+            size = size ? size*2 : 65536;
+            s->text = xrealloc(s->text,size);
+        }
+        ssize_t n = read(fd,s->text+len,size-len);
+        if (n == 0) break;
+        if (n == -1 && errno != EINTR) goto err;
+        if (n > 0) len += n;
+    }
+    s->len = len;
+    close(fd);
+    return PICOL_OK;
+
+err:
+    xfree(s->text);
+    s->text = NULL;
+    close(fd);
+    return PICOL_ERR;
+}
+
+void picolFreeSource(struct picolSource *s) {
+    if (s->mapped) munmap(s->text,s->len);
+    else xfree(s->text);
+}
+
+/* =============================================================================
+ * Threads
+ * ========================================================================== */
+
+/* Interpreters share nothing, so every thread can run its own. They talk
+ * by sending each other messages, that are strings copied into a struct
+ * picolMsg, since objects have plain reference counts and can't be shared.
+ * Every interpreter using [thread::...] commands has a struct picolThread
+ * with the mailbox where the messages sent to it are queued. Threads are
+ * found by id in a global table, the only state shared by interpreters. */
+struct picolMsg {
+    _Atomic(struct picolMsg*) next;
+    int len;
+    char data[];
+};
+
+/* Multiple producers single consumer queue, lock free: producers just swap
+ * 'head' with their message and link the previous one to it, the consumer
+ * takes messages from 'tail'. The mutex and the condition are only used to
+ * sleep when the queue is empty, and to wake up the sleeping consumer. */
+struct picolMailbox {
+    _Atomic(struct picolMsg*) head;
+    struct picolMsg *tail;
+    struct picolMsg stub;   // Always in the queue, so that it's never empty.
+    atomic_int waiting;     // True if the consumer is sleeping or about to.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct picolThread {
+    int id;
+    atomic_int refcount;    // Table entry, running thread, senders.
+    pthread_t tid;
+    int started;            // True for threads of [thread::create].
+    char *script;           // Script of the thread.
+    int retcode;            // Return code and result of the script.
+    char *result;
+    struct picolMailbox mbox;
+};
+
+struct {
+    pthread_mutex_t lock;
+    struct picolThread **threads; // Indexed by id, NULL for joined threads.
+    int len;
+} picolThreads = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+void picolMailboxInit(struct picolMailbox *mb) {
+    atomic_store(&mb->stub.next,NULL);
+    atomic_store(&mb->head,&mb->stub);
+    mb->tail = &mb->stub;
+    atomic_store(&mb->waiting,0);
+    pthread_mutex_init(&mb->lock,NULL);
+    pthread_cond_init(&mb->cond,NULL);
+}
+
+void picolMailboxLink(struct picolMailbox *mb, struct picolMsg *m) {
+    atomic_store(&m->next,NULL);
+    struct picolMsg *prev = atomic_exchange(&mb->head,m);
+    atomic_store(&prev->next,m);
+}
+
+/* Queue a message. Any thread can call it. */
+void picolMailboxPut(struct picolMailbox *mb, struct picolMsg *m) {
+    picolMailboxLink(mb,m);
+    if (atomic_load(&mb->waiting)) {
+        pthread_mutex_lock(&mb->lock);
+        pthread_cond_signal(&mb->cond);
+        pthread_mutex_unlock(&mb->lock);
+    }
+}
+
+/* Take the oldest message, or return NULL if there is none. Only the owner
+ * of the mailbox can call it. A message being linked by a producer at the
+ * same time may be missed: the producer wakes up the consumer when done. */
+struct picolMsg *picolMailboxTryGet(struct picolMailbox *mb) {
+    struct picolMsg *tail = mb->tail, *next = atomic_load(&tail->next);
+    if (tail == &mb->stub) {
+        if (next == NULL) return NULL;
+        mb->tail = tail = next;
+        next = atomic_load(&tail->next);
+    }
+    if (next == NULL) {
+        if (tail != atomic_load(&mb->head)) return NULL;
+        picolMailboxLink(mb,&mb->stub); // Leave the stub when tail is taken.
+        next = atomic_load(&tail->next);
+        if (next == NULL) return NULL;
+    }
+    mb->tail = next;
+    return tail;
+}
+
+/* Take the oldest message, sleeping until there is one. */
+struct picolMsg *picolMailboxGet(struct picolMailbox *mb) {
+    struct picolMsg *m = picolMailboxTryGet(mb);
+    if (m) return m;
+    pthread_mutex_lock(&mb->lock);
+    atomic_store(&mb->waiting,1);
+    while((m = picolMailboxTryGet(mb)) == NULL)
+        pthread_cond_wait(&mb->cond,&mb->lock);
+    atomic_store(&mb->waiting,0);
+    pthread_mutex_unlock(&mb->lock);
+    return m;
+}
+
+/* Create a thread structure, and add it to the table. */
+struct picolThread *picolNewThread(char *script) {
+    struct picolThread *t = xmalloc(sizeof(*t));
+    memset(t,0,sizeof(*t));
+    atomic_store(&t->refcount,1);
+    t->script = script ? xstrdup(script) : NULL;
+    picolMailboxInit(&t->mbox);
+    pthread_mutex_lock(&picolThreads.lock);
+    t->id = picolThreads.len;
+    picolThreads.threads = xrealloc(picolThreads.threads,
+        sizeof(struct picolThread*)*(picolThreads.len+1));
+    picolThreads.threads[picolThreads.len++] = t;
+    pthread_mutex_unlock(&picolThreads.lock);
+    return t;
+}
+
+void picolReleaseThread(struct picolThread *t) {
+    if (atomic_fetch_sub(&t->refcount,1) > 1) return;
+    struct picolMsg *m;
+    while((m = picolMailboxTryGet(&t->mbox)) != NULL) xfree(m);
+    pthread_mutex_destroy(&t->mbox.lock);
+    pthread_cond_destroy(&t->mbox.cond);
+    xfree(t->script);
+    xfree(t->result);
+    xfree(t);
+}
+
+/* Return the thread with the given id, with a reference the caller must
+ * release, or NULL if it doesn't exist. */
+struct picolThread *picolFindThread(int id) {
+    struct picolThread *t = NULL;
+    pthread_mutex_lock(&picolThreads.lock);
+    if (id >= 0 && id < picolThreads.len && (t = picolThreads.threads[id]))
+        atomic_fetch_add(&t->refcount,1);
+    pthread_mutex_unlock(&picolThreads.lock);
+    return t;
+}
+
+/* Remove the thread from the table, releasing the table reference. */
+void picolRemoveThread(struct picolThread *t) {
+    pthread_mutex_lock(&picolThreads.lock);
+    picolThreads.threads[t->id] = NULL;
+    pthread_mutex_unlock(&picolThreads.lock);
+    picolReleaseThread(t);
+}
+
+/* Send a copy of 'len' bytes at 's' to the thread. */
+void picolThreadSend(struct picolThread *t, const char *s, int len) {
+    struct picolMsg *m = xmalloc(sizeof(*m)+len+1);
+    m->len = len;
+    memcpy(m->data,s,len);
+    m->data[len] = '\0';
+    picolMailboxPut(&t->mbox,m);
+}
+
+/* [pmap] runs a procedure on the elements of a list in a pool of worker
+ * threads, each with its own interpreter, created the first time and kept
+ * by the calling interpreter. Workers copy the procedures of the caller
+ * when it has defined new ones since the previous [pmap].
+ *
+ * Elements are scheduled with work stealing: every worker starts with a
+ * contiguous range of indexes, and takes 'grain' of them at a time from
+ * its start. A worker with an empty range steals the second half of the
+ * range of another one. The range is a single atomic word, with the first
+ * index in the low 32 bits and the end in the high ones, so owner and
+ * thieves just compare and swap it. */
+#define PICOL_PMAP_MAX_THREADS 256
+#define PICOL_PMAP_GRAINS 16 /* Grains per worker, less means less stealing. */
+
+#define picolRange(lo,hi) ((unsigned long long)(hi) << 32 | (unsigned)(lo))
+#define picolRangeLo(r) ((int)((r) & 0xffffffff))
+#define picolRangeHi(r) ((int)((r) >> 32))
+
+struct picolPmapWorker {
+    struct picolPmap *pool;
+    int id;
+    pthread_t tid;
+    struct picolInterp *interp; // Created and freed by the worker thread.
+    int cmdepoch;               // Caller command epoch of the copied procs.
+    int job;                    // Last job seen.
+    _Atomic unsigned long long range; // Indexes left, see picolRange().
+};
+
+struct picolPmap {
+    int numworkers;
+    struct picolPmapWorker *workers[PICOL_PMAP_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int job;                    // Incremented for every [pmap] call.
+    int active, finished;       // Workers used by the job, and done with it.
+    int quit;
+    /* The job. Only read by workers, until they are finished. */
+    struct picolInterp *caller;
+    char *procname;
+    struct picolObj **elem;     // Strings already computed by the caller.
+    struct picolMsg **results;  // Result of every element.
+    int len, grain;
+    atomic_int failed;          // Set on errors, so workers stop early.
+    int errindex;               // First element with an error, and message.
+    struct picolMsg *errmsg;
+};
+
+/* Take the next indexes to process from the range of 'w', setting *lo and
+ * *hi. Returns 0 if the range is empty. */
+int picolPmapTake(struct picolPmapWorker *w, int grain, int *lo, int *hi) {
+    unsigned long long r = atomic_load(&w->range);
+    do {
+        *lo = picolRangeLo(r);
+        *hi = picolRangeHi(r);
+        if (*lo >= *hi) return 0;
+        if (*hi-*lo > grain) *hi = *lo+grain;
+    } while(!atomic_compare_exchange_weak(&w->range,&r,picolRange(*hi,picolRangeHi(r))));
+    return 1;
+}
+
+/* Move the second half of the range of another worker to the empty range
+ * of 'w'. Returns 0 if every range is empty. */
+int picolPmapSteal(struct picolPmapWorker *w) {
+    struct picolPmap *p = w->pool;
+    for (int j = 1; j < p->active; j++) {
+        struct picolPmapWorker *v = p->workers[(w->id+j) % p->active];
+        unsigned long long r = atomic_load(&v->range);
+        int lo, mid, hi;
+        do {
+            lo = picolRangeLo(r);
+            hi = picolRangeHi(r);
+            if (lo >= hi) break;
+            mid = lo+(hi-lo)/2;
+        } while(!atomic_compare_exchange_weak(&v->range,&r,picolRange(lo,mid)));
+        if (lo >= hi) continue;
+        atomic_store(&w->range,picolRange(mid,hi));
+        return 1;
+    }
+    return 0;
+}
+
+/* =============================================================================
+ * Eval and related functions
+ * ========================================================================== */
+
+/* FNV-1a hash function, used for variables, commands and the script cache. */
+unsigned int picolHashString(const char *s) {
+    unsigned int h = 2166136261U;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Create a new call frame on top of the current one. The slots for the
+ * procedure local variables, if any, start unset. Frames are taken from the
+ * pool of the dropped ones when possible, together with their slots. */
+void picolPushCallFrame(struct picolInterp *i, struct picolLocals *locals) {
+    struct picolCallFrame *cf = i->framepool;
+    int n = locals ? locals->numlocals : 0;
+    if (cf) {
+        i->framepool = cf->parent;
+        i->numpooled--;
+    } else {
+        cf = xmalloc(sizeof(*cf));
+        picolMemTag(cf,PICOL_MEM_FRAMES);
+        cf->slots = NULL;
+        cf->numslots = 0;
+    }
+    if (n > cf->numslots) {
+        cf->slots = xrealloc(cf->slots,sizeof(struct picolVar)*n);
+        picolMemTag(cf->slots,PICOL_MEM_FRAMES);
+        cf->numslots = n;
+    }
+    for (int j = 0; j < n; j++) {
+        cf->slots[j].name = locals->names[j];
+        cf->slots[j].val = NULL;
+        cf->slots[j].hash = locals->hashes[j];
+    }
+    cf->locals = locals;
+    if (locals) locals->refcount++;
+    cf->vars = NULL;
+    cf->varslots = cf->numvars = 0;
+    cf->parent = i->callframe;
+    i->callframe = cf;
+}
+
+struct picolInterp *picolInitInterp(void) {
+#ifdef PICOL_MEM_STATS
+    struct picolMemCounters *mem = calloc(1,sizeof(*mem));
+    if (mem == NULL) {
+        fprintf(stderr,"Out of memory calloc(1,%zu)\n", sizeof(*mem));
+        exit(1);
+    }
+    atomic_store(&mem->refs,1);
+    picolMemCurrent = mem;
+#endif
+    struct picolInterp *i = xmalloc(sizeof(*i));
+    i->level = 0;
+    i->maxlevel = PICOL_MAX_LEVEL;
+    i->nesting = 0;
+    i->callframe = NULL;
+    i->framepool = NULL;
+    i->numpooled = 0;
+    picolPushCallFrame(i,NULL);
+    i->rootframe = i->callframe;
+    i->emptyobj = picolNewStringObj("",0);
+    picolIncrRefCount(i->emptyobj);
+    i->result = i->emptyobj;
+    picolIncrRefCount(i->result);
+    i->cmdslots = 64;
+    i->numcmds = 0;
+    i->commands = xmalloc(sizeof(struct picolCmd*)*i->cmdslots);
+    picolMemTag(i->commands,PICOL_MEM_COMMANDS);
+    memset(i->commands,0,sizeof(struct picolCmd*)*i->cmdslots);
+    i->cmdepoch = 0;
+    i->epoch = 0;
+    memset(i->scriptcache,0,sizeof(i->scriptcache));
+    memset(i->exprcache,0,sizeof(i->exprcache));
+    i->stack = NULL;
+    i->sp = i->stacklen = 0;
+    i->arena.first = i->arena.cur = NULL;
+    i->execstack = NULL;
+    i->execdepth = i->execlen = 0;
+    picolInitChannel(&i->in,"stdin",0,PICOL_BUF_LINE);
+    picolInitChannel(&i->out,"stdout",1,
+        isatty(fileno(stdout)) ? PICOL_BUF_LINE : PICOL_BUF_FULL);
+    i->out.fp = stdout;
+    i->in.access = PICOL_READABLE;
+    i->out.access = PICOL_WRITABLE;
+    i->files = NULL;
+    i->numfiles = 0;
+    i->thread = NULL;
+    i->pmap = NULL;
+    i->profiling = 0;
+    i->profile = NULL;
+    i->mem = NULL;
+#ifdef PICOL_MEM_STATS
+    i->mem = mem;
+#endif
+    i->ticks = PICOL_LIMIT_INTERVAL;
+    i->budget = -1;
+    i->deadline = 0;
+    atomic_init(&i->interrupted,0);
+    i->events = NULL;
+    return i;
+}
+
+void picolSetResultObj(struct picolInterp *i, struct picolObj *o) {
+    picolIncrRefCount(o); /* Before the decr: o may be the old result. */
+    picolDecrRefCount(i->result);
+    i->result = o;
+}
+
+void picolSetResult(struct picolInterp *i, char *s) {
+    picolSetResultObj(i,s[0] ? picolNewStringObj(s,-1) : i->emptyobj);
+}
+
+/* Like picolSetResult(), with printf() style formatting. */
+void picolSetResultf(struct picolInterp *i, const char *fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap,fmt);
+    vsnprintf(buf,sizeof(buf),fmt,ap);
+    va_end(ap);
+    picolSetResult(i,buf);
+}
+
+char *picolGetResult(struct picolInterp *i) {
+    return picolGetString(i->result);
+}
+
+/* Return the slot of the frame hash table where the variable with the given
+ * name and hash is stored, or the empty slot where it should be added. */
+struct picolVar **picolVarSlot(struct picolCallFrame *cf, char *name, unsigned int h) {
+    unsigned int mask = cf->varslots-1, j = h & mask;
+    while(cf->vars[j]) {
+        struct picolVar *v = cf->vars[j];
+        if (v->hash == h && strcmp(v->name,name) == 0) break;
+        j = (j+1) & mask;
+    }
+    return cf->vars+j;
+}
+
+/* Lookup 'name' in the frame: first in the local slots, then in the hash
+ * table. Slots are scanned from the end so that if an argument name is
+ * repeated, the last one wins. */
+struct picolVar *picolFindVar(struct picolCallFrame *cf, char *name, unsigned int h) {
+    for (int j = cf->locals ? cf->locals->numlocals-1 : -1; j >= 0; j--) {
+        struct picolVar *v = cf->slots+j;
+        if (v->hash == h && strcmp(v->name,name) == 0) return v;
+    }
+    return cf->varslots ? *picolVarSlot(cf,name,h) : NULL;
+}
+
+/* Return the variable, or NULL if it does not exist (or is an unset local).
+ * Names starting with a capital letter are globals. */
+struct picolVar *picolGetVar(struct picolInterp *i, char *name) {
+    struct picolCallFrame *cf = isupper(name[0]) ? i->rootframe : i->callframe;
+    struct picolVar *v = picolFindVar(cf,name,picolHashString(name));
+    return (v && v->val) ? v : NULL;
+}
+
+/* Double the size of the frame variables table, rehashing the variables. */
+void picolGrowVars(struct picolCallFrame *cf) {
+    struct picolVar **old = cf->vars;
+    int oldslots = cf->varslots, j;
+    cf->varslots = oldslots ? oldslots*2 : 16;
+    cf->vars = xmalloc(sizeof(struct picolVar*)*cf->varslots);
+    picolMemTag(cf->vars,PICOL_MEM_VARS);
+    memset(cf->vars,0,sizeof(struct picolVar*)*cf->varslots);
+    for (j = 0; j < oldslots; j++)
+        if (old[j]) *picolVarSlot(cf,old[j]->name,old[j]->hash) = old[j];
+    xfree(old);
+}
+
+/* Set the variable to the object 'val', that is shared, not copied. */
+void picolSetVarObj(struct picolInterp *i, char *name, struct picolObj *val) {
+    struct picolCallFrame *cf = isupper(name[0]) ? i->rootframe : i->callframe;
+    unsigned int h = picolHashString(name);
+    struct picolVar *v = picolFindVar(cf,name,h);
+    picolIncrRefCount(val);
+    if (v) {
+        if (v->val) picolDecrRefCount(v->val);
+        v->val = val;
+        return;
+    }
+    if ((cf->numvars+1)*2 > cf->varslots) picolGrowVars(cf);
+    v = picolAllocSmall(sizeof(*v));
+    picolMemTag(v,PICOL_MEM_VARS);
+    v->name = picolAllocSmall(strlen(name)+1);
+    picolMemTag(v->name,PICOL_MEM_VARS);
+    strcpy(v->name,name);
+    v->val = val;
+    v->hash = h;
+    *picolVarSlot(cf,name,h) = v;
+    cf->numvars++;
+}
+
+void picolSetVar(struct picolInterp *i, char *name, char *val) {
+    picolSetVarObj(i,name,picolNewStringObj(val,-1));
+}
+
+/* Commands the compiler turns into jumps instead of calls, as long as they
+ * are not redefined: see picolDefineCommand() and picolDeoptimize(). */
+int picolCommandIf(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd);
+int picolCommandWhile(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd);
+int picolCommandRetCodes(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd);
+int picolCommandReturn(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
+int picolCommandSet(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
+int picolCommandExpr(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
+int picolCommandForeach(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
+int picolCommandDict(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd);
+
+void picolReleaseCode(struct picolCode *c);
+
+int picolIsInlinedCommand(struct picolCmd *c) {
+    return c->func == picolCommandIf || c->func == picolCommandWhile ||
+           c->func == picolCommandRetCodes || c->objfunc == picolCommandReturn ||
+           c->objfunc == picolCommandSet || c->objfunc == picolCommandExpr ||
+           c->objfunc == picolCommandForeach || c->objfunc == picolCommandDict;
+}
+
+/* Return the slot of the commands table where the command with the given
+ * name and hash is stored, or the empty slot where it should be added. */
+struct picolCmd **picolCommandSlot(struct picolInterp *i, char *name, unsigned int h) {
+    unsigned int mask = i->cmdslots-1, j = h & mask;
+    while(i->commands[j]) {
+        struct picolCmd *c = i->commands[j];
+        if (c->hash == h && strcmp(c->name,name) == 0) break;
+        j = (j+1) & mask;
+    }
+    return i->commands+j;
+}
+
+struct picolCmd *picolGetCommand(struct picolInterp *i, char *name) {
+    return *picolCommandSlot(i,name,picolHashString(name));
+}
+
+/* Double the size of the commands table, rehashing all the commands. */
+void picolGrowCommands(struct picolInterp *i) {
+    struct picolCmd **old = i->commands;
+    int oldslots = i->cmdslots, j;
+    i->cmdslots *= 2;
+    i->commands = xmalloc(sizeof(struct picolCmd*)*i->cmdslots);
+    picolMemTag(i->commands,PICOL_MEM_COMMANDS);
+    memset(i->commands,0,sizeof(struct picolCmd*)*i->cmdslots);
+    for (j = 0; j < oldslots; j++)
+        if (old[j]) *picolCommandSlot(i,old[j]->name,old[j]->hash) = old[j];
+    xfree(old);
+}
+
+/* Commands are never removed, and a redefinition reuses the same structure,
+ * so pointers to commands stay valid as long as the interpreter exists. */
+void picolDefineCommand(struct picolInterp *i, char *name, picolCmdFunc f, picolObjCmdFunc objf) {
+    unsigned int h = picolHashString(name);
+    struct picolCmd **slot = picolCommandSlot(i,name,h), *c = *slot;
+
+    if (c == NULL) {
+        if ((i->numcmds+1)*2 > i->cmdslots) {
+            picolGrowCommands(i);
+            slot = picolCommandSlot(i,name,h);
+        }
+        c = picolAllocSmall(sizeof(*c));
+        picolMemTag(c,PICOL_MEM_COMMANDS);
+        c->name = xstrdup(name);
+        picolMemTag(c->name,PICOL_MEM_COMMANDS);
+        c->hash = h;
+        c->arglist = NULL;
+        c->body = NULL;
+        c->code = NULL;
+        c->memo = NULL;
+        *slot = c;
+        i->numcmds++;
+    } else {
+        /* Code that inlined this command must be recompiled. */
+        if (picolIsInlinedCommand(c)) i->epoch++;
+        xfree(c->arglist);
+        xfree(c->body);
+        picolReleaseCode(c->code);
+        picolFreeMemo(c->memo);
+        c->arglist = NULL;
+        c->body = NULL;
+        c->code = NULL;
+        c->memo = NULL;
+    }
+    c->func = f;
+    c->objfunc = objf;
+    i->cmdepoch++;
+}
+
+void picolRegisterCommand(struct picolInterp *i, char *name, picolCmdFunc f) {
+    picolDefineCommand(i,name,f,NULL);
+}
+
+void picolRegisterObjCommand(struct picolInterp *i, char *name, picolObjCmdFunc f) {
+    picolDefineCommand(i,name,NULL,f);
+}
+
+/* =============================================================================
+ * Expressions
+ * ========================================================================== */
+
+#define PICOL_EXPR_UNARY_PREC 10
+
+/* Fast path for the common binary operators on integers: stores the result
+ * in *r and returns PICOL_OK, or returns PICOL_ERR if picolMathOp() must
+ * handle the operation. */
+int picolIntMathOp(int op, long long x, long long y, long long *r) {
+    switch(op) {
+    case '+': return __builtin_add_overflow(x,y,r) ? PICOL_ERR : PICOL_OK;
+    case '-': return __builtin_sub_overflow(x,y,r) ? PICOL_ERR : PICOL_OK;
+    case '*': return __builtin_mul_overflow(x,y,r) ? PICOL_ERR : PICOL_OK;
+    case '<': *r = x < y; break; case '>': *r = x > y; break;
+    case 'L': *r = x <= y; break; case 'G': *r = x >= y; break;
+    case 'E': *r = x == y; break; case 'N': *r = x != y; break;
+    case 'o': *r = x || y; break; case 'a': *r = x && y; break;
+    case '&': *r = x & y; break;
+    case '|': *r = x | y; break;
+    case '^': *r = x ^ y; break;
+    default: return PICOL_ERR;
+    }
+    return PICOL_OK;
+}
+
+/* Apply the operator 'op' to the operands, storing the result in 'a'.
+ * Unary operators ('m' for the minus sign, 'n' for the plus sign, that just
+ * takes the number, 'b' that turns it into a boolean, '!' and '~') are
+ * called with 'b' set to NULL. Integer operations overflowing 64 bits are
+ * performed with doubles instead. Returns NULL, or an error message. */
+char *picolMathOp(int op, struct picolNumber *a, struct picolNumber *b) {
+    long long x = a->i, y = b ? b->i : 0, r = 0;
+    double dx = (a->type == PICOL_OBJ_INT) ? a->i : a->d, dy = 0;
+    if (b) dy = (b->type == PICOL_OBJ_INT) ? b->i : b->d;
+
+    if (a->type == PICOL_OBJ_INT && (b == NULL || b->type == PICOL_OBJ_INT)) {
+        if (b && picolIntMathOp(op,x,y,&r) == PICOL_OK) op = 0;
+        switch(op) {
+        case 0: break; // Done by picolIntMathOp().
+        case '+': case '-': case '*': goto fp; // Overflow.
+        case 'm': if (__builtin_sub_overflow(0,x,&r)) goto fp; break;
+        case '/': case '%':
+            if (y == 0) return "Division by zero";
+            if (y == -1) { // LLONG_MIN / -1 does not fit.
+                if (op == '%') r = 0;
+                else if (__builtin_sub_overflow(0,x,&r)) goto fp;
+                break;
+            }
+            r = (op == '/') ? x/y : x%y;
+            /* Like Tcl, round towards negative infinity. */
+            if (x%y != 0 && (x < 0) != (y < 0)) {
+                if (op == '/') r--; else r += y;
+            }
+            break;
+        case 'l': case 'r':
+            if (y < 0) return "Negative shift";
+            if (op == 'r') {
+                r = (y >= 64) ? (x < 0 ? -1 : 0) : x >> y;
+            } else {
+                if (y >= 63) goto fp;
+                r = (long long)((unsigned long long)x << y);
+                if (r >> y != x) goto fp;
+            }
+            break;
+        case '~': r = ~x; break;
+        case 'b': r = x != 0; break; case '!': r = !x; break;
+        default: r = x; break;
+        }
+        a->type = PICOL_OBJ_INT;
+        a->i = r;
+        return NULL;
+    }
+
+    if (strchr("%&|^~lr",op)) return "Error in expression"; // Integers only.
+fp:
+    a->type = PICOL_OBJ_DOUBLE;
+    switch(op) {
+    case '+': a->d = dx + dy; break; case '-': a->d = dx - dy; break;
+    case '*': a->d = dx * dy; break; case '/': a->d = dx / dy; break;
+    case 'm': a->d = -dx; break;
+    case 'l': // Overflowing shift of an integer.
+        a->d = dx;
+        for (r = 0; r < y && r < 2000; r++) a->d *= 2;
+        break;
+    case 'n': a->d = dx; break;
+    default:
+        a->type = PICOL_OBJ_INT;
+        switch(op) {
+        case '<': a->i = dx < dy; break; case '>': a->i = dx > dy; break;
+        case 'L': a->i = dx <= dy; break; case 'G': a->i = dx >= dy; break;
+        case 'E': a->i = dx == dy; break; case 'N': a->i = dx != dy; break;
+        case 'o': a->i = dx || dy; break; case 'a': a->i = dx && dy; break;
+        case 'b': a->i = dx != 0; break; case '!': a->i = !dx; break;
+        }
+    }
+    return NULL;
+}
+
+/* Truth value of a number. */
+int picolNumberIsTrue(struct picolNumber *n) {
+    return (n->type == PICOL_OBJ_INT) ? n->i != 0 : n->d != 0;
+}
+
+/* Parse the binary operator at 'p'. Returns its code, also setting its
+ * precedence and length, or 0 if there is no operator at 'p'. */
+int picolExprOperator(char *p, int *prec, int *len) {
+    *len = 2;
+    if (*p == '|' && *(p+1) == '|') { *prec = 0; return 'o'; }
+    if (*p == '&' && *(p+1) == '&') { *prec = 1; return 'a'; }
+    if (*p == '=' && *(p+1) == '=') { *prec = 5; return 'E'; }
+    if (*p == '!' && *(p+1) == '=') { *prec = 5; return 'N'; }
+    if (*p == '<' && *(p+1) == '=') { *prec = 6; return 'L'; }
+    if (*p == '>' && *(p+1) == '=') { *prec = 6; return 'G'; }
+    if (*p == '<' && *(p+1) == '<') { *prec = 7; return 'l'; }
+    if (*p == '>' && *(p+1) == '>') { *prec = 7; return 'r'; }
+    *len = 1;
+    if (*p == '|') { *prec = 2; return '|'; }
+    if (*p == '^') { *prec = 3; return '^'; }
+    if (*p == '&') { *prec = 4; return '&'; }
+    if (*p == '<' || *p == '>') { *prec = 6; return *p; }
+    if (*p == '+' || *p == '-') { *prec = 8; return *p; }
+    if (*p == '*' || *p == '/' || *p == '%') { *prec = 9; return *p; }
+    return 0;
+}
+
+/* Return the code of the unary operator at 'p', or 0. */
+int picolExprUnaryOperator(char *p) {
+    if (*p == '-') return 'm';
+    if (*p == '+') return 'n';
+    if (*p == '!' || *p == '~') return *p;
+    return 0;
+}
+
+/* Expressions are parsed directly from the arguments of expr, as if they
+ * were joined with spaces. Arguments that are numbers as a whole are taken
+ * as operands without looking at their string, that may not even exist:
+ * this way numbers computed by expr flow into the next expr unformatted. */
+struct picolExprState {
+    struct picolObj **objv;
+    int objc, idx;      // Current argument.
+    char *p;            // Position inside it, NULL if at its start.
+};
+
+/* Skip spaces, moving to the next argument when the current one is over.
+ * If 'text' is false, stops at the start of an argument without getting its
+ * string (st->p is left NULL). Otherwise returns the current position, that
+ * is an empty string at the end of the expression. */
+char *picolExprSkip(struct picolExprState *st, int text) {
+    while (st->idx < st->objc) {
+        if (st->p == NULL) {
+            if (!text) return NULL;
+            st->p = picolGetString(st->objv[st->idx]);
+        }
+        while (*st->p && strchr(" \t\r\n",*st->p)) st->p++;
+        if (*st->p) return st->p;
+        st->idx++;
+        st->p = NULL;
+    }
+    return "";
+}
+
+/* This is a "Pratt style parser" for expressions: precedence is encoded in a
+ * single recursive function. Basically the C call stack replaces the explicit
+ * stack here. The value is stored in 'a', and on errors *err is set to the
+ * error message.
+ *
+ * Precedences, like in C:
+ *  ?: (lowest), 0 ||, 1 &&, 2 |, 3 ^, 4 &, 5 == !=, 6 comparisons,
+ *  7 shifts, 8 add/sub, 9 mul/div/mod, 10 unary.
+ *
+ * Note: picolExpr() only works with arguments that were already substituted
+ * by the caller, like in [expr $a + [foo]]. Expressions containing $vars and
+ * [commands], like [expr {$a + [foo]}], are compiled instead, see
+ * picolParseExprTree(): only that form short circuits && and ||.
+ */
+void picolExpr(struct picolInterp *i, struct picolExprState *st, char **err, int prec, struct picolNumber *a) {
+    char *p, *e;
+    int op;
+
+    a->type = PICOL_OBJ_INT;
+    a->i = 0;
+    if (++i->nesting > PICOL_MAX_RECURSION_LEVEL) {
+        i->nesting--;
+        *err = "Error in expression"; // Instead of the recursion limit. Requires
+        return;                       // a pathological expression anyway.
+    }
+
+    /* Step 1: parse the left operand. */
+    picolExprSkip(st,0);
+    if (st->p == NULL && st->idx < st->objc &&
+        picolGetNumber(st->objv[st->idx],a) == PICOL_OK)
+    {
+        st->idx++; // The whole argument is a number.
+    } else {
+        p = picolExprSkip(st,1);
+        if (*p == '(') {
+            st->p++; picolExpr(i,st,err,0,a);
+            if (*picolExprSkip(st,1) == ')') st->p++;
+            else *err = "Error in expression";
+        } else if ((op = picolExprUnaryOperator(p)) != 0) {
+            st->p++; picolExpr(i,st,err,PICOL_EXPR_UNARY_PREC,a);
+            if (!*err) *err = picolMathOp(op,a,NULL);
+        } else {
+            e = picolScanNumber(p,a);
+            if (e == p) *err = "Error in expression"; else st->p = e;
+        }
+    }
+
+    while (!*err) {
+        /* Step 2: parse the operator */
+        int oprec, len;
+        struct picolNumber b;
+        p = picolExprSkip(st,1);
+        op = picolExprOperator(p,&oprec,&len);
+        if (op == 0) break; // No more operators to consume: \0, ), or syntax error.
+
+        /* Step 3: if the operator has high enough precedence, parse the right
+         * operand with a recursive call (effectively processing higher
+         * precedence operators in the recursive call), and execute the
+         * operation. */
+        if (oprec < prec) break;
+        st->p += len;
+        picolExpr(i,st,err,oprec+1,&b);
+        if (!*err) *err = picolMathOp(op,a,&b);
+    }
+
+    /* Step 4: the ternary operator, that has the lowest precedence. */
+    if (!*err && prec == 0 && *picolExprSkip(st,1) == '?') {
+        struct picolNumber b, c;
+        st->p++;
+        picolExpr(i,st,err,0,&b);
+        if (*picolExprSkip(st,1) == ':') st->p++;
+        else if (!*err) *err = "Error in expression";
+        picolExpr(i,st,err,0,&c);
+        *a = picolNumberIsTrue(a) ? b : c;
+    }
+    i->nesting--;
+}
+
+/* The expressions of [if] and [while] conditions, and the ones evaluated by
+ * picolEvalExpr(), are parsed into a tree instead, with the same grammar.
+ * $var and [cmd] are operands, and they are evaluated at runtime by the
+ * compiled code, that skips the operands not needed by &&, || and ?:.
+ * The ternary operator is a '?' node whose right operand is a ':' node with
+ * the two alternatives. */
+struct picolExprNode *picolNewExprNode(struct picolArena *a, int type, int op, char *str, struct picolExprNode *left, struct picolExprNode *right) {
+    struct picolExprNode *n = picolArenaAlloc(a,sizeof(*n));
+    n->type = type;
+    n->op = op;
+    n->str = str;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+char *picolExprSpaces(char *p) {
+    while (*p && strchr(" \t\r\n",*p)) p++;
+    return p;
+}
+
+/* Parse the expression at *pp, like picolExpr() does, updating *pp. Returns
+ * NULL on syntax errors. The tree is allocated in the arena 'a'. */
+struct picolExprNode *picolParseExprTree(struct picolArena *a, char **pp, int prec, int depth) {
+    struct picolExprNode *n, *arg;
+    char *p = picolExprSpaces(*pp), *e;
+    int op;
+
+    if (depth > PICOL_MAX_RECURSION_LEVEL) return NULL;
+
+    /* Step 1: parse the left operand. */
+    if (*p == '(') {
+        *pp = p+1;
+        if ((n = picolParseExprTree(a,pp,0,depth+1)) == NULL) return NULL;
+        p = picolExprSpaces(*pp);
+        if (*p != ')') return NULL;
+        p++;
+    } else if ((op = picolExprUnaryOperator(p)) != 0) {
+        *pp = p+1;
+        if ((arg = picolParseExprTree(a,pp,PICOL_EXPR_UNARY_PREC,depth+1)) == NULL)
+            return NULL;
+        n = picolNewExprNode(a,EXPR_OP,op,NULL,arg,NULL);
+        p = *pp;
+    } else if (*p == '$' || *p == '[') {
+        struct picolParser parser;
+        picolInitParser(&parser,p,-1);
+        if (*p == '$') picolParseVar(&parser); else picolParseCommand(&parser);
+        /* A lone "$" and unterminated commands are errors. */
+        if (parser.type == PT_STR || (*p == '[' && parser.p-parser.end != 2))
+            return NULL;
+        int len = parser.end-parser.start+1;
+        char *str = picolArenaAlloc(a,len+1);
+        memcpy(str,parser.start,len);
+        str[len] = '\0';
+        n = picolNewExprNode(a,*p == '$' ? EXPR_VAR : EXPR_CMD,0,str,NULL,NULL);
+        p = parser.p;
+    } else {
+        struct picolNumber num;
+        if ((e = picolScanNumber(p,&num)) == p) return NULL;
+        char *str = picolArenaAlloc(a,e-p+1);
+        memcpy(str,p,e-p);
+        str[e-p] = '\0';
+        n = picolNewExprNode(a,EXPR_NUM,0,str,NULL,NULL);
+        p = e;
+    }
+
+    /* Step 2: operators with high enough precedence, see picolExpr(). */
+    while (1) {
+        int oprec, len;
+        p = picolExprSpaces(p);
+        op = picolExprOperator(p,&oprec,&len);
+        if (op == 0 || oprec < prec) break;
+        *pp = p+len;
+        if ((arg = picolParseExprTree(a,pp,oprec+1,depth+1)) == NULL)
+            return NULL;
+        n = picolNewExprNode(a,EXPR_OP,op,NULL,n,arg);
+        p = *pp;
+    }
+
+    /* Step 3: the ternary operator, that has the lowest precedence. */
+    if (prec == 0 && *p == '?') {
+        struct picolExprNode *yes, *no = NULL;
+        *pp = p+1;
+        if ((yes = picolParseExprTree(a,pp,0,depth+1)) != NULL) {
+            p = picolExprSpaces(*pp);
+            if (*p == ':') {
+                *pp = p+1;
+                no = picolParseExprTree(a,pp,0,depth+1);
+            }
+        }
+        if (no == NULL) return NULL;
+        arg = picolNewExprNode(a,EXPR_OP,':',NULL,yes,no);
+        n = picolNewExprNode(a,EXPR_OP,'?',NULL,n,arg);
+        p = *pp;
+    }
+    *pp = p;
+    return n;
+}
+
+/* Parse the whole expression 'text'. Returns NULL on syntax errors. */
+struct picolExprNode *picolParseExpr(struct picolArena *a, char *text) {
+    struct picolExprNode *n = picolParseExprTree(a,&text,0,0);
+    if (n && *picolExprSpaces(text) != '\0') return NULL;
+    return n;
+}
+
+/* =============================================================================
+ * Compiler
+ * ========================================================================== */
+
+struct picolCompiler {
+    struct picolInterp *i;
+    struct picolCode *c;
+    int sp;             // Stack depth at the current point of the code.
+    int nesting;        // Nesting level of [commands] and inlined bodies.
+    int loopdepth;      // Stack depth of the innermost inlined loop, or -1.
+    struct picolLocals *locals; // Slots assigned so far, NULL outside procs.
+};
+
+void picolEmit(struct picolCompiler *cc, int op) {
+    struct picolCode *c = cc->c;
+    /* The capacity is implicitly the next power of two, like in
+     * picolArenaGrowArray(). */
+    if ((c->len & (c->len-1)) == 0) {
+        c->ops = xrealloc(c->ops,sizeof(int)*(c->len ? c->len*2 : 1));
+        picolMemTag(c->ops,PICOL_MEM_COMMANDS);
+    }
+    c->ops[c->len++] = op;
+}
+
+/* Track the stack usage of the emitted code. */
+void picolAdjustStack(struct picolCompiler *cc, int delta) {
+    cc->sp += delta;
+    if (cc->sp > cc->c->maxstack) cc->c->maxstack = cc->sp;
+}
+
+/* Emit an instruction with its operand. */
+void picolEmitOp(struct picolCompiler *cc, int op, int arg, int stackdelta) {
+    picolEmit(cc,op);
+    picolEmit(cc,arg);
+    picolAdjustStack(cc,stackdelta);
+}
+
+/* Return the local slot of the variable 'name', assigning a new one if
+ * needed, or -1 if the variable must be looked up by name at runtime. */
+int picolLocalSlot(struct picolCompiler *cc, char *name) {
+    struct picolLocals *l = cc->locals;
+    int j;
+    if (l == NULL || isupper(name[0])) return -1;
+    for (j = l->numlocals-1; j >= 0; j--)
+        if (strcmp(l->names[j],name) == 0) return j;
+    l->names = xrealloc(l->names,sizeof(char*)*(l->numlocals+1));
+    l->hashes = xrealloc(l->hashes,sizeof(unsigned int)*(l->numlocals+1));
+    l->names[l->numlocals] = xstrdup(name);
+    l->hashes[l->numlocals] = picolHashString(name);
+    return l->numlocals++;
+}
+
+int picolAddConst(struct picolCompiler *cc, char *s) {
+    struct picolCode *c = cc->c;
+    if ((c->numconsts & (c->numconsts-1)) == 0) {
+        c->consts = xrealloc(c->consts,sizeof(struct picolObj*)*
+                             (c->numconsts ? c->numconsts*2 : 1));
+        picolMemTag(c->consts,PICOL_MEM_COMMANDS);
+    }
+    c->consts[c->numconsts] = picolNewStringObj(s,-1);
+    picolIncrRefCount(c->consts[c->numconsts]);
+    return c->numconsts++;
+}
+
+void picolCompileScript(struct picolCompiler *cc, struct picolScript *s);
+
+/* Compile the script 'text' so that its result is left in the interpreter
+ * result, exactly like picolEval() would do. */
+void picolCompileBody(struct picolCompiler *cc, char *text) {
+    struct picolScript *s = picolParseScript(&cc->i->arena,text);
+    cc->nesting++;
+    picolEmit(cc,OP_CLEARRESULT);
+    picolCompileScript(cc,s);
+    cc->nesting--;
+}
+
+/* Compile the code that pushes the value of the word 'w' on the stack. */
+void picolCompileWord(struct picolCompiler *cc, struct picolWord *w) {
+    int j;
+    for (j = 0; j < w->numparts; j++) {
+        struct picolPart *part = w->parts+j;
+        if (part->type == PT_STR) {
+            picolEmitOp(cc,OP_PUSH,picolAddConst(cc,part->str),1);
+        } else if (part->type == PT_VAR) {
+            int slot = picolLocalSlot(cc,part->str);
+            if (slot != -1) picolEmitOp(cc,OP_LOADLOCAL,slot,1);
+            else picolEmitOp(cc,OP_LOAD,picolAddConst(cc,part->str),1);
+        } else if (cc->nesting >= PICOL_MAX_RECURSION_LEVEL) {
+            picolEmitOp(cc,OP_ERROR,picolAddConst(cc,"Nesting too deep"),1);
+        } else {
+            picolCompileBody(cc,part->str);
+            picolEmit(cc,OP_RESULT);
+            picolAdjustStack(cc,1);
+        }
+    }
+    if (w->numparts > 1) picolEmitOp(cc,OP_CONCAT,w->numparts,1-w->numparts);
+}
+
+/* Return the literal value of the word at index 'j' of the command, or NULL
+ * if it requires substitutions. */
+char *picolLiteralWord(struct picolScriptCmd *sc, int j) {
+    struct picolWord *w = sc->words+j;
+    if (j >= sc->argc || w->numparts != 1 || w->parts[0].type != PT_STR)
+        return NULL;
+    return w->parts[0].str;
+}
+
+/* Compile the code that pushes the value of the expression tree 'n'. */
+void picolCompileExprNode(struct picolCompiler *cc, struct picolExprNode *n) {
+    if (n->type == EXPR_NUM) {
+        picolEmitOp(cc,OP_PUSH,picolAddConst(cc,n->str),1);
+    } else if (n->type == EXPR_VAR || n->type == EXPR_CMD) {
+        /* Compile it exactly like a word made of a single $var or [cmd]. */
+        struct picolPart part = {n->type == EXPR_VAR ? PT_VAR : PT_CMD, n->str};
+        struct picolWord w = {1, &part};
+        picolCompileWord(cc,&w);
+    } else if (n->op == 'a' || n->op == 'o') {
+        /* The right operand is skipped if the left one decides. */
+        picolCompileExprNode(cc,n->left);
+        picolEmitOp(cc,OP_ANDOR,n->op,-1);
+        picolEmit(cc,0);
+        int end = cc->c->len-1;
+        picolCompileExprNode(cc,n->right);
+        picolEmitOp(cc,OP_MATH,'b',0);
+        cc->c->ops[end] = cc->c->len;
+    } else if (n->op == '?') {
+        picolCompileExprNode(cc,n->left);
+        picolEmitOp(cc,OP_POPJUMPFALSE,0,-1);
+        int next = cc->c->len-1;
+        picolCompileExprNode(cc,n->right->left);
+        picolEmitOp(cc,OP_JUMP,0,-1); /* The other branch starts without it. */
+        int end = cc->c->len-1;
+        cc->c->ops[next] = cc->c->len;
+        picolCompileExprNode(cc,n->right->right);
+        cc->c->ops[end] = cc->c->len;
+    } else {
+        picolCompileExprNode(cc,n->left);
+        if (n->right) picolCompileExprNode(cc,n->right);
+        picolEmitOp(cc,OP_MATH,n->op,n->right ? -1 : 0);
+    }
+}
+
+/* Compile the expression 'text' so that its value is left in the interpreter
+ * result, like [expr] would do. Syntax errors are reported at runtime. */
+void picolCompileExpr(struct picolCompiler *cc, char *text) {
+    struct picolExprNode *n = picolParseExpr(&cc->i->arena,text);
+    if (n == NULL) {
+        picolEmitOp(cc,OP_ERROR,picolAddConst(cc,"Error in expression"),1);
+    } else {
+        picolCompileExprNode(cc,n);
+        /* A single operand must be a number too. */
+        if (n->type != EXPR_OP) picolEmitOp(cc,OP_MATH,'n',0);
+    }
+    picolEmit(cc,OP_POPRESULT);
+    picolAdjustStack(cc,-1);
+}
+
+/* Compile an [if] condition, and the jump taken if it is false. Returns the
+ * position of the jump target operand to fix later. */
+int picolCompileCond(struct picolCompiler *cc, char *cond) {
+    picolCompileExpr(cc,cond);
+    picolEmitOp(cc,OP_JUMPFALSE,0,0);
+    return cc->c->len-1;
+}
+
+/* if cond body ?elseif cond body ...? ?else body?, with literal arguments. */
+int picolCompileIf(struct picolCompiler *cc, struct picolScriptCmd *sc) {
+    int j, jumps[sc->argc], numjumps = 0;
+
+    /* Check the syntax first: if it is not valid, the command is called
+     * normally to report the error. */
+    for (j = 1; j < sc->argc; j++) if (!picolLiteralWord(sc,j)) return 0;
+    for (j = 1; j+2 != sc->argc; j += 3) {
+        if (j+1 >= sc->argc) return 0;
+        if (!strcmp(picolLiteralWord(sc,j+2),"else")) {
+            if (j+4 != sc->argc) return 0;
+            break;
+        }
+        if (strcmp(picolLiteralWord(sc,j+2),"elseif")) return 0;
+    }
+
+    for (j = 1; ; j += 3) {
+        int next = picolCompileCond(cc,picolLiteralWord(sc,j));
+        picolCompileBody(cc,picolLiteralWord(sc,j+1));
+        if (j+2 == sc->argc) {
+            cc->c->ops[next] = cc->c->len;
+            break;
+        }
+        picolEmitOp(cc,OP_JUMP,0,0);
+        jumps[numjumps++] = cc->c->len-1;
+        cc->c->ops[next] = cc->c->len;
+        if (!strcmp(picolLiteralWord(sc,j+2),"else")) {
+            picolCompileBody(cc,picolLiteralWord(sc,j+3));
+            break;
+        }
+    }
+    for (j = 0; j < numjumps; j++) cc->c->ops[jumps[j]] = cc->c->len;
+    return 1;
+}
+
+/* while cond body, with literal arguments. The condition is at the end of
+ * the loop, so that every iteration takes a single jump. */
+int picolCompileWhile(struct picolCompiler *cc, struct picolScriptCmd *sc) {
+    char *cond = picolLiteralWord(sc,1), *body = picolLiteralWord(sc,2);
+    struct picolCode *c = cc->c;
+    if (sc->argc != 3 || !cond || !body) return 0;
+
+    int oldloopdepth = cc->loopdepth;
+    picolEmitOp(cc,OP_JUMP,0,0);
+    int condjump = c->len-1;
+    int loop = c->numloops++, start = c->len;
+    c->loops = xrealloc(c->loops,sizeof(struct picolLoop)*c->numloops);
+    picolMemTag(c->loops,PICOL_MEM_COMMANDS);
+    cc->loopdepth = cc->sp;
+    picolCompileBody(cc,body);
+    cc->loopdepth = oldloopdepth;
+    int contpc = c->len;
+    c->ops[condjump] = contpc;
+    picolCompileExpr(cc,cond);
+    picolEmitOp(cc,OP_JUMPTRUE,start,0);
+    c->loops[loop].start = start;
+    c->loops[loop].end = contpc;
+    c->loops[loop].contpc = contpc;
+    c->loops[loop].breakpc = c->len;
+    c->loops[loop].depth = cc->sp;
+    return 1;
+}
+
+/* foreach varList list ?varList list ...? body, and dict for {keyVar
+ * valueVar} dict body, with literal variable lists and body. The words are
+ * pushed like arguments, followed by the count of the iterations done, and
+ * OP_FOREACH, at the end of the loop, sets the variables and jumps to the
+ * body. Returns the position of the op pushing the count, or of the one
+ * taking the items of the dict, where the arguments are all on the stack,
+ * or zero if the command can't be inlined. */
+int picolCompileForeach(struct picolCompiler *cc, struct picolScriptCmd *sc, int isdict) {
+    struct picolCode *c = cc->c;
+    int j, k, start, first = isdict ? 2 : 1, numlists = (sc->argc-1-first)/2;
+    struct picolObj *varlists[numlists > 0 ? numlists : 1];
+    char *body = picolLiteralWord(sc,sc->argc-1);
+
+    if (isdict ? sc->argc != 5 || strcmp(picolLiteralWord(sc,1),"for")
+               : sc->argc < 4 || sc->argc % 2) return 0;
+    for (j = first; j < sc->argc-1; j += 2) if (!picolLiteralWord(sc,j)) return 0;
+    if (!body) return 0;
+    for (j = 0; j < numlists; j++) {
+        varlists[j] = picolNewStringObj(picolLiteralWord(sc,first+j*2),-1);
+        picolIncrRefCount(varlists[j]);
+    }
+    for (j = 0; j < numlists; j++) {
+        int len = picolGetList(varlists[j])->len;
+        if (isdict ? len != 2 : len == 0) break; // Let the command fail.
+    }
+    if (j < numlists) {
+        for (j = 0; j < numlists; j++) picolDecrRefCount(varlists[j]);
+        return 0;
+    }
+
+    for (j = 1; j < sc->argc; j++) picolCompileWord(cc,sc->words+j);
+    if (isdict) picolEmit(cc,OP_DICTITEMS);
+    start = isdict ? c->len-1 : c->len;
+    picolEmitOp(cc,OP_PUSH,picolAddConst(cc,"0"),1);
+    picolEmitOp(cc,OP_JUMP,0,0);
+    int condjump = c->len-1, oldloopdepth = cc->loopdepth;
+    int loop = c->numloops++, bodypc = c->len;
+    c->loops = xrealloc(c->loops,sizeof(struct picolLoop)*c->numloops);
+    picolMemTag(c->loops,PICOL_MEM_COMMANDS);
+    cc->loopdepth = cc->sp;
+    picolCompileBody(cc,body);
+    cc->loopdepth = oldloopdepth;
+    int contpc = c->len;
+    c->ops[condjump] = contpc;
+    picolEmitOp(cc,OP_FOREACH,bodypc,0);
+    picolEmit(cc,numlists);
+    for (j = 0; j < numlists; j++) {
+        struct picolList *vars = picolGetList(varlists[j]);
+        picolEmit(cc,vars->len);
+        for (k = 0; k < vars->len; k++) {
+            char *name = picolGetString(vars->elem[k]);
+            int slot = picolLocalSlot(cc,name);
+            picolEmit(cc,slot != -1 ? slot : -1-picolAddConst(cc,name));
+        }
+        picolDecrRefCount(varlists[j]);
+    }
+    c->loops[loop].start = bodypc;
+    c->loops[loop].end = contpc;
+    c->loops[loop].contpc = contpc;
+    c->loops[loop].breakpc = c->len;
+    c->loops[loop].depth = cc->sp;
+    picolEmitOp(cc,OP_POP,sc->argc,-sc->argc);
+    picolEmit(cc,OP_CLEARRESULT);
+    return start;
+}
+
+/* Compile the command 'sc' into the code of 'cmd', that is one of the
+ * commands picolIsInlinedCommand() accepts, if the arguments allow it, and
+ * set the fields of 'in' that tell how to call it instead. Otherwise
+ * nothing is emitted and zero is returned. */
+int picolCompileInlined(struct picolCompiler *cc, struct picolCmd *cmd, struct picolScriptCmd *sc, struct picolInlined *in) {
+    struct picolCode *c = cc->c;
+    in->start = c->len;
+    in->onstack = 0;
+    if (cmd->func == picolCommandIf) return picolCompileIf(cc,sc);
+    if (cmd->func == picolCommandWhile) return picolCompileWhile(cc,sc);
+    if (cmd->func == picolCommandRetCodes && sc->argc == 1 &&
+        cc->loopdepth == cc->sp)
+    {
+        picolEmit(cc,!strcmp(picolLiteralWord(sc,0),"break") ? OP_BREAK : OP_CONTINUE);
+        return 1;
+    }
+    /* The code computing the value of [set] and [return] may have inlined
+     * commands too, so only the final op, that takes it, is replaced. */
+    if (cmd->objfunc == picolCommandSet && sc->argc == 3 &&
+        picolLiteralWord(sc,1))
+    {
+        int slot = picolLocalSlot(cc,picolLiteralWord(sc,1));
+        picolCompileWord(cc,sc->words+2);
+        in->start = c->len;
+        in->onstack = 1;
+        if (slot != -1) picolEmitOp(cc,OP_STORELOCAL,slot,-1);
+        else picolEmitOp(cc,OP_STORE,picolAddConst(cc,picolLiteralWord(sc,1)),-1);
+        return 1;
+    }
+    if (cmd->objfunc == picolCommandExpr && sc->argc == 2 &&
+        picolLiteralWord(sc,1))
+    {
+        picolCompileExpr(cc,picolLiteralWord(sc,1));
+        return 1;
+    }
+    if (cmd->objfunc == picolCommandReturn && sc->argc <= 2) {
+        if (sc->argc == 2) picolCompileWord(cc,sc->words+1);
+        in->start = c->len;
+        in->onstack = sc->argc-1;
+        picolEmitOp(cc,OP_RETURN,sc->argc == 2,-(sc->argc-1));
+        return 1;
+    }
+    if (cmd->objfunc == picolCommandForeach ||
+        (cmd->objfunc == picolCommandDict && picolLiteralWord(sc,1)))
+    {
+        int start = picolCompileForeach(cc,sc,cmd->objfunc == picolCommandDict);
+        if (start == 0) return 0;
+        in->start = start;
+        in->onstack = sc->argc-1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Remember the inlined command 'in' compiled from 'sc', that ends here.
+ * The ones nested in it were added meanwhile, and the entries are kept
+ * sorted by start. */
+void picolAddInlined(struct picolCompiler *cc, struct picolScriptCmd *sc, struct picolInlined *in) {
+    struct picolCode *c = cc->c;
+    int j;
+    in->end = c->len;
+    in->args = c->numconsts;
+    in->numargs = sc->argc-1-in->onstack;
+    if (in->cmd->objfunc == picolCommandSet && c->ops[in->start] == OP_STORE)
+        in->args = c->ops[in->start+1]; // The name is there already.
+    else for (j = 1; j <= in->numargs; j++) picolAddConst(cc,picolLiteralWord(sc,j));
+    if ((c->numinlined & (c->numinlined-1)) == 0) {
+        c->inlined = xrealloc(c->inlined,sizeof(*in)*(c->numinlined ? c->numinlined*2 : 1));
+        picolMemTag(c->inlined,PICOL_MEM_COMMANDS);
+    }
+    for (j = c->numinlined++; j > 0 && c->inlined[j-1].start > in->start; j--)
+        c->inlined[j] = c->inlined[j-1];
+    c->inlined[j] = *in;
+}
+
+/* Compile a command. Calls to if, while, foreach, dict for, break, continue
+ * and return are turned into jumps when possible, set into a variable store,
+ * and expr into the code of the expression. Everything else, including
+ * commands whose name is only known at runtime, is compiled into an
+ * OP_INVOKE. */
+void picolCompileCommand(struct picolCompiler *cc, struct picolScriptCmd *sc) {
+    char *name = picolLiteralWord(sc,0);
+    struct picolCmd *cmd = name ? picolGetCommand(cc->i,name) : NULL;
+    struct picolInlined in = {cmd};
+    int j;
+
+    if (cmd && picolIsInlinedCommand(cmd) &&
+        cc->nesting < PICOL_MAX_RECURSION_LEVEL &&
+        picolCompileInlined(cc,cmd,sc,&in))
+    {
+        picolAddInlined(cc,sc,&in);
+        return;
+    }
+    for (j = 0; j < sc->argc; j++) picolCompileWord(cc,sc->words+j);
+    if (name) {
+        struct picolCode *c = cc->c;
+        c->sites = xrealloc(c->sites,sizeof(struct picolCallSite)*(c->numsites+1));
+        picolMemTag(c->sites,PICOL_MEM_COMMANDS);
+        c->sites[c->numsites].cmd = NULL;
+        picolEmitOp(cc,OP_CALL,sc->argc,-sc->argc);
+        picolEmit(cc,c->numsites++);
+    } else {
+        picolEmitOp(cc,OP_INVOKE,sc->argc,-sc->argc);
+    }
+}
+
+void picolCompileScript(struct picolCompiler *cc, struct picolScript *s) {
+    int j;
+    for (j = 0; j < s->numcmds; j++) picolCompileCommand(cc,s->cmds+j);
+}
+
+/* Set up the compiler 'cc' to emit code into a new, empty code object. */
+void picolInitCompiler(struct picolCompiler *cc, struct picolInterp *i, struct picolLocals *locals) {
+    struct picolCode *c = xmalloc(sizeof(*c));
+    picolMemTag(c,PICOL_MEM_COMMANDS);
+    memset(c,0,sizeof(*c));
+    c->refcount = 1;
+    c->epoch = i->epoch;
+    c->locals = locals;
+    cc->i = i;
+    cc->c = c;
+    cc->sp = 0;
+    cc->nesting = 0;
+    cc->loopdepth = -1;
+    cc->locals = locals;
+}
+
+/* Compile the program 'src' into a new code object. When 'locals' is not
+ * NULL, the code is a procedure body, and the local variables it uses are
+ * assigned slots after the arguments already in 'locals'. If 'isexpr' is
+ * true, 'src' is an expression instead, see picolCompileExpr(). */
+struct picolCode *picolCompileCode(struct picolInterp *i, char *src, struct picolLocals *locals, int isexpr) {
+    struct picolCompiler cc;
+    struct picolArenaMark mark = picolArenaMark(&i->arena);
+    picolInitCompiler(&cc,i,locals);
+    cc.c->src = xstrdup(src);
+    picolMemTag(cc.c->src,PICOL_MEM_COMMANDS);
+    cc.c->isexpr = isexpr;
+    if (isexpr) {
+        picolCompileExpr(&cc,src);
+    } else {
+        picolCompileScript(&cc,picolParseScript(&i->arena,src));
+    }
+    picolArenaReset(&i->arena,mark); // Release the parse tree.
+    return cc.c;
+}
+
+/* Compile the next 'maxcmds' commands of the parser 'p', see
+ * picolParseCommands(). The code has no source, so it can't be recompiled
+ * nor cached: it is meant to be executed once, see picolEvalSource(). */
+struct picolCode *picolCompileCommands(struct picolInterp *i, struct picolParser *p, int maxcmds) {
+    struct picolCompiler cc;
+    struct picolArenaMark mark = picolArenaMark(&i->arena);
+    picolInitCompiler(&cc,i,NULL);
+    picolCompileScript(&cc,picolParseCommands(&i->arena,p,maxcmds));
+    picolArenaReset(&i->arena,mark);
+    return cc.c;
+}
+
+struct picolCode *picolCompile(struct picolInterp *i, char *src) {
+    return picolCompileCode(i,src,NULL,0);
+}
+
+/* Compile a procedure body. The arguments take the first local slots. */
+struct picolCode *picolCompileProc(struct picolInterp *i, char *body, int numargs, char **args) {
+    struct picolLocals *l = xmalloc(sizeof(*l));
+    picolMemTag(l,PICOL_MEM_COMMANDS);
+    l->refcount = 1;
+    l->numargs = l->numlocals = numargs;
+    l->globalarg = -1;
+    l->names = xmalloc(sizeof(char*)*(numargs+1));
+    l->hashes = xmalloc(sizeof(unsigned int)*(numargs+1));
+    for (int j = 0; j < numargs; j++) {
+        l->names[j] = xstrdup(args[j]);
+        l->hashes[j] = picolHashString(args[j]);
+        if (isupper(args[j][0]) && l->globalarg == -1) l->globalarg = j;
+    }
+    return picolCompileCode(i,body,l,0);
+}
+
+void picolReleaseLocals(struct picolLocals *l) {
+    if (l == NULL || --l->refcount > 0) return;
+    for (int j = 0; j < l->numlocals; j++) xfree(l->names[j]);
+    xfree(l->names);
+    xfree(l->hashes);
+    xfree(l);
+}
+
+void picolReleaseCode(struct picolCode *c) {
+    int j;
+    if (c == NULL || --c->refcount > 0) return;
+    for (j = 0; j < c->numconsts; j++) picolDecrRefCount(c->consts[j]);
+    xfree(c->consts);
+    xfree(c->ops);
+    xfree(c->loops);
+    xfree(c->sites);
+    xfree(c->inlined);
+    xfree(c->src);
+    picolReleaseLocals(c->locals);
+    xfree(c);
+}
+
+/* Return the code stored at *cp, recompiling it first if commands it
+ * inlined were redefined after it was compiled. */
+struct picolCode *picolValidCode(struct picolInterp *i, struct picolCode **cp) {
+    struct picolCode *old = *cp;
+    if (old->epoch != i->epoch) {
+        *cp = old->locals ?
+            picolCompileProc(i,old->src,old->locals->numargs,old->locals->names) :
+            picolCompileCode(i,old->src,NULL,old->isexpr);
+        picolReleaseCode(old);
+    }
+    return *cp;
+}
+
+/* Called when inlined commands were redefined while the code 'c' runs, and
+ * it can't just be recompiled: the first op of the commands that are no
+ * longer inlined is replaced by OP_DEOPT, that calls them normally, see
+ * picolPushDeoptArgs(). The code is then valid for the current epoch.
+ * Other frames running the same code are fine with that too: they are
+ * either past the start of an inlined command, or have yet to run it, and
+ * must call the new one. */
+void picolDeoptimize(struct picolInterp *i, struct picolCode *c) {
+    for (int j = 0; j < c->numinlined; j++) {
+        struct picolInlined *in = c->inlined+j;
+        if (!picolIsInlinedCommand(in->cmd)) c->ops[in->start] = OP_DEOPT;
+    }
+    c->epoch = i->epoch;
+}
+
+/* Return the inlined command whose code starts at 'pc'. */
+struct picolInlined *picolFindInlined(struct picolCode *c, int pc) {
+    int lo = 0, hi = c->numinlined-1;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (c->inlined[mid].start < pc) lo = mid+1;
+        else hi = mid;
+    }
+    return c->inlined+lo;
+}
+
+/* =============================================================================
+ * Profiler
+ * ========================================================================== */
+
+/* When [profile start] is called, every command call is timed, building a
+ * tree of the call chains seen, where every node has the time spent in the
+ * command itself, and not in the commands it called, for the folded stacks
+ * report. Counters are also kept for every command name: calls, exclusive
+ * time, and inclusive time, that for recursive commands only counts the
+ * outermost call. Calls are only timed when i->profiling is true, so when
+ * the profiler is off it costs a predictable branch per call. */
+struct picolProfCmd {
+    char *name;
+    unsigned int hash;
+    int active;                 // Calls in progress, see above.
+    long long calls;
+    double inclusive, exclusive;    // Nanoseconds.
+};
+
+struct picolProfNode {
+    int cmd;                    // Index in the commands, -1 for the root.
+    int parent, child, next;    // First child and next sibling, or -1.
+    double self;                // Exclusive nanoseconds.
+};
+
+struct picolProfFrame {
+    int node;
+    double start, children;     // Call time, and time spent in callees.
+};
+
+struct picolProfile {
+    struct picolProfCmd *cmds;
+    int numcmds;
+    struct picolProfNode *nodes;    // nodes[0] is the root.
+    int numnodes;
+    struct picolProfFrame *stack;
+    int depth, stacklen;
+};
+
+double picolProfileNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+void picolFreeProfile(struct picolProfile *p) {
+    if (p == NULL) return;
+    for (int j = 0; j < p->numcmds; j++) xfree(p->cmds[j].name);
+    xfree(p->cmds);
+    xfree(p->nodes);
+    xfree(p->stack);
+    xfree(p);
+}
+
+/* Return the node for a call of 'c' from the node 'parent', adding it to
+ * the tree the first time. */
+int picolProfileNode(struct picolProfile *p, int parent, struct picolCmd *c) {
+    int n, j;
+    for (n = p->nodes[parent].child; n != -1; n = p->nodes[n].next) {
+        struct picolProfCmd *pc = p->cmds+p->nodes[n].cmd;
+        if (pc->hash == c->hash && strcmp(pc->name,c->name) == 0) return n;
+    }
+    for (j = 0; j < p->numcmds; j++)
+        if (p->cmds[j].hash == c->hash && strcmp(p->cmds[j].name,c->name) == 0) break;
+    if (j == p->numcmds) {
+        p->cmds = xrealloc(p->cmds,sizeof(struct picolProfCmd)*(p->numcmds+1));
+        memset(p->cmds+j,0,sizeof(struct picolProfCmd));
+        p->cmds[j].name = xstrdup(c->name);
+        p->cmds[j].hash = c->hash;
+        p->numcmds++;
+    }
+    /* Nodes are never removed: grow the array by powers of two. */
+    if ((p->numnodes & (p->numnodes-1)) == 0)
+        p->nodes = xrealloc(p->nodes,sizeof(struct picolProfNode)*p->numnodes*2);
+    n = p->numnodes++;
+    p->nodes[n].cmd = j;
+    p->nodes[n].parent = parent;
+    p->nodes[n].child = -1;
+    p->nodes[n].next = p->nodes[parent].child;
+    p->nodes[n].self = 0;
+    p->nodes[parent].child = n;
+    return n;
+}
+
+/* Start timing a call of 'c'. */
+void picolProfileEnter(struct picolInterp *i, struct picolCmd *c) {
+    struct picolProfile *p = i->profile;
+    int parent = p->depth ? p->stack[p->depth-1].node : 0;
+    int n = picolProfileNode(p,parent,c);
+    if (p->depth == p->stacklen) {
+        p->stacklen = p->stacklen ? p->stacklen*2 : 64;
+        p->stack = xrealloc(p->stack,sizeof(struct picolProfFrame)*p->stacklen);
+    }
+    struct picolProfFrame *f = p->stack+p->depth++;
+    f->node = n;
+    f->children = 0;
+    p->cmds[p->nodes[n].cmd].active++;
+    f->start = picolProfileNow();
+}
+
+/* Stop timing the innermost call. */
+void picolProfileLeave(struct picolInterp *i) {
+    double now = picolProfileNow();
+    struct picolProfile *p = i->profile;
+    if (p->depth == 0) return; // Started after the call, see picolProfileStart().
+    struct picolProfFrame *f = p->stack+(--p->depth);
+    struct picolProfNode *n = p->nodes+f->node;
+    struct picolProfCmd *pc = p->cmds+n->cmd;
+    double elapsed = now-f->start;
+    n->self += elapsed-f->children;
+    pc->calls++;
+    pc->exclusive += elapsed-f->children;
+    if (--pc->active == 0) pc->inclusive += elapsed;
+    if (p->depth) p->stack[p->depth-1].children += elapsed;
+}
+
+/* Drop the previous data, and time the calls from now on. Calls already
+ * in progress are not timed. */
+void picolProfileStart(struct picolInterp *i) {
+    picolFreeProfile(i->profile);
+    struct picolProfile *p = i->profile = xmalloc(sizeof(*p));
+    memset(p,0,sizeof(*p));
+    p->nodes = xmalloc(sizeof(struct picolProfNode));
+    p->nodes[0].cmd = p->nodes[0].parent = p->nodes[0].child = p->nodes[0].next = -1;
+    p->nodes[0].self = 0;
+    p->numnodes = 1;
+    i->profiling = 1;
+}
+
+/* Stop timing calls, ending the ones in progress now. The data is kept for
+ * the reports. */
+void picolProfileStop(struct picolInterp *i) {
+    if (!i->profiling) return;
+    while(i->profile->depth) picolProfileLeave(i);
+    i->profiling = 0;
+}
+
+int picolProfileCompare(const void *a, const void *b) {
+    const struct picolProfCmd *x = a, *y = b;
+    return x->exclusive < y->exclusive ? 1 : x->exclusive > y->exclusive ? -1 :
+           strcmp(x->name,y->name);
+}
+
+/* Append to 'o' a line for every call chain, with the command names from
+ * the outermost separated by ';', and the exclusive time in microseconds,
+ * the format of the flame graph tools. Chains with no time are omitted. */
+void picolProfileFolded(struct picolProfile *p, struct picolObj *o) {
+    int *path = xmalloc(sizeof(int)*p->numnodes), len = 0;
+    int n = p->nodes[0].child;
+    while(n != -1) {
+        path[len++] = n;
+        long long us = p->nodes[n].self/1e3+0.5;
+        if (us > 0) {
+            char buf[32];
+            for (int j = 0; j < len; j++) {
+                char *name = p->cmds[p->nodes[path[j]].cmd].name;
+                if (j) picolAppendString(o,";",1);
+                picolAppendString(o,name,strlen(name));
+            }
+            picolAppendString(o,buf,snprintf(buf,sizeof(buf)," %lld\n",us));
+        }
+        /* Depth first: the child, or the next sibling of this node or of
+         * the closest ancestor having one. */
+        if (p->nodes[n].child != -1) {
+            n = p->nodes[n].child;
+            continue;
+        }
+        while(len && p->nodes[path[len-1]].next == -1) len--;
+        n = len ? p->nodes[path[--len]].next : -1;
+    }
+    xfree(path);
+}
+
+/* Return the report of the profiler: a table of the commands sorted by
+ * exclusive time, or the folded stacks if 'folded' is true. */
+struct picolObj *picolProfileReport(struct picolInterp *i, int folded) {
+    struct picolProfile *p = i->profile;
+    struct picolObj *o = picolNewStringObj("",0);
+    char buf[256];
+    if (p == NULL) return o;
+    if (folded) {
+        picolProfileFolded(p,o);
+        return o;
+    }
+    struct picolProfCmd *cmds = xmalloc(sizeof(*cmds)*(p->numcmds+1));
+    double total = 0;
+    memcpy(cmds,p->cmds,sizeof(*cmds)*p->numcmds);
+    qsort(cmds,p->numcmds,sizeof(*cmds),picolProfileCompare);
+    for (int j = 0; j < p->numcmds; j++) total += cmds[j].exclusive;
+    picolAppendString(o,buf,snprintf(buf,sizeof(buf),"%-24s %10s %12s %12s %7s\n",
+        "command","calls","incl_ms","excl_ms","excl_%"));
+    for (int j = 0; j < p->numcmds; j++) {
+        struct picolProfCmd *c = cmds+j;
+        if (c->calls == 0) continue; // Only calls in progress, like [profile].
+        picolAppendString(o,buf,snprintf(buf,sizeof(buf),"%-24.64s %10lld %12.3f %12.3f %7.2f\n",
+            c->name,c->calls,c->inclusive/1e6,c->exclusive/1e6,
+            total ? c->exclusive*100/total : 0));
+    }
+    xfree(cmds);
+    return o;
+}
+
+/* =============================================================================
+ * Execution limits
+ * ========================================================================== */
+
+/* The host may stop runaway scripts with a budget of checkpoints, a
+ * deadline, or by calling picolInterrupt(). A checkpoint is every command
+ * call and every iteration of a loop, so that every script reaches one in
+ * bounded time, unless a single command blocks. Checkpoints just decrement
+ * i->ticks, and every PICOL_LIMIT_INTERVAL of them, or fewer if the budget
+ * is about to end, picolLimitExceeded() looks at the limits, reading the
+ * clock only if there is a deadline. Hosts that never set limits may
+ * compile the checkpoints out with -DPICOL_NO_LIMITS. */
+#ifndef PICOL_NO_LIMITS
+#define picolLimitCheckpoint(i) (--(i)->ticks == 0 && picolLimitExceeded(i))
+#else
+#define picolLimitCheckpoint(i) 0
+#endif
+
+int picolLimitExceeded(struct picolInterp *i) {
+    char *msg = NULL;
+    i->ticks = 1; /* Check again at the next checkpoint, if we fail. */
+    if (atomic_exchange(&i->interrupted,0)) {
+        msg = "Interrupted";
+    } else if (i->budget == 0) {
+        msg = "Command limit exceeded";
+    } else if (i->deadline && picolProfileNow() >= i->deadline) {
+        msg = "Time limit exceeded";
+    }
+    if (msg) {
+        picolSetResult(i,msg);
+        return 1;
+    }
+    i->ticks = PICOL_LIMIT_INTERVAL;
+    if (i->budget >= 0) {
+        if (i->budget < i->ticks) i->ticks = i->budget;
+        i->budget -= i->ticks;
+    }
+    return 0;
+}
+
+/* Allow at most 'budget' more checkpoints, or remove the limit if it is
+ * zero or negative. When the budget ends, every script fails at its first
+ * checkpoint, until the host sets a new one. */
+void picolSetBudget(struct picolInterp *i, long long budget) {
+    i->budget = budget > 0 ? budget : -1;
+    i->ticks = 1;
+}
+
+/* Checkpoints left to run, or -1 if unlimited. The one that triggers the
+ * check of the limits is counted in the budget too, hence the -1. */
+long long picolGetBudget(struct picolInterp *i) {
+    return i->budget < 0 ? -1 : i->budget+i->ticks-1;
+}
+
+/* Allow 'ms' more milliseconds of execution, or remove the deadline if it
+ * is zero or negative. Like the budget, it stays exceeded once reached. */
+void picolSetTimeLimit(struct picolInterp *i, double ms) {
+    i->deadline = ms > 0 ? picolProfileNow()+ms*1e6 : 0;
+}
+
+/* Make the running script, or the next one, fail with PICOL_LIMIT at the
+ * next checkpoint. It only stores to an atomic, so it can be called by
+ * other threads and by signal handlers. */
+void picolInterrupt(struct picolInterp *i) {
+    atomic_store(&i->interrupted,1);
+}
+
+/* =============================================================================
+ * Virtual machine
+ * ========================================================================== */
+
+/* Push 'o' on the VM stack, that takes a reference to it. */
+void picolPush(struct picolInterp *i, struct picolObj *o) {
+    if (i->sp == i->stacklen) {
+        i->stacklen = i->stacklen ? i->stacklen*2 : 64;
+        i->stack = xrealloc(i->stack,sizeof(struct picolObj*)*i->stacklen);
+        picolMemTag(i->stack,PICOL_MEM_FRAMES);
+    }
+    picolIncrRefCount(o);
+    i->stack[i->sp++] = o;
+}
+
+void picolPopTo(struct picolInterp *i, int sp) {
+    while(i->sp > sp) picolDecrRefCount(i->stack[--i->sp]);
+}
+
+/* Call the command 'c' with the arguments of its type. Commands taking C
+ * strings get pointers to the objects strings: this is why they must never
+ * modify argv. */
+int picolInvokeCommand(struct picolInterp *i, struct picolCmd *c, int objc, struct picolObj **objv) {
+    if (c->objfunc) return c->objfunc(i,objc,objv,c);
+
+    struct picolArenaMark mark = picolArenaMark(&i->arena);
+    char *argvbuf[16], **argv = objc <= 16 ? argvbuf :
+        picolArenaAlloc(&i->arena,sizeof(char*)*objc);
+    for (int j = 0; j < objc; j++) argv[j] = picolGetString(objv[j]);
+    int retcode = c->func(i,objc,argv,c);
+    if (argv != argvbuf) picolArenaReset(&i->arena,mark);
+    return retcode;
+}
+
+/* Call the command 'c', that is NULL if objv[0] does not exist, timing it
+ * if the profiler is on. */
+int picolCallCommand(struct picolInterp *i, struct picolCmd *c, int objc, struct picolObj **objv) {
+    if (c == NULL) {
+        picolSetResultf(i,"No such command '%s'",picolGetString(objv[0]));
+        return PICOL_ERR;
+    }
+    if (!i->profiling) return picolInvokeCommand(i,c,objc,objv);
+    picolProfileEnter(i,c);
+    int retcode = picolInvokeCommand(i,c,objc,objv);
+    if (i->profiling) picolProfileLeave(i);
+    return retcode;
+}
+
+/* Set 'objv' to the arguments of the normal call of the inlined command
+ * 'in' of the code 'c'. The computed ones were pushed by the code before
+ * in->start: the command name and the literal arguments are pushed after
+ * them, so that the call pops all of them. */
+void picolPushDeoptArgs(struct picolInterp *i, struct picolCode *c, struct picolInlined *in, struct picolObj **objv) {
+    int j, n = 1+in->numargs;
+    picolPush(i,picolNewStringObj(in->cmd->name,-1));
+    for (j = 0; j < in->numargs; j++) picolPush(i,c->consts[in->args+j]);
+    for (j = 0; j < n; j++) objv[j] = i->stack[i->sp-n+j];
+    for (j = 0; j < in->onstack; j++) objv[n+j] = i->stack[i->sp-n-in->onstack+j];
+}
+
+/* Return the innermost inlined loop containing the instruction at 'pc'. */
+struct picolLoop *picolFindLoop(struct picolCode *c, int pc) {
+    struct picolLoop *found = NULL;
+    for (int j = 0; j < c->numloops; j++) {
+        struct picolLoop *l = c->loops+j;
+        if (pc >= l->start && pc < l->end && (!found || l->start > found->start))
+            found = l;
+    }
+    return found;
+}
+
+struct picolDict *picolGetDict(struct picolInterp *i, struct picolObj *o);
+struct picolCode *picolEnterProc(struct picolInterp *i, struct picolCmd *cmd, int argc, struct picolObj **argv);
+void picolLeaveProc(struct picolInterp *i, struct picolCode *code);
+int picolCommandCallProc(struct picolInterp *i, int argc, struct picolObj **argv, struct picolCmd *cmd);
+int picolCommandTailcall(struct picolInterp *i, int argc, struct picolObj **argv, struct picolCmd *cmd);
+
+/* Save the state of the caller of a procedure, see picolExecCode(). */
+void picolPushExecFrame(struct picolInterp *i, struct picolCode *c, int pc, int ip, int base, int objc, struct picolCmd *cmd, struct picolObj *memokey) {
+    if (i->execdepth == i->execlen) {
+        i->execlen = i->execlen ? i->execlen*2 : 64;
+        i->execstack = xrealloc(i->execstack,sizeof(struct picolExecFrame)*i->execlen);
+        picolMemTag(i->execstack,PICOL_MEM_FRAMES);
+    }
+    struct picolExecFrame *f = i->execstack+i->execdepth++;
+    f->code = c;
+    f->pc = pc;
+    f->ip = ip;
+    f->base = base;
+    f->objc = objc;
+    f->cmd = cmd;
+    f->memokey = memokey;
+    f->profiled = i->profiling;
+    if (f->profiled) picolProfileEnter(i,cmd);
+}
+
+/* EVAL! Execute compiled code. Procedures called by the code are executed
+ * by the same loop: their caller state is saved in the interpreter exec
+ * stack, and restored when they return, so the depth of procedure calls is
+ * only limited by i->maxlevel, and not by the C stack. Calls in tail
+ * position, and the [tailcall] command, replace the running procedure
+ * instead of returning to it. */
+int picolExecCode(struct picolInterp *i, struct picolCode *c) {
+    int pc = 0, ip = 0, retcode = PICOL_OK, base = i->sp, j;
+    int entrydepth = i->execdepth; // Deeper frames are called by this code.
+    struct picolLoop *l;
+    picolSetResultObj(i,i->emptyobj);
+    if (++i->nesting > PICOL_MAX_RECURSION_LEVEL) {
+        i->nesting--;
+        picolSetResult(i,"Nesting too deep");
+        return PICOL_ERR;
+    }
+#ifdef PICOL_MEM_STATS
+    struct picolMemCounters *memsaved = picolMemCurrent;
+    picolMemCurrent = i->mem;
+#endif
+    c->refcount++; // The code may be redefined or evicted meanwhile.
+next:
+    while (pc < c->len) {
+        int *op = c->ops+pc;
+        ip = pc;
+        switch(op[0]) {
+        case OP_PUSH:
+            picolPush(i,c->consts[op[1]]);
+            pc += 2;
+            break;
+        case OP_LOAD:
+        case OP_LOADLOCAL: {
+            struct picolVar *v;
+            if (op[0] == OP_LOAD) {
+                v = picolGetVar(i,c->consts[op[1]]->str);
+            } else {
+                v = i->callframe->slots+op[1];
+                if (v->val == NULL) v = NULL;
+            }
+            if (!v) {
+                char *name = op[0] == OP_LOAD ? c->consts[op[1]]->str :
+                                                i->callframe->slots[op[1]].name;
+                picolSetResultf(i,"No such variable '%s'",name);
+                retcode = PICOL_ERR;
+                goto done;
+            }
+            picolPush(i,v->val);
+            pc += 2;
+            break;
+        }
+        case OP_STORE:
+        case OP_STORELOCAL: {
+            struct picolObj *o = i->stack[i->sp-1];
+            if (op[0] == OP_STORE) {
+                picolSetVarObj(i,c->consts[op[1]]->str,o);
+            } else {
+                struct picolVar *v = i->callframe->slots+op[1];
+                picolIncrRefCount(o);
+                if (v->val) picolDecrRefCount(v->val);
+                v->val = o;
+            }
+            picolSetResultObj(i,o);
+            picolPopTo(i,i->sp-1);
+            pc += 2;
+            break;
+        }
+        case OP_CONCAT: {
+            /* Interpolation: concatenate the parts of a word. */
+            int len = 0, first = i->sp-op[1];
+            for (j = first; j < i->sp; j++) {
+                picolGetString(i->stack[j]);
+                len += i->stack[j]->len;
+            }
+            struct picolObj *o = picolNewStringObj(NULL,len);
+            char *p = o->str;
+            for (j = first; j < i->sp; j++) {
+                memcpy(p,i->stack[j]->str,i->stack[j]->len);
+                p += i->stack[j]->len;
+            }
+            *p = '\0';
+            picolPopTo(i,first);
+            picolPush(i,o);
+            pc += 2;
+            break;
+        }
+        case OP_DEOPT:
+        case OP_INVOKE:
+        case OP_CALL: {
+            if (picolLimitCheckpoint(i)) {
+                retcode = PICOL_LIMIT;
+                goto done;
+            }
+            struct picolInlined *in = op[0] == OP_DEOPT ? picolFindInlined(c,pc) : NULL;
+            /* The stack may be reallocated by the call: copy objv. */
+            int objc = in ? 1+in->numargs+in->onstack : op[1];
+            struct picolArenaMark mark = picolArenaMark(&i->arena);
+            struct picolObj *objvbuf[16], **objv = objc <= 16 ? objvbuf :
+                picolArenaAlloc(&i->arena,sizeof(struct picolObj*)*objc);
+            struct picolCmd *cmd;
+            if (in) picolPushDeoptArgs(i,c,in,objv);
+            else for (j = 0; j < objc; j++) objv[j] = i->stack[i->sp-objc+j];
+            if (op[0] == OP_CALL) {
+                struct picolCallSite *site = c->sites+op[2];
+                if (site->cmd == NULL || site->epoch != i->cmdepoch) {
+                    site->cmd = picolGetCommand(i,picolGetString(objv[0]));
+                    site->epoch = i->cmdepoch;
+                }
+                cmd = site->cmd;
+                pc += 3;
+            } else if (in) {
+                cmd = in->cmd;
+                pc = in->end;
+            } else {
+                cmd = picolGetCommand(i,picolGetString(objv[0]));
+                pc += 2;
+            }
+            if (cmd == NULL || (cmd->objfunc != picolCommandCallProc &&
+                               cmd->objfunc != picolCommandTailcall))
+            {
+                retcode = picolCallCommand(i,cmd,objc,objv);
+                if (objv != objvbuf) picolArenaReset(&i->arena,mark);
+                picolPopTo(i,i->sp-objc);
+                /* The command may have redefined commands inlined in the
+                 * rest of the code. */
+                if (c->epoch != i->epoch) picolDeoptimize(i,c);
+                break;
+            }
+
+            /* [tailcall cmd ...] is a call of 'cmd' in tail position. If
+             * the command is not a procedure, or we are not running a
+             * procedure called by this loop, it is just [return [cmd ...]]. */
+            int tail = 0;
+            if (cmd->objfunc == picolCommandTailcall) {
+                struct picolCmd *target = objc > 1 ?
+                    picolGetCommand(i,picolGetString(objv[1])) : NULL;
+                if (target == NULL || target->objfunc != picolCommandCallProc ||
+                    target->memo || i->execdepth == entrydepth ||
+                    i->execstack[i->execdepth-1].memokey)
+                {
+                    retcode = picolCallCommand(i,cmd,objc,objv);
+                    if (objv != objvbuf) picolArenaReset(&i->arena,mark);
+                    picolPopTo(i,i->sp-objc);
+                    if (c->epoch != i->epoch) picolDeoptimize(i,c);
+                    break;
+                }
+                cmd = target;
+                objv++;
+                objc--;
+                tail = 1;
+            } else {
+                /* [return [proc ...]] is a call in tail position too. A
+                 * call that is just the last command is not, or endless
+                 * recursion would never reach the depth limit. */
+                tail = i->execdepth > entrydepth && i->sp-objc == base &&
+                       pc+2 < c->len && c->ops[pc] == OP_RESULT &&
+                       c->ops[pc+1] == OP_RETURN && c->ops[pc+2] == 1 &&
+                       i->execstack[i->execdepth-1].memokey == NULL;
+            }
+
+            /* Memoized procedures may not run at all. They are never
+             * called in tail position, and never replaced by tail calls,
+             * since the result is cached when their frame returns. */
+            struct picolObj *memokey = NULL;
+            if (cmd->memo) {
+                struct picolObj *cached = picolMemoLookup(cmd,objc,objv,&memokey);
+                if (cached) {
+                    picolSetResultObj(i,cached);
+                    if (objv != objvbuf) picolArenaReset(&i->arena,mark);
+                    picolPopTo(i,i->sp-objc);
+                    break;
+                }
+                tail = 0;
+            }
+            struct picolCallFrame *frame = i->callframe;
+            struct picolCode *body = picolEnterProc(i,cmd,objc,objv);
+            if (objv != objvbuf) picolArenaReset(&i->arena,mark);
+            if (body == NULL) {
+                if (memokey) picolDecrRefCount(memokey);
+                retcode = PICOL_ERR;
+                picolPopTo(i,i->sp-objc);
+                break;
+            }
+            if (tail) {
+                /* Drop the frame of the running procedure, that is now
+                 * below the new one. The arguments are bound first since
+                 * they may be referenced only by its variables. */
+                struct picolCallFrame *newframe = i->callframe;
+                newframe->parent = frame->parent;
+                i->callframe = frame;
+                picolLeaveProc(i,c);
+                i->callframe = newframe;
+                picolPopTo(i,base);
+                if (i->execstack[i->execdepth-1].profiled && i->profiling) {
+                    picolProfileLeave(i);
+                    picolProfileEnter(i,cmd);
+                }
+            } else {
+                picolPushExecFrame(i,c,pc,ip,base,objc,cmd,memokey);
+                base = i->sp;
+            }
+            c = body;
+            pc = 0;
+            picolSetResultObj(i,i->emptyobj);
+            break;
+        }
+        case OP_RESULT:
+            picolPush(i,i->result);
+            pc++;
+            break;
+        case OP_CLEARRESULT:
+            picolSetResultObj(i,i->emptyobj);
+            pc++;
+            break;
+        case OP_JUMP:
+            pc = op[1];
+            break;
+        case OP_JUMPFALSE:
+            pc = picolIsTrue(i->result) ? pc+2 : op[1];
+            break;
+        case OP_JUMPTRUE:
+            if (!picolIsTrue(i->result)) {
+                pc += 2;
+                break;
+            }
+            /* Jumping back is a new iteration of an inlined loop. */
+            if (op[1] < pc && picolLimitCheckpoint(i)) {
+                retcode = PICOL_LIMIT;
+                goto done;
+            }
+            pc = op[1];
+            break;
+        case OP_FOREACH: {
+            /* The lists are below the body and the count of the iterations
+             * done, each one after its variable list. Variables are local
+             * slots, or -1-const for the ones set by name. */
+            struct picolObj *count = i->stack[i->sp-1];
+            struct picolObj **lists = i->stack+i->sp-1-op[2]*2;
+            long long iter = count->type == PICOL_OBJ_INT ? count->ival : 0;
+            int more = 0, *v;
+            for (j = 0, v = op+3; j < op[2]; j++, v += 1+v[0])
+                if (iter*v[0] < picolGetList(lists[j*2])->len) more = 1;
+            if (!more) {
+                pc = v-c->ops;
+                break;
+            }
+            if (picolLimitCheckpoint(i)) {
+                retcode = PICOL_LIMIT;
+                goto done;
+            }
+            for (j = 0, v = op+3; j < op[2]; j++, v += 1+v[0]) {
+                struct picolList *l = picolGetList(lists[j*2]);
+                for (int k = 0; k < v[0]; k++) {
+                    long long idx = iter*v[0]+k;
+                    struct picolObj *o = idx < l->len ? l->elem[idx] : i->emptyobj;
+                    if (v[1+k] < 0) {
+                        picolSetVarObj(i,c->consts[-1-v[1+k]]->str,o);
+                    } else {
+                        struct picolVar *var = i->callframe->slots+v[1+k];
+                        picolIncrRefCount(o);
+                        if (var->val) picolDecrRefCount(var->val);
+                        var->val = o;
+                    }
+                }
+            }
+            /* The count starts as a constant, then it is only referenced
+             * by the stack and can be changed in place. */
+            if (count->refcount == 1 && count->type == PICOL_OBJ_INT) {
+                count->ival++;
+            } else {
+                picolPopTo(i,i->sp-1);
+                picolPush(i,picolNewIntObj(iter+1));
+            }
+            pc = op[1];
+            break;
+        }
+        case OP_DICTITEMS: {
+            struct picolDict *d = picolGetDict(i,i->stack[i->sp-2]);
+            if (d == NULL) {
+                retcode = PICOL_ERR;
+                goto done;
+            }
+            struct picolObj *items = picolNewListObj(0,NULL);
+            for (struct picolDictEntry *e = d->head; e; e = e->next) {
+                picolListPush(items->list,e->key);
+                picolListPush(items->list,e->val);
+            }
+            picolIncrRefCount(items);
+            picolDecrRefCount(i->stack[i->sp-2]);
+            i->stack[i->sp-2] = items;
+            pc++;
+            break;
+        }
+        case OP_POP:
+            picolPopTo(i,i->sp-op[1]);
+            pc += 2;
+            break;
+        case OP_MATH: {
+            int n = (op[1] == 'm' || op[1] == 'n' || op[1] == 'b' ||
+                     op[1] == '!' || op[1] == '~') ? 1 : 2;
+            struct picolObj *a = i->stack[i->sp-n], *b = i->stack[i->sp-1];
+            struct picolNumber x, y;
+            char *err = "Error in expression";
+            if (n == 2 && a->type == PICOL_OBJ_INT && b->type == PICOL_OBJ_INT &&
+                picolIntMathOp(op[1],a->ival,b->ival,&x.i) == PICOL_OK)
+            {
+                x.type = PICOL_OBJ_INT;
+            } else if (picolGetNumber(a,&x) != PICOL_OK ||
+                (n == 2 && picolGetNumber(i->stack[i->sp-1],&y) != PICOL_OK) ||
+                (err = picolMathOp(op[1],&x,n == 2 ? &y : NULL)) != NULL)
+            {
+                picolSetResult(i,err);
+                retcode = PICOL_ERR;
+                goto done;
+            }
+            picolPopTo(i,i->sp-n+1);
+            if (a->refcount == 1) {
+                /* Only referenced by the stack: reuse it for the result. */
+                picolFreeIntRep(a);
+                if (a->str) picolFreeString(a);
+                a->str = NULL;
+                a->type = x.type;
+                a->ival = x.i;
+                a->dval = x.d;
+            } else {
+                picolPopTo(i,i->sp-1);
+                picolPush(i,picolNewNumberObj(&x));
+            }
+            pc += 2;
+            break;
+        }
+        case OP_ANDOR:
+        case OP_POPJUMPFALSE: {
+            double x;
+            if (picolGetDouble(i->stack[i->sp-1],&x) != PICOL_OK) {
+                picolSetResult(i,"Error in expression");
+                retcode = PICOL_ERR;
+                goto done;
+            }
+            int jump = (op[0] == OP_POPJUMPFALSE) ? x == 0 :
+                                                    (op[1] == 'o') == (x != 0);
+            picolPopTo(i,i->sp-1);
+            if (op[0] == OP_POPJUMPFALSE) {
+                pc = jump ? op[1] : pc+2;
+            } else if (jump) {
+                picolPush(i,picolNewIntObj(x != 0));
+                pc = op[2];
+            } else {
+                pc += 3;
+            }
+            break;
+        }
+        case OP_POPRESULT:
+            picolSetResultObj(i,i->stack[i->sp-1]);
+            picolPopTo(i,i->sp-1);
+            pc++;
+            break;
+        case OP_BREAK: retcode = PICOL_BREAK; pc++; break;
+        case OP_CONTINUE: retcode = PICOL_CONTINUE; pc++; break;
+        case OP_RETURN:
+            picolSetResultObj(i,op[1] ? i->stack[i->sp-1] : i->emptyobj);
+            retcode = PICOL_RETURN;
+            goto done;
+        case OP_ERROR:
+            picolSetResultObj(i,c->consts[op[1]]);
+            retcode = PICOL_ERR;
+            goto done;
+        }
+        if (retcode == PICOL_OK) continue;
+
+        /* A break or continue inside an inlined loop is just a jump. */
+unwind:
+        if ((retcode == PICOL_BREAK || retcode == PICOL_CONTINUE) &&
+            (l = picolFindLoop(c,ip)) != NULL)
+        {
+            picolPopTo(i,base+l->depth);
+            pc = (retcode == PICOL_BREAK) ? l->breakpc : l->contpc;
+            retcode = PICOL_OK;
+            continue;
+        }
+        break;
+    }
+done:
+    picolPopTo(i,base);
+    if (i->execdepth > entrydepth) {
+        /* Return from a procedure to its caller, that handles the return
+         * code like the one of any other command. */
+        struct picolExecFrame *f = i->execstack+(--i->execdepth);
+        if (f->memokey) picolMemoDone(f->cmd,c,f->memokey,retcode,i->result);
+        picolLeaveProc(i,c);
+        if (f->profiled && i->profiling) picolProfileLeave(i);
+        if (retcode == PICOL_RETURN) retcode = PICOL_OK;
+        c = f->code;
+        pc = f->pc;
+        ip = f->ip;
+        base = f->base;
+        picolPopTo(i,i->sp-f->objc);
+        if (c->epoch != i->epoch) picolDeoptimize(i,c);
+        if (retcode == PICOL_OK) goto next;
+        goto unwind;
+    }
+    picolReleaseCode(c);
+    i->nesting--;
+#ifdef PICOL_MEM_STATS
+    picolMemCurrent = memsaved;
+#endif
+    return retcode;
+}
+
+/* Return the compiled form of 't', taking it from the cache when possible,
+ * so that loop bodies and the like are compiled just once. */
+struct picolCode *picolCachedCode(struct picolInterp *i, struct picolScriptCacheEntry *cache, char *t, int isexpr) {
+    unsigned int h = picolHashString(t);
+    struct picolScriptCacheEntry *e = cache+(h%PICOL_SCRIPT_CACHE_SIZE);
+    if (e->code == NULL || e->hash != h || strcmp(e->code->src,t) != 0) {
+        picolReleaseCode(e->code);
+        e->hash = h;
+        e->code = picolCompileCode(i,t,NULL,isexpr);
+    }
+    return picolValidCode(i,&e->code);
+}
+
+/* Evaluate the program 't'. */
+int picolEval(struct picolInterp *i, char *t) {
+    return picolExecCode(i,picolCachedCode(i,i->scriptcache,t,0));
+}
+
+/* Evaluate the expression 't', setting the result to its value. This is
+ * used for [if] and [while] conditions. */
+int picolEvalExpr(struct picolInterp *i, char *t) {
+    return picolExecCode(i,picolCachedCode(i,i->exprcache,t,1));
+}
+
+#define PICOL_SOURCE_BATCH 1024 /* Commands compiled at once, see below. */
+
+/* Evaluate the program of 'len' bytes at 't', that may not be null
+ * terminated, like a file loaded with picolLoadSource(). The program is not
+ * compiled all at once: every PICOL_SOURCE_BATCH commands are compiled and
+ * executed before parsing the next ones, so execution starts right away,
+ * and the memory used by the compiler doesn't grow with the program. The
+ * code is not cached, since it is not going to run again. */
+int picolEvalSource(struct picolInterp *i, char *t, int len) {
+    struct picolParser p;
+    int retcode = PICOL_OK;
+    picolInitParser(&p,t,len);
+    picolSetResultObj(i,i->emptyobj);
+    while (retcode == PICOL_OK && p.type != PT_EOF) {
+        struct picolCode *c = picolCompileCommands(i,&p,PICOL_SOURCE_BATCH);
+        if (c->len) retcode = picolExecCode(i,c);
+        picolReleaseCode(c);
+    }
+    return retcode;
+}
+
+/* =============================================================================
+ * Event loop
+ * ========================================================================== */
+
+/* [after] schedules scripts to run at a given time, or when there is nothing
+ * else to do, and [fileevent] when a channel is readable or writable. They
+ * run at global level, only while the event loop runs: inside [vwait] and
+ * [update], or picolDoOneEvent() for the host. Timers are a binary heap
+ * ordered by time, and channels are watched with epoll, that is level
+ * triggered: the script of a readable channel runs again and again, until
+ * its input is read. */
+#define PICOL_MAX_EVENTS 256 /* Ready channels taken by one epoll_wait(). */
+
+struct picolTimer {
+    long long id;           // As in the "after#id" name of the timer.
+    double when;            // CLOCK_MONOTONIC nanoseconds.
+    struct picolCode *script;
+};
+
+struct picolEvents {
+    int epfd;               // -1 until a channel is watched.
+    int numwatched;
+    struct picolTimer *timers;  // Heap: timers[0] is the next one.
+    int numtimers, timerslen;
+    struct picolTimer *idle;    // Scripts of [after idle], in order.
+    int numidle, idlelen;
+    long long nextid;
+};
+
+struct picolChannel *picolAddChannel(struct picolInterp *i, int fd, char *prefix);
+int picolChannelErr(struct picolInterp *i, char *op, struct picolChannel *ch);
+
+struct picolEvents *picolGetEvents(struct picolInterp *i) {
+    if (i->events) return i->events;
+    struct picolEvents *e = xmalloc(sizeof(*e));
+    memset(e,0,sizeof(*e));
+    e->epfd = -1;
+    return i->events = e;
+}
+
+void picolFreeEvents(struct picolEvents *e) {
+    if (e == NULL) return;
+    for (int j = 0; j < e->numtimers; j++) picolReleaseCode(e->timers[j].script);
+    for (int j = 0; j < e->numidle; j++) picolReleaseCode(e->idle[j].script);
+    xfree(e->timers);
+    xfree(e->idle);
+    if (e->epfd != -1) close(e->epfd);
+    xfree(e);
+}
+
+/* True if there is something to wait for. */
+int picolHasEvents(struct picolInterp *i) {
+    struct picolEvents *e = i->events;
+    return e && (e->numtimers || e->numidle || e->numwatched);
+}
+
+int picolTimerBefore(struct picolTimer *a, struct picolTimer *b) {
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
+
+/* Move the timer at 'j' up or down the heap to its place. */
+void picolFixTimer(struct picolEvents *e, int j) {
+    struct picolTimer *t = e->timers, tmp;
+    while(j > 0 && picolTimerBefore(t+j,t+(j-1)/2)) {
+        tmp = t[j]; t[j] = t[(j-1)/2]; t[(j-1)/2] = tmp;
+        j = (j-1)/2;
+    }
+    while(1) {
+        int min = j, l = 2*j+1, r = 2*j+2;
+        if (l < e->numtimers && picolTimerBefore(t+l,t+min)) min = l;
+        if (r < e->numtimers && picolTimerBefore(t+r,t+min)) min = r;
+        if (min == j) break;
+        tmp = t[j]; t[j] = t[min]; t[min] = tmp;
+        j = min;
+    }
+}
+
+/* Schedule the script to run after 'ms' milliseconds, or when idle if 'ms'
+ * is negative. The timer takes the reference to the code. Returns its id. */
+long long picolAddTimer(struct picolInterp *i, double ms, struct picolCode *script) {
+    struct picolEvents *e = picolGetEvents(i);
+    struct picolTimer t = {e->nextid++, picolProfileNow()+ms*1e6, script};
+    if (ms < 0) {
+        if (e->numidle == e->idlelen) {
+            e->idlelen = e->idlelen ? e->idlelen*2 : 16;
+            e->idle = xrealloc(e->idle,sizeof(struct picolTimer)*e->idlelen);
+        }
+        e->idle[e->numidle++] = t;
+    } else {
+        if (e->numtimers == e->timerslen) {
+            e->timerslen = e->timerslen ? e->timerslen*2 : 16;
+            e->timers = xrealloc(e->timers,sizeof(struct picolTimer)*e->timerslen);
+        }
+        e->timers[e->numtimers++] = t;
+        picolFixTimer(e,e->numtimers-1);
+    }
+    return t.id;
+}
+
+/* Remove the timer or idle script 'id', returning its code, that the
+ * caller must release, or NULL if there is no such timer. */
+struct picolCode *picolRemoveTimer(struct picolInterp *i, long long id) {
+    struct picolEvents *e = i->events;
+    struct picolCode *script;
+    int j;
+    if (e == NULL) return NULL;
+    for (j = 0; j < e->numidle; j++) {
+        if (e->idle[j].id != id) continue;
+        script = e->idle[j].script;
+        memmove(e->idle+j,e->idle+j+1,sizeof(struct picolTimer)*(e->numidle-j-1));
+        e->numidle--;
+        return script;
+    }
+    for (j = 0; j < e->numtimers; j++) {
+        if (e->timers[j].id != id) continue;
+        script = e->timers[j].script;
+        e->timers[j] = e->timers[--e->numtimers];
+        if (j < e->numtimers) picolFixTimer(e,j);
+        return script;
+    }
+    return NULL;
+}
+
+/* Make epoll wait for the events the channel needs now: readable if it has
+ * a readable script or accepts connections, writable if it has a writable
+ * script or output that a non blocking write left in the buffer. Returns
+ * PICOL_ERR with errno set if the channel can't be watched, like regular
+ * files. */
+int picolWatchChannel(struct picolInterp *i, struct picolChannel *ch) {
+    int mask = (ch->onreadable || ch->onaccept ? EPOLLIN : 0) |
+               (ch->onwritable || (ch->nonblocking && ch->len) ? EPOLLOUT : 0);
+    if (mask == ch->watched) return PICOL_OK;
+    struct picolEvents *e = picolGetEvents(i);
+    if (e->epfd == -1 && (e->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return PICOL_ERR;
+    struct epoll_event ev = {.events = mask, .data.u32 = ch->slot};
+    int op = ch->watched == 0 ? EPOLL_CTL_ADD :
+             mask == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(e->epfd,op,ch->fd,&ev) == -1) return PICOL_ERR;
+    e->numwatched += (mask != 0)-(ch->watched != 0);
+    ch->watched = mask;
+    return PICOL_OK;
+}
+
+/* Drop the scripts of the channel, and stop watching it. */
+void picolUnwatchChannel(struct picolInterp *i, struct picolChannel *ch) {
+    picolReleaseCode(ch->onreadable);
+    picolReleaseCode(ch->onwritable);
+    if (ch->onaccept) picolDecrRefCount(ch->onaccept);
+    ch->onreadable = ch->onwritable = NULL;
+    ch->onaccept = NULL;
+    picolWatchChannel(i,ch);
+}
+
+/* Run the script of an event at global level. */
+int picolRunEventScript(struct picolInterp *i, struct picolCode **script) {
+    struct picolCallFrame *cf = i->callframe;
+    i->callframe = i->rootframe;
+    int retcode = picolExecCode(i,picolValidCode(i,script));
+    i->callframe = cf;
+    return retcode == PICOL_RETURN ? PICOL_OK : retcode;
+}
+
+/* Report the error of an event script, that has no caller to return it to,
+ * and return PICOL_OK so that the event loop goes on, like Tcl does: the
+ * bgerror procedure, if defined, is called at global level with the
+ * message, otherwise the message goes to stderr. Only PICOL_LIMIT stops
+ * the loop, and is returned. */
+int picolBackgroundError(struct picolInterp *i, int retcode) {
+    if (retcode == PICOL_OK || retcode == PICOL_LIMIT) return retcode;
+    struct picolCmd *handler = picolGetCommand(i,"bgerror");
+    struct picolObj *objv[2];
+    objv[0] = picolNewStringObj("bgerror",-1);
+    objv[1] = retcode == PICOL_ERR ? i->result :
+              picolNewStringObj(retcode == PICOL_BREAK ?
+                  "invoked \"break\" outside of a loop" :
+                  "invoked \"continue\" outside of a loop",-1);
+    picolIncrRefCount(objv[0]);
+    picolIncrRefCount(objv[1]);
+    if (handler) {
+        struct picolCallFrame *cf = i->callframe;
+        i->callframe = i->rootframe;
+        retcode = picolCallCommand(i,handler,2,objv);
+        i->callframe = cf;
+    }
+    if (retcode == PICOL_LIMIT) {
+        picolDecrRefCount(objv[0]);
+        picolDecrRefCount(objv[1]);
+        return retcode;
+    }
+    if (!handler || (retcode != PICOL_OK && retcode != PICOL_RETURN)) {
+        picolFlushChannel(&i->out);
+        if (handler) fprintf(stderr,"Error in bgerror: %s\n",picolGetResult(i));
+        fprintf(stderr,"Background error: %s\n",picolGetString(objv[1]));
+    }
+    picolDecrRefCount(objv[0]);
+    picolDecrRefCount(objv[1]);
+    picolSetResultObj(i,i->emptyobj);
+    return PICOL_OK;
+}
+
+/* Run the [fileevent] script at 'script' of the channel 'ch', at 'slot'. If
+ * it fails, and didn't close the channel, it is removed, like Tcl does, not
+ * to fail again at every event. */
+int picolRunChannelScript(struct picolInterp *i, int slot, struct picolChannel *ch, struct picolCode **script) {
+    int retcode = picolRunEventScript(i,script);
+    if (retcode != PICOL_OK && retcode != PICOL_LIMIT &&
+        slot < i->numfiles && i->files[slot] == ch)
+    {
+        picolReleaseCode(*script);
+        *script = NULL;
+    }
+    return picolBackgroundError(i,retcode);
+}
+
+/* Accept the pending connections of the server socket 'ch', calling its
+ * command with the new channel, the address and the port of the client. */
+int picolAcceptConnections(struct picolInterp *i, struct picolChannel *ch) {
+    int slot = ch->slot, retcode = PICOL_OK;
+    while(retcode == PICOL_OK && slot < i->numfiles && i->files[slot] == ch) {
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        char host[NI_MAXHOST], port[NI_MAXSERV];
+        int fd = accept(ch->fd,(struct sockaddr*)&sa,&salen);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) break;
+            return picolChannelErr(i,"accepting",ch);
+        }
+        fcntl(fd,F_SETFD,FD_CLOEXEC);
+        if (getnameinfo((struct sockaddr*)&sa,salen,host,sizeof(host),port,
+                        sizeof(port),NI_NUMERICHOST|NI_NUMERICSERV) != 0)
+            host[0] = port[0] = '\0';
+
+        struct picolList *prefix = picolGetList(ch->onaccept);
+        int objc = prefix->len+3;
+        struct picolObj **objv = xmalloc(sizeof(struct picolObj*)*objc);
+        for (int j = 0; j < prefix->len; j++) objv[j] = prefix->elem[j];
+        objv[objc-3] = picolNewStringObj(picolAddChannel(i,fd,"sock")->name,-1);
+        objv[objc-2] = picolNewStringObj(host,-1);
+        objv[objc-1] = picolNewStringObj(port,-1);
+        for (int j = 0; j < objc; j++) picolIncrRefCount(objv[j]);
+        struct picolCallFrame *cf = i->callframe;
+        i->callframe = i->rootframe;
+        retcode = picolCallCommand(i,picolGetCommand(i,picolGetString(objv[0])),objc,objv);
+        i->callframe = cf;
+        for (int j = 0; j < objc; j++) picolDecrRefCount(objv[j]);
+        xfree(objv);
+        if (retcode == PICOL_RETURN) retcode = PICOL_OK;
+        retcode = picolBackgroundError(i,retcode);
+    }
+    return retcode;
+}
+
+/* Handle the epoll events of the channel at 'slot'. Any script may close
+ * the channel, so it is looked up again after every one. */
+int picolChannelEvent(struct picolInterp *i, int slot, int events) {
+    struct picolChannel *ch = slot < i->numfiles ? i->files[slot] : NULL;
+    int retcode = PICOL_OK;
+#define picolSameChannel(i,slot,ch) (slot < i->numfiles && i->files[slot] == ch)
+    if (ch == NULL || ch->watched == 0) return PICOL_OK;
+    if (ch->onaccept) return picolAcceptConnections(i,ch);
+    if (events & (EPOLLOUT|EPOLLERR)) {
+        /* Errors of the background writes show up with the next [gets]
+         * or [read], like the end of file. */
+        if (ch->nonblocking && ch->len) picolFlushChannel(ch);
+        if (ch->onwritable) retcode = picolRunChannelScript(i,slot,ch,&ch->onwritable);
+        if (retcode != PICOL_OK || !picolSameChannel(i,slot,ch)) return retcode;
+    }
+    /* Input read in advance doesn't make the file descriptor readable: the
+     * script runs again while it consumes it, until a read would block, or
+     * for blocking channels while there is a whole line for [gets]. */
+    if (events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+        while(ch->onreadable) {
+            int rpos = ch->rpos, rlen = ch->rlen;
+            retcode = picolRunChannelScript(i,slot,ch,&ch->onreadable);
+            if (retcode != PICOL_OK || !picolSameChannel(i,slot,ch)) return retcode;
+            if (ch->rpos == ch->rlen || ch->blocked ||
+                (ch->rpos == rpos && ch->rlen == rlen) ||
+                (!ch->nonblocking && !memchr(ch->rbuf+ch->rpos,'\n',ch->rlen-ch->rpos)))
+                break;
+        }
+    }
+#undef picolSameChannel
+    if (picolWatchChannel(i,ch) != PICOL_OK) return picolChannelErr(i,"watching",ch);
+    return PICOL_OK;
+}
+
+/* Wait for the next events, if 'wait' is true, and handle them: ready
+ * channels first, then the timers that expired, and if nothing happened,
+ * the idle scripts. Scripts scheduled meanwhile by the scripts wait for the
+ * next call. Sets *handled to the number of events handled. Errors of the
+ * scripts are background errors, so only the errors of the loop itself and
+ * PICOL_LIMIT are returned. */
+int picolDoOneEvent(struct picolInterp *i, int wait, int *handled) {
+    struct picolEvents *e = picolGetEvents(i);
+    struct epoll_event ev[PICOL_MAX_EVENTS];
+    long long last = e->nextid;
+    double now = picolProfileNow(), ms = -1;
+    int retcode = PICOL_OK, n = 0, idle = 0;
+
+    *handled = 0;
+    if (!wait || e->numidle) {
+        ms = 0;
+    } else {
+        if (e->numtimers) ms = (e->timers[0].when-now)/1e6;
+        if (i->deadline && (ms == -1 || (i->deadline-now)/1e6 < ms))
+            ms = (i->deadline-now)/1e6;
+        if (ms != -1 && ms < 0) ms = 0;
+    }
+    int timeout = ms <= 0 ? (int)ms : ms >= INT_MAX ? INT_MAX : (int)ms+1;
+    if (e->numwatched) {
+        n = epoll_wait(e->epfd,ev,PICOL_MAX_EVENTS,timeout);
+        if (n == -1 && errno != EINTR) {
+            picolSetResultf(i,"Error waiting for events: %s",strerror(errno));
+            return PICOL_ERR;
+        }
+    } else if (timeout > 0) {
+        struct timespec ts = {timeout/1000, (timeout%1000)*1000000L};
+        nanosleep(&ts,NULL);
+    }
+    /* Look at the limits at the next checkpoint if the wait was cut short
+     * by picolInterrupt() in a signal handler, or by the deadline. */
+    now = picolProfileNow();
+    if (atomic_load(&i->interrupted) || (i->deadline && now >= i->deadline))
+        i->ticks = 1;
+
+    for (int j = 0; j < n; j++) {
+        retcode = picolChannelEvent(i,ev[j].data.u32,ev[j].events);
+        if (retcode != PICOL_OK) return retcode;
+        (*handled)++;
+    }
+    while(e->numtimers && e->timers[0].when <= now && e->timers[0].id < last) {
+        struct picolCode *script = picolRemoveTimer(i,e->timers[0].id);
+        retcode = picolBackgroundError(i,picolRunEventScript(i,&script));
+        picolReleaseCode(script);
+        (*handled)++;
+        if (retcode != PICOL_OK) return retcode;
+    }
+    while(*handled == 0 && e->numidle && e->idle[0].id < last) {
+        struct picolCode *script = picolRemoveTimer(i,e->idle[0].id);
+        retcode = picolBackgroundError(i,picolRunEventScript(i,&script));
+        picolReleaseCode(script);
+        idle++;
+        if (retcode != PICOL_OK) return retcode;
+    }
+    *handled += idle;
+    return PICOL_OK;
+}
+
+/* =============================================================================
+ * Standard library of commands
+ * ========================================================================== */
+
+int picolArityErr(struct picolInterp *i, char *name) {
+    char buf[1024];
+    snprintf(buf,sizeof(buf),"Wrong number of args for %s",name);
+    picolSetResult(i,buf);
+    return PICOL_ERR;
+}
+
+/* expr a + b * c ... or expr {$a + [foo]} */
+int picolCommandExpr(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    struct picolExprState st;
+    struct picolNumber v;
+    char *err = NULL;
+    int j, len = 0;
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+
+    /* A single argument (usually braced), or arguments with $vars and
+     * [commands] to substitute, are joined with spaces and run in the
+     * compiled form. The common case of already substituted arguments is
+     * handled by picolExpr() directly. */
+    for (j = 1; j < objc; j++) {
+        if (objv[j]->type == PICOL_OBJ_INT || objv[j]->type == PICOL_OBJ_DOUBLE) continue;
+        if (objc == 2 ? picolGetNumber(objv[j],&v) != PICOL_OK :
+                        strpbrk(picolGetString(objv[j]),"$[") != NULL) break;
+    }
+    if (j < objc) {
+        if (objc == 2) return picolEvalExpr(i,picolGetString(objv[1]));
+        for (j = 1; j < objc; j++) {
+            picolGetString(objv[j]);
+            len += objv[j]->len+1;
+        }
+        struct picolArenaMark mark = picolArenaMark(&i->arena);
+        char *e = picolArenaAlloc(&i->arena,len), *p = e;
+        for (j = 1; j < objc; j++) {
+            memcpy(p,objv[j]->str,objv[j]->len);
+            p += objv[j]->len;
+            *p++ = ' ';
+        }
+        p[-1] = '\0';
+        int retcode = picolEvalExpr(i,e);
+        picolArenaReset(&i->arena,mark);
+        return retcode;
+    }
+    st.objv = objv;
+    st.objc = objc;
+    st.idx = 1;
+    st.p = NULL;
+    picolExpr(i,&st,&err,0,&v);
+    if (!err && *picolExprSkip(&st,1) != '\0') err = "Error in expression";
+    if (err) { picolSetResult(i,err); return PICOL_ERR; }
+    picolSetResultObj(i,picolNewNumberObj(&v));
+    return PICOL_OK;
+}
+
+/* set var ?value? */
+int picolCommandSet(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc != 2 && objc != 3) return picolArityErr(i,picolGetString(objv[0]));
+    char *name = picolGetString(objv[1]);
+    if (objc == 3) {
+        picolSetVarObj(i,name,objv[2]);
+        picolSetResultObj(i,objv[2]);
+    } else {
+        struct picolVar *v = picolGetVar(i,name);
+        if (v == NULL) {
+            char buf[1024];
+            snprintf(buf,sizeof(buf),
+                "Can't read \"%s\": no such variable",name);
+            picolSetResult(i,buf);
+            return PICOL_ERR;
+        }
+        picolSetResultObj(i,v->val);
+    }
+    return PICOL_OK;
+}
+
+/* append varName ?value ...? appends the values to the variable string, in
+ * place if the object is not shared, see picolAppendString(). */
+int picolCommandAppend(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+    char *name = picolGetString(objv[1]);
+    struct picolVar *v = picolGetVar(i,name);
+    struct picolObj *o = v ? v->val : NULL;
+    /* The previous result is often the variable itself, after a previous
+     * [append]: that reference does not count, it is replaced anyway. */
+    if (o == NULL || o->refcount > 1+(i->result == o)) {
+        /* The length is only valid once the string is generated. */
+        char *s = o ? picolGetString(o) : "";
+        o = picolNewStringObj(s,o ? o->len : 0);
+        picolSetVarObj(i,name,o);
+    }
+    for (int j = 2; j < objc; j++) {
+        picolGetString(objv[j]);
+        picolAppendString(o,objv[j]->str,objv[j]->len);
+    }
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* Return the variable object 'name' ready to be modified in place, that is
+ * not shared, like [append] does: shared values are copied as a list, or
+ * as a dict if they are one. If the variable does not exist, and 'create'
+ * is true, it is set to an empty list, otherwise NULL is returned with an
+ * error. */
+struct picolObj *picolGetUnsharedVar(struct picolInterp *i, char *name, int create) {
+    struct picolVar *v = picolGetVar(i,name);
+    struct picolObj *o = v ? v->val : NULL;
+    if (o && o->refcount <= 1+(i->result == o)) return o;
+    if (o && o->type == PICOL_OBJ_DICT) {
+        o = picolNewDictObj(o->dict);
+    } else if (o) {
+        struct picolList *l = picolGetList(o);
+        o = picolNewListObj(l->len,l->elem);
+    } else if (create) {
+        o = picolNewListObj(0,NULL);
+    } else {
+        picolSetResultf(i,"Can't read \"%s\": no such variable",name);
+        return NULL;
+    }
+    picolSetVarObj(i,name,o);
+    return o;
+}
+
+/* Parse the list index 'o', an integer or end-N, into *idx. Indexes are
+ * not checked against the list length 'len', only clamped to -1..len+1 so
+ * that they fit an int: past the end, but not just at it, they stay out of
+ * range for [lset], that appends at 'len'. */
+int picolGetIndex(struct picolInterp *i, struct picolObj *o, int len, int *idx) {
+    char *s, *end;
+    long long v = 0;
+    int isend = 0;
+    if (o->type == PICOL_OBJ_INT) {
+        v = o->ival;
+    } else {
+        s = picolGetString(o);
+        if (strncmp(s,"end",3) == 0) {
+            isend = 1;
+            s += 3;
+        }
+        if (!isend || *s) {
+            v = strtoll(s,&end,10);
+            if (end == s || *end || (isend && *s != '-' && *s != '+')) {
+                picolSetResultf(i,"Bad index \"%s\"",picolGetString(o));
+                return PICOL_ERR;
+            }
+        }
+        if (isend) v += len-1;
+    }
+    *idx = v < -1 ? -1 : v > len ? len+1 : v;
+    return PICOL_OK;
+}
+
+/* list ?value ...? */
+int picolCommandList(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    picolSetResultObj(i,picolNewListObj(objc-1,objv+1));
+    return PICOL_OK;
+}
+
+/* llength list */
+int picolCommandLlength(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc != 2) return picolArityErr(i,picolGetString(objv[0]));
+    picolSetResultObj(i,picolNewIntObj(picolGetList(objv[1])->len));
+    return PICOL_OK;
+}
+
+/* lindex list ?index ...? gets the element of nested lists. An index out
+ * of range returns the empty string. */
+int picolCommandLindex(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+    struct picolObj *o = objv[1];
+    for (int j = 2; j < objc; j++) {
+        struct picolList *l = picolGetList(o);
+        int idx;
+        if (picolGetIndex(i,objv[j],l->len,&idx) != PICOL_OK) return PICOL_ERR;
+        if (idx < 0 || idx >= l->len) {
+            o = i->emptyobj;
+            break;
+        }
+        o = l->elem[idx];
+    }
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* lrange list first last */
+int picolCommandLrange(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc != 4) return picolArityErr(i,picolGetString(objv[0]));
+    struct picolList *l = picolGetList(objv[1]);
+    int first, last;
+    if (picolGetIndex(i,objv[2],l->len,&first) != PICOL_OK ||
+        picolGetIndex(i,objv[3],l->len,&last) != PICOL_OK) return PICOL_ERR;
+    if (first < 0) first = 0;
+    if (last >= l->len) last = l->len-1;
+    picolSetResultObj(i,picolNewListObj(first <= last ? last-first+1 : 0,l->elem+first));
+    return PICOL_OK;
+}
+
+/* lappend varName ?value ...? appends in place, see picolGetUnsharedVar(). */
+int picolCommandLappend(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+    struct picolObj *o = picolGetUnsharedVar(i,picolGetString(objv[1]),1);
+    struct picolList *l = picolGetList(o);
+    for (int j = 2; j < objc; j++) picolListPush(l,objv[j]);
+    picolInvalidateString(o);
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* lset varName ?index ...? value sets an element of nested lists, in place
+ * if possible. The index can be the list length, to append. */
+int picolCommandLset(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc < 3) return picolArityErr(i,picolGetString(objv[0]));
+    char *name = picolGetString(objv[1]);
+    struct picolObj *o = picolGetUnsharedVar(i,name,0), *val = objv[objc-1];
+    if (o == NULL) return PICOL_ERR;
+    if (objc == 3) {
+        picolSetVarObj(i,name,val);
+        picolSetResultObj(i,val);
+        return PICOL_OK;
+    }
+    struct picolObj *top = o;
+    for (int j = 2; j < objc-1; j++) {
+        struct picolList *l = picolGetList(o);
+        int idx;
+        if (picolGetIndex(i,objv[j],l->len,&idx) != PICOL_OK) return PICOL_ERR;
+        if (idx < 0 || idx > l->len || (idx == l->len && j < objc-2)) {
+            picolSetResult(i,"List index out of range");
+            return PICOL_ERR;
+        }
+        picolInvalidateString(o);
+        if (idx == l->len) {
+            picolListPush(l,val);
+            break;
+        }
+        struct picolObj *e = l->elem[idx];
+        if (j == objc-2) {
+            picolIncrRefCount(val);
+            l->elem[idx] = val;
+        } else if (e->refcount > 1) {
+            /* A nested list shared with others: modify a copy. */
+            struct picolList *el = picolGetList(e);
+            l->elem[idx] = picolNewListObj(el->len,el->elem);
+            picolIncrRefCount(l->elem[idx]);
+        } else {
+            o = e;
+            continue;
+        }
+        picolDecrRefCount(e);
+        o = l->elem[idx];
+    }
+    picolSetResultObj(i,top);
+    return PICOL_OK;
+}
+
+/* Sorting options of [lsort], see picolSortCompare(). */
+_Thread_local struct {
+    int mode;       // 'a' for strings, 'i' for integers, 'r' for reals.
+    int order;      // 1 or -1 for -decreasing.
+} picolSortOptions;
+
+struct picolSortItem {
+    struct picolObj *o;
+    struct picolNumber n;
+    int pos;        // Original position: equal elements keep their order.
+};
+
+/* Compare the elements, without considering their position. */
+int picolSortKeyCompare(const struct picolSortItem *x, const struct picolSortItem *y) {
+    int cmp;
+    if (picolSortOptions.mode == 'a') {
+        cmp = strcmp(x->o->str,y->o->str);
+    } else if (picolSortOptions.mode == 'i') {
+        cmp = (x->n.i > y->n.i) - (x->n.i < y->n.i);
+    } else {
+        cmp = (x->n.d > y->n.d) - (x->n.d < y->n.d);
+    }
+    return cmp*picolSortOptions.order;
+}
+
+int picolSortCompare(const void *a, const void *b) {
+    const struct picolSortItem *x = a, *y = b;
+    int cmp = picolSortKeyCompare(x,y);
+    return cmp ? cmp : x->pos-y->pos;
+}
+
+/* lsort ?-ascii|-integer|-real? ?-increasing|-decreasing? ?-unique? list */
+int picolCommandLsort(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    int mode = 'a', order = 1, unique = 0, j;
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+    for (j = 1; j < objc-1; j++) {
+        char *opt = picolGetString(objv[j]);
+        if (strcmp(opt,"-ascii") == 0) mode = 'a';
+        else if (strcmp(opt,"-integer") == 0) mode = 'i';
+        else if (strcmp(opt,"-real") == 0) mode = 'r';
+        else if (strcmp(opt,"-increasing") == 0) order = 1;
+        else if (strcmp(opt,"-decreasing") == 0) order = -1;
+        else if (strcmp(opt,"-unique") == 0) unique = 1;
+        else {
+            picolSetResultf(i,"Bad option \"%s\"",opt);
+            return PICOL_ERR;
+        }
+    }
+    struct picolList *l = picolGetList(objv[objc-1]);
+    struct picolSortItem *items = xmalloc(sizeof(*items)*(l->len+1));
+    for (j = 0; j < l->len; j++) {
+        struct picolSortItem *it = items+j;
+        it->o = l->elem[j];
+        it->pos = j;
+        if (mode == 'a') {
+            picolGetString(it->o);
+        } else if (picolGetNumber(it->o,&it->n) != PICOL_OK ||
+                   (mode == 'i' && it->n.type != PICOL_OBJ_INT)) {
+            picolSetResultf(i,"Expected %s but got \"%s\"",
+                mode == 'i' ? "integer" : "number",picolGetString(it->o));
+            xfree(items);
+            return PICOL_ERR;
+        } else if (it->n.type == PICOL_OBJ_INT) {
+            it->n.d = it->n.i;
+        }
+    }
+    picolSortOptions.mode = mode;
+    picolSortOptions.order = order;
+    qsort(items,l->len,sizeof(*items),picolSortCompare);
+    struct picolObj *o = picolNewListObj(0,NULL);
+    for (j = 0; j < l->len; j++) {
+        /* With -unique only the last of a run of equal elements is kept. */
+        if (unique && j+1 < l->len && picolSortKeyCompare(items+j,items+j+1) == 0)
+            continue;
+        picolListPush(o->list,items[j].o);
+    }
+    xfree(items);
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* foreach varList list ?varList list ...? body. Every varList is a list
+ * of variables taking the next elements at every iteration. */
+int picolCommandForeach(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    int j, k, iter, iterations = 0, retcode;
+    if (objc < 4 || objc%2) return picolArityErr(i,picolGetString(objv[0]));
+    char *body = picolGetString(objv[objc-1]);
+    /* The lists are referenced by the caller stack, so they can't change,
+     * but the list representation is taken again at every iteration since
+     * the body may turn them into something else. */
+    for (j = 1; j < objc-1; j += 2) {
+        int numvars = picolGetList(objv[j])->len, len = picolGetList(objv[j+1])->len;
+        if (numvars == 0) {
+            picolSetResult(i,"Foreach varlist is empty");
+            return PICOL_ERR;
+        }
+        if ((len+numvars-1)/numvars > iterations) iterations = (len+numvars-1)/numvars;
+    }
+    for (iter = 0; iter < iterations; iter++) {
+        for (j = 1; j < objc-1; j += 2) {
+            struct picolList *vars = picolGetList(objv[j]), *l = picolGetList(objv[j+1]);
+            for (k = 0; k < vars->len; k++) {
+                int idx = iter*vars->len+k;
+                picolSetVarObj(i,picolGetString(vars->elem[k]),
+                               idx < l->len ? l->elem[idx] : i->emptyobj);
+            }
+        }
+        retcode = picolEval(i,body);
+        if (retcode == PICOL_BREAK) break;
+        if (retcode != PICOL_OK && retcode != PICOL_CONTINUE) return retcode;
+    }
+    picolSetResultObj(i,i->emptyobj);
+    return PICOL_OK;
+}
+
+/* Return the dict of 'o', converting it from its list of keys and values
+ * the first time. On error NULL is returned, with the error set. */
+struct picolDict *picolGetDict(struct picolInterp *i, struct picolObj *o) {
+    if (o->type == PICOL_OBJ_DICT) return o->dict;
+    struct picolList *l = picolGetList(o);
+    if (l->len % 2) {
+        picolSetResult(i,"Missing value to go with key");
+        return NULL;
+    }
+    struct picolDict *d = picolNewDict();
+    for (int j = 0; j < l->len; j += 2) picolDictSet(d,l->elem[j],l->elem[j+1]);
+    picolFreeIntRep(o); // The string, if missing, is created from the dict.
+    o->type = PICOL_OBJ_DICT;
+    o->dict = d;
+    return d;
+}
+
+/* Follow the keys objv[0..objc-1] in nested dicts starting at 'o'. Returns
+ * NULL if a key is missing, with an error set if 'missingerr' is true. */
+struct picolObj *picolDictPath(struct picolInterp *i, struct picolObj *o, int objc, struct picolObj **objv, int missingerr) {
+    for (int j = 0; j < objc && o; j++) {
+        struct picolDict *d = picolGetDict(i,o);
+        if (d == NULL) return NULL;
+        o = picolDictGet(d,objv[j]);
+        if (o == NULL && missingerr)
+            picolSetResultf(i,"Key \"%s\" not known in dictionary",picolGetString(objv[j]));
+    }
+    return o;
+}
+
+/* dict set|unset varName key ?key ...? ?value?. Nested dicts along the path
+ * are created if missing, and copied if shared, like [lset] does. */
+int picolDictModify(struct picolInterp *i, int objc, struct picolObj **objv, int isset) {
+    int numkeys = objc-3-isset;
+    if (numkeys < 1) return picolArityErr(i,"dict");
+    struct picolObj *top = picolGetUnsharedVar(i,picolGetString(objv[2]),1), *o = top;
+    struct picolDict *d = picolGetDict(i,o);
+    for (int j = 0; d && j < numkeys-1; j++) {
+        struct picolObj *key = objv[3+j], *e = picolDictGet(d,key);
+        if (e == NULL && !isset) {
+            picolSetResultf(i,"Key \"%s\" not known in dictionary",picolGetString(key));
+            return PICOL_ERR;
+        }
+        picolInvalidateString(o);
+        if (e == NULL || e->refcount > 1) {
+            if (e && picolGetDict(i,e) == NULL) return PICOL_ERR;
+            e = picolNewDictObj(e ? e->dict : NULL);
+            picolDictSet(d,key,e);
+        }
+        o = e;
+        d = picolGetDict(i,o);
+    }
+    if (d == NULL) return PICOL_ERR;
+    picolInvalidateString(o);
+    if (isset) picolDictSet(d,objv[objc-2],objv[objc-1]);
+    else picolDictUnset(d,objv[objc-1]);
+    picolSetResultObj(i,top);
+    return PICOL_OK;
+}
+
+/* dict for {keyVar valueVar} dict body. The entries are taken before
+ * running the body, that may change the dict. */
+int picolDictFor(struct picolInterp *i, int objc, struct picolObj **objv) {
+    if (objc != 5) return picolArityErr(i,"dict");
+    struct picolList *vars = picolGetList(objv[2]);
+    struct picolDict *d;
+    if (vars->len != 2) {
+        picolSetResult(i,"Must have exactly two variable names");
+        return PICOL_ERR;
+    }
+    char *kname = xstrdup(picolGetString(vars->elem[0]));
+    char *vname = xstrdup(picolGetString(vars->elem[1]));
+    char *body = picolGetString(objv[4]);
+    int retcode = PICOL_OK, n = 0, j;
+    if ((d = picolGetDict(i,objv[3])) == NULL) retcode = PICOL_ERR;
+    struct picolObj **items = xmalloc(sizeof(struct picolObj*)*(d ? d->len*2+1 : 1));
+    for (struct picolDictEntry *e = d ? d->head : NULL; e; e = e->next) {
+        items[n++] = e->key;
+        items[n++] = e->val;
+    }
+    for (j = 0; j < n; j++) picolIncrRefCount(items[j]);
+    for (j = 0; j < n && retcode == PICOL_OK; j += 2) {
+        picolSetVarObj(i,kname,items[j]);
+        picolSetVarObj(i,vname,items[j+1]);
+        retcode = picolEval(i,body);
+        if (retcode == PICOL_CONTINUE) retcode = PICOL_OK;
+    }
+    for (j = 0; j < n; j++) picolDecrRefCount(items[j]);
+    xfree(items);
+    xfree(kname);
+    xfree(vname);
+    if (retcode == PICOL_BREAK) retcode = PICOL_OK;
+    if (retcode == PICOL_OK) picolSetResultObj(i,i->emptyobj);
+    return retcode;
+}
+
+/* dict create|get|set|exists|unset|size|keys|for ... */
+int picolCommandDict(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc < 2) return picolArityErr(i,picolGetString(objv[0]));
+    char *sub = picolGetString(objv[1]);
+    struct picolDict *d;
+    struct picolObj *o;
+
+    if (strcmp(sub,"create") == 0) {
+        if (objc % 2) return picolArityErr(i,"dict create");
+        o = picolNewDictObj(NULL);
+        for (int j = 2; j < objc; j += 2) picolDictSet(o->dict,objv[j],objv[j+1]);
+        picolSetResultObj(i,o);
+    } else if (strcmp(sub,"get") == 0) {
+        if (objc < 3) return picolArityErr(i,"dict get");
+        if ((o = picolDictPath(i,objv[2],objc-3,objv+3,1)) == NULL) return PICOL_ERR;
+        picolSetResultObj(i,o);
+    } else if (strcmp(sub,"exists") == 0) {
+        if (objc < 4) return picolArityErr(i,"dict exists");
+        o = picolDictPath(i,objv[2],objc-3,objv+3,0);
+        picolSetResultObj(i,picolNewIntObj(o != NULL));
+    } else if (strcmp(sub,"set") == 0 || strcmp(sub,"unset") == 0) {
+        return picolDictModify(i,objc,objv,sub[0] == 's');
+    } else if (strcmp(sub,"size") == 0 || strcmp(sub,"keys") == 0) {
+        if (objc != 3) return picolArityErr(i,"dict");
+        if ((d = picolGetDict(i,objv[2])) == NULL) return PICOL_ERR;
+        if (sub[0] == 's') {
+            picolSetResultObj(i,picolNewIntObj(d->len));
+            return PICOL_OK;
+        }
+        o = picolNewListObj(0,NULL);
+        for (struct picolDictEntry *e = d->head; e; e = e->next)
+            picolListPush(o->list,e->key);
+        picolSetResultObj(i,o);
+    } else if (strcmp(sub,"for") == 0) {
+        return picolDictFor(i,objc,objv);
+    } else {
+        picolSetResultf(i,"Bad dict subcommand \"%s\"",sub);
+        return PICOL_ERR;
+    }
+    return PICOL_OK;
+}
+
+/* Return the channel 'name', or NULL with an error. */
+struct picolChannel *picolGetChannel(struct picolInterp *i, char *name) {
+    if (strcmp(name,"stdout") == 0) return &i->out;
+    if (strcmp(name,"stdin") == 0) return &i->in;
+    if (strncmp(name,"file",4) == 0 || strncmp(name,"sock",4) == 0) {
+        char *end;
+        long j = strtol(name+4,&end,10);
+        if (end != name+4 && *end == '\0' && j >= 0 && j < i->numfiles &&
+            i->files[j] && strcmp(i->files[j]->name,name) == 0)
+            return i->files[j];
+    }
+    picolSetResultf(i,"Can not find channel named \"%s\"",name);
+    return NULL;
+}
+
+/* Like picolGetChannel(), but fails if the channel was not opened for
+ * 'access', PICOL_READABLE or PICOL_WRITABLE. */
+struct picolChannel *picolGetChannelFor(struct picolInterp *i, char *name, int access) {
+    struct picolChannel *ch = picolGetChannel(i,name);
+    if (ch && !(ch->access & access)) {
+        picolSetResultf(i,"Channel \"%s\" wasn't opened for %s",name,
+                        access == PICOL_READABLE ? "reading" : "writing");
+        return NULL;
+    }
+    return ch;
+}
+
+/* Add a channel for the file descriptor 'fd', named 'prefix' followed by
+ * its index in the files of the interpreter, like "file3" or "sock3". The
+ * host may use it to give scripts a socket or a pipe it created. */
+struct picolChannel *picolAddChannel(struct picolInterp *i, int fd, char *prefix) {
+    struct picolChannel *ch;
+    struct stat st;
+    char name[32];
+    int j;
+    for (j = 0; j < i->numfiles; j++) if (i->files[j] == NULL) break;
+    if (j == i->numfiles) {
+        i->files = xrealloc(i->files,sizeof(struct picolChannel*)*(i->numfiles+1));
+        i->numfiles++;
+    }
+    snprintf(name,sizeof(name),"%s%d",prefix,j);
+    ch = i->files[j] = xmalloc(sizeof(struct picolChannel));
+    picolMemTag(ch,PICOL_MEM_CHANNELS);
+    picolInitChannel(ch,name,fd,PICOL_BUF_FULL);
+    ch->slot = j;
+    if (fstat(fd,&st) == 0 && (S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode))) {
+        ch->stream = 1;
+        ch->size = PICOL_SOCKET_BUFSIZE;
+    }
+    return ch;
+}
+
+/* Close the channel, that must be one of the files of the interpreter,
+ * after writing its pending output. Returns PICOL_ERR with errno set if
+ * the output could not be written, or the file not closed. */
+int picolCloseChannel(struct picolInterp *i, struct picolChannel *ch) {
+    int retcode = PICOL_OK;
+    if (ch->nonblocking) retcode = picolSetChannelBlocking(ch,1);
+    picolUnwatchChannel(i,ch);
+    if (picolFlushChannel(ch) != PICOL_OK) retcode = PICOL_ERR;
+    if (close(ch->fd) == -1) retcode = PICOL_ERR;
+    i->files[ch->slot] = NULL;
+    picolFreeChannel(ch);
+    xfree(ch);
+    return retcode;
+}
+
+/* Set the error of a failed I/O operation on the channel 'ch'. */
+int picolChannelErr(struct picolInterp *i, char *op, struct picolChannel *ch) {
+    picolSetResultf(i,"Error %s \"%s\": %s",op,ch->name,strerror(errno));
+    return PICOL_ERR;
+}
+
+/* puts ?-nonewline? ?channelId? string */
+int picolCommandPuts(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int nonl = (argc > 2 && !strcmp(argv[1],"-nonewline"));
+    struct picolChannel *ch = &i->out;
+    if (argc-nonl < 2 || argc-nonl > 3) return picolArityErr(i,argv[0]);
+    if (argc-nonl == 3 && (ch = picolGetChannelFor(i,argv[1+nonl],PICOL_WRITABLE)) == NULL)
+        return PICOL_ERR;
+    if (picolWriteChannel(ch,argv[argc-1],strlen(argv[argc-1])) != PICOL_OK ||
+        (!nonl && picolWriteChannel(ch,"\n",1) != PICOL_OK) ||
+        (ch->nonblocking && picolWatchChannel(i,ch) != PICOL_OK))
+        return picolChannelErr(i,"writing",ch);
+    return PICOL_OK;
+}
+
+/* flush ?channelId? */
+int picolCommandFlush(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch = &i->out;
+    if (argc > 2) return picolArityErr(i,argv[0]);
+    if (argc == 2 && (ch = picolGetChannelFor(i,argv[1],PICOL_WRITABLE)) == NULL)
+        return PICOL_ERR;
+    if (picolFlushChannel(ch) != PICOL_OK ||
+        (ch->nonblocking && picolWatchChannel(i,ch) != PICOL_OK))
+        return picolChannelErr(i,"writing",ch);
+    return PICOL_OK;
+}
+
+/* open fileName ?access? opens a file, returning the name of its channel.
+ * Access is r (the default), r+, w, w+, a or a+, like for fopen(). */
+int picolCommandOpen(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    static char *modes[] = {"r", "r+", "w", "w+", "a", "a+"};
+    static int flags[] = {O_RDONLY, O_RDWR, O_WRONLY|O_CREAT|O_TRUNC,
+        O_RDWR|O_CREAT|O_TRUNC, O_WRONLY|O_CREAT|O_APPEND, O_RDWR|O_CREAT|O_APPEND};
+    int mode = 0, fd;
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    if (argc == 3) {
+        for (mode = 0; mode < 6; mode++) if (strcmp(argv[2],modes[mode]) == 0) break;
+        if (mode == 6) {
+            picolSetResultf(i,"Bad access mode \"%s\"",argv[2]);
+            return PICOL_ERR;
+        }
+    }
+    if ((fd = open(argv[1],flags[mode]|O_CLOEXEC,0666)) == -1) {
+        picolSetResultf(i,"Couldn't open \"%s\": %s",argv[1],strerror(errno));
+        return PICOL_ERR;
+    }
+    struct picolChannel *ch = picolAddChannel(i,fd,"file");
+    ch->access = (flags[mode] & O_ACCMODE) == O_RDONLY ? PICOL_READABLE :
+                 (flags[mode] & O_ACCMODE) == O_WRONLY ? PICOL_WRITABLE :
+                 PICOL_READABLE|PICOL_WRITABLE;
+    picolSetResult(i,ch->name);
+    return PICOL_OK;
+}
+
+/* close channelId, flushing it. Only channels of [open] and [socket] can be
+ * closed. */
+int picolCommandClose(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    if (ch->slot == -1) {
+        picolSetResultf(i,"Can't close \"%s\"",argv[1]);
+        return PICOL_ERR;
+    }
+    if (picolCloseChannel(i,ch) != PICOL_OK) {
+        picolSetResultf(i,"Error closing \"%s\": %s",argv[1],strerror(errno));
+        return PICOL_ERR;
+    }
+    picolSetResult(i,"");
+    return PICOL_OK;
+}
+
+/* gets channelId ?varName? returns the next line, without the newline. With
+ * varName, the line is stored in the variable instead, and the result is its
+ * length, or -1 at the end of file. If the variable string is not shared
+ * and large enough, like after a previous [gets], the line is copied there
+ * from the input buffer, without allocating anything. */
+int picolCommandGets(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    int len;
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannelFor(i,argv[1],PICOL_READABLE)) == NULL) return PICOL_ERR;
+    char *line = picolReadLine(ch,&len);
+    if (line == NULL && errno && !ch->blocked) return picolChannelErr(i,"reading",ch);
+    if (argc == 2) {
+        picolSetResultObj(i,line ? picolNewStringObj(line,len) : i->emptyobj);
+        return PICOL_OK;
+    }
+    if (line == NULL) {
+        picolSetVarObj(i,argv[2],i->emptyobj);
+        picolSetResultObj(i,picolNewIntObj(-1));
+        return PICOL_OK;
+    }
+    struct picolVar *v = picolGetVar(i,argv[2]);
+    struct picolObj *o = v ? v->val : NULL;
+    if (o && o->refcount <= 1+(i->result == o) && o->size > len) {
+        picolFreeIntRep(o);
+        o->type = PICOL_OBJ_STRING;
+        memcpy(o->str,line,len);
+        o->str[len] = '\0';
+        o->len = len;
+    } else {
+        picolSetVarObj(i,argv[2],picolNewStringObj(line,len));
+    }
+    picolSetResultObj(i,picolNewIntObj(len));
+    return PICOL_OK;
+}
+
+/* read channelId ?numChars? reads numChars bytes, or up to the end of file.
+ * read -nonewline channelId reads up to the end of file, dropping the last
+ * character if it is a newline. */
+int picolCommandRead(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int nonl = argc == 3 && strcmp(argv[1],"-nonewline") == 0;
+    struct picolChannel *ch;
+    struct picolObj *o;
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannelFor(i,argv[1+nonl],PICOL_READABLE)) == NULL) return PICOL_ERR;
+    if (argc == 3 && !nonl) {
+        char *end;
+        long n = strtol(argv[2],&end,10);
+        if (*end || end == argv[2] || n < 0 || n > INT_MAX/2) {
+            picolSetResultf(i,"Bad byte count '%s'",argv[2]);
+            return PICOL_ERR;
+        }
+        while(ch->rlen-ch->rpos < n) {
+            int r = picolFillChannel(ch);
+            if (r == -1 && ch->blocked) break;
+            if (r == -1) return picolChannelErr(i,"reading",ch);
+            if (r == 0) break;
+        }
+        if (n > ch->rlen-ch->rpos) n = ch->rlen-ch->rpos;
+        o = picolNewStringObj(ch->rbuf+ch->rpos,n);
+        ch->rpos += n;
+    } else {
+        if ((o = picolReadAll(ch)) == NULL) return picolChannelErr(i,"reading",ch);
+        if (nonl && o->len && o->str[o->len-1] == '\n') o->str[--o->len] = '\0';
+    }
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* seek channelId offset ?start|current|end? */
+int picolCommandSeek(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    static char *origins[] = {"start", "current", "end"};
+    static int whence[] = {SEEK_SET, SEEK_CUR, SEEK_END};
+    struct picolChannel *ch;
+    int origin = 0;
+    char *end;
+    if (argc != 3 && argc != 4) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    long long offset = strtoll(argv[2],&end,10);
+    if (*end || end == argv[2]) {
+        picolSetResultf(i,"Bad offset '%s'",argv[2]);
+        return PICOL_ERR;
+    }
+    if (argc == 4) {
+        for (origin = 0; origin < 3; origin++) if (strcmp(argv[3],origins[origin]) == 0) break;
+        if (origin == 3) {
+            picolSetResultf(i,"Bad origin \"%s\": must be start, current or end",argv[3]);
+            return PICOL_ERR;
+        }
+    }
+    if (picolFlushChannel(ch) != PICOL_OK) return picolChannelErr(i,"writing",ch);
+    picolDropInput(ch);
+    if (lseek(ch->fd,offset,whence[origin]) == -1) return picolChannelErr(i,"seeking",ch);
+    ch->eof = 0;
+    picolSetResult(i,"");
+    return PICOL_OK;
+}
+
+/* tell channelId returns the current offset, or -1 if not seekable. */
+int picolCommandTell(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    off_t pos = ch->fp ? -1 : lseek(ch->fd,0,SEEK_CUR);
+    if (pos != -1) pos += ch->len-(ch->rlen-ch->rpos);
+    picolSetResultObj(i,picolNewIntObj(pos));
+    return PICOL_OK;
+}
+
+/* eof channelId returns 1 if the last read found the end of file. */
+int picolCommandEof(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    picolSetResultObj(i,picolNewIntObj(ch->eof));
+    return PICOL_OK;
+}
+
+/* Set the result to the address of a socket, as "address host port", with
+ * the numeric address as host. */
+int picolSocketName(struct picolInterp *i, struct picolChannel *ch, int peer) {
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    if ((peer ? getpeername(ch->fd,(struct sockaddr*)&sa,&salen) :
+                getsockname(ch->fd,(struct sockaddr*)&sa,&salen)) == -1)
+        return picolChannelErr(i,"querying",ch);
+    int err = getnameinfo((struct sockaddr*)&sa,salen,host,sizeof(host),port,
+                          sizeof(port),NI_NUMERICHOST|NI_NUMERICSERV);
+    if (err) {
+        picolSetResultf(i,"Error querying \"%s\": %s",ch->name,gai_strerror(err));
+        return PICOL_ERR;
+    }
+    picolSetResultf(i,"%s %s %s",host,host,port);
+    return PICOL_OK;
+}
+
+/* fconfigure channelId ?-blocking bool? ?-buffering none|line|full?
+ * ?-buffersize size? sets the options. With a single option returns its
+ * value, without options returns all of them. Sockets have the read only
+ * options -sockname and -peername too. */
+int picolCommandFconfigure(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    static char *modes[] = {"none", "line", "full"};
+    struct picolChannel *ch;
+    if (argc < 2) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    if (argc == 2) {
+        picolSetResultf(i,"-blocking %d -buffering %s -buffersize %d",
+            !ch->nonblocking,modes[ch->buffering],ch->size);
+        return PICOL_OK;
+    }
+    if (argc == 3 && (strcmp(argv[2],"-sockname") == 0 || strcmp(argv[2],"-peername") == 0))
+        return picolSocketName(i,ch,argv[2][1] == 'p');
+    for (int j = 2; j < argc; j += 2) {
+        int buffering = strcmp(argv[j],"-buffering") == 0;
+        int blocking = strcmp(argv[j],"-blocking") == 0;
+        if (!buffering && !blocking && strcmp(argv[j],"-buffersize") != 0) {
+            picolSetResultf(i,"Bad option \"%s\": must be -blocking, -buffering, "
+                              "-buffersize, -sockname or -peername",argv[j]);
+            return PICOL_ERR;
+        }
+        if (argc == 3) {
+            if (buffering) picolSetResult(i,modes[ch->buffering]);
+            else if (blocking) picolSetResultObj(i,picolNewIntObj(!ch->nonblocking));
+            else picolSetResultf(i,"%d",ch->size);
+            return PICOL_OK;
+        }
+        if (j+1 == argc) return picolArityErr(i,argv[0]);
+        if (buffering) {
+            int mode;
+            for (mode = 0; mode < 3; mode++) if (strcmp(argv[j+1],modes[mode]) == 0) break;
+            if (mode == 3) {
+                picolSetResultf(i,"Bad value \"%s\": must be none, line or full",argv[j+1]);
+                return PICOL_ERR;
+            }
+            picolFlushChannel(ch);
+            ch->buffering = mode;
+        } else if (blocking) {
+            /* stdin and stdout may be shared with other processes. */
+            if (ch->slot == -1) {
+                picolSetResultf(i,"Can't change blocking mode of \"%s\"",argv[1]);
+                return PICOL_ERR;
+            }
+            if (picolSetChannelBlocking(ch,strtod(argv[j+1],NULL) != 0) != PICOL_OK ||
+                picolWatchChannel(i,ch) != PICOL_OK)
+                return picolChannelErr(i,"configuring",ch);
+        } else {
+            char *end;
+            long size = strtol(argv[j+1],&end,10);
+            if (*end || end == argv[j+1] || size < 1 || size > 1<<30) {
+                picolSetResultf(i,"Bad buffer size '%s'",argv[j+1]);
+                return PICOL_ERR;
+            }
+            picolSetChannelBufferSize(ch,size);
+        }
+    }
+    picolSetResult(i,"");
+    return PICOL_OK;
+}
+
+/* fblocked channelId returns 1 if the last read of a non blocking channel
+ * found no input, or just part of a line. */
+int picolCommandFblocked(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    picolSetResultObj(i,picolNewIntObj(ch->blocked));
+    return PICOL_OK;
+}
+
+/* socket -server command ?-myaddr addr? port listens for connections,
+ * calling the command with the channel of every new connection, and the
+ * address and port of the client, from the event loop. socket host port
+ * connects to a server. Both return the channel of the socket. */
+int picolCommandSocket(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int server = argc > 1 && strcmp(argv[1],"-server") == 0;
+    char *host = NULL, *port = argv[argc-1];
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, err = 0, one = 1;
+    if (server && argc == 6 && strcmp(argv[3],"-myaddr") == 0) host = argv[4];
+    else if (server && argc != 4) return picolArityErr(i,argv[0]);
+    else if (!server && argc != 3) return picolArityErr(i,argv[0]);
+    if (!server) host = argv[1];
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    if ((err = getaddrinfo(host,port,&hints,&res)) != 0) {
+        picolSetResultf(i,"Couldn't resolve \"%s\": %s",host ? host : port,gai_strerror(err));
+        return PICOL_ERR;
+    }
+    /* Try the addresses in order, for example IPv6 and IPv4 for localhost. */
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family,ai->ai_socktype|SOCK_CLOEXEC,ai->ai_protocol);
+        if (fd == -1) continue;
+        if (server) {
+            setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+            if (bind(fd,ai->ai_addr,ai->ai_addrlen) == 0 && listen(fd,SOMAXCONN) == 0) break;
+        } else {
+            if (connect(fd,ai->ai_addr,ai->ai_addrlen) == 0) break;
+        }
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        picolSetResultf(i,"Couldn't open socket: %s",strerror(err));
+        return PICOL_ERR;
+    }
+    struct picolChannel *ch = picolAddChannel(i,fd,"sock");
+    if (server) {
+        /* Connections are accepted until accept() would block. */
+        ch->onaccept = picolNewStringObj(argv[2],-1);
+        picolIncrRefCount(ch->onaccept);
+        if (fcntl(fd,F_SETFL,O_NONBLOCK) == -1 || picolWatchChannel(i,ch) != PICOL_OK) {
+            picolChannelErr(i,"listening",ch);
+            picolCloseChannel(i,ch);
+            return PICOL_ERR;
+        }
+    }
+    picolSetResult(i,ch->name);
+    return PICOL_OK;
+}
+
+/* fileevent channelId readable|writable ?script? sets the script to run at
+ * global level, from the event loop, when the channel is readable, or
+ * writable. An empty script removes it. Without the script returns the
+ * current one. */
+int picolCommandFileevent(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolChannel *ch;
+    if (argc != 3 && argc != 4) return picolArityErr(i,argv[0]);
+    if ((ch = picolGetChannel(i,argv[1])) == NULL) return PICOL_ERR;
+    int readable = strcmp(argv[2],"readable") == 0;
+    if (!readable && strcmp(argv[2],"writable") != 0) {
+        picolSetResultf(i,"Bad event name \"%s\": must be readable or writable",argv[2]);
+        return PICOL_ERR;
+    }
+    if (ch->slot == -1 || ch->onaccept) {
+        picolSetResultf(i,"Can't watch \"%s\"",argv[1]);
+        return PICOL_ERR;
+    }
+    struct picolCode **script = readable ? &ch->onreadable : &ch->onwritable;
+    if (argc == 3) {
+        picolSetResult(i,*script ? (*script)->src : "");
+        return PICOL_OK;
+    }
+    picolReleaseCode(*script);
+    *script = argv[3][0] ? picolCompile(i,argv[3]) : NULL;
+    if (picolWatchChannel(i,ch) != PICOL_OK) {
+        int saved = errno;
+        picolReleaseCode(*script);
+        *script = NULL;
+        picolWatchChannel(i,ch);
+        errno = saved;
+        return picolChannelErr(i,"watching",ch);
+    }
+    picolSetResult(i,"");
+    return PICOL_OK;
+}
+
+/* after ms ?script? runs the script after ms milliseconds, from the event
+ * loop, or without the script sleeps for ms milliseconds. Negative delays
+ * are zero. after idle script runs it when the event loop has nothing else
+ * to do. Both return an id for after cancel id. Errors of the scripts are
+ * background errors, see picolBackgroundError(). */
+int picolCommandAfter(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    char *end;
+    if (argc == 3 && strcmp(argv[1],"cancel") == 0) {
+        if (strncmp(argv[2],"after#",6) == 0)
+            picolReleaseCode(picolRemoveTimer(i,strtoll(argv[2]+6,NULL,10)));
+        picolSetResult(i,"");
+        return PICOL_OK;
+    }
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    int idle = argc == 3 && strcmp(argv[1],"idle") == 0;
+    long ms = idle ? -1 : strtol(argv[1],&end,10);
+    if (!idle && (*end || end == argv[1])) {
+        picolSetResultf(i,"Bad argument \"%s\": must be a number of milliseconds, idle or cancel",argv[1]);
+        return PICOL_ERR;
+    }
+    if (!idle && ms < 0) ms = 0; // Like Tcl, it is just already expired.
+    if (argc == 2) {
+        struct timespec ts = {ms/1000, (ms%1000)*1000000L};
+        while(nanosleep(&ts,&ts) == -1 && errno == EINTR && !atomic_load(&i->interrupted));
+        picolSetResult(i,"");
+        return PICOL_OK;
+    }
+    picolSetResultf(i,"after#%lld",picolAddTimer(i,ms,picolCompile(i,argv[2])));
+    return PICOL_OK;
+}
+
+/* Run the event loop until 'name', a variable of the global level, is
+ * written, see [vwait]. Variables have no traces, so before waiting the
+ * value is replaced by a private copy: any write stores another object, and
+ * the copy can't change in place, being shared. */
+int picolWaitVariable(struct picolInterp *i, char *name) {
+    struct picolCallFrame *cf = i->callframe;
+    struct picolObj *copy = NULL;
+    struct picolVar *v;
+    int retcode = PICOL_OK, handled;
+    i->callframe = i->rootframe;
+    if ((v = picolGetVar(i,name)) != NULL) {
+        char *s = picolGetString(v->val);
+        copy = picolNewStringObj(s,v->val->len);
+        picolSetVarObj(i,name,copy);
+        picolIncrRefCount(copy);
+    }
+    i->callframe = cf;
+    while(retcode == PICOL_OK) {
+        i->callframe = i->rootframe;
+        v = picolGetVar(i,name);
+        i->callframe = cf;
+        if ((v ? v->val : NULL) != copy) break;
+        if (!picolHasEvents(i)) {
+            picolSetResultf(i,"Can't wait for variable \"%s\": would wait forever",name);
+            retcode = PICOL_ERR;
+        } else if (picolLimitCheckpoint(i)) {
+            retcode = PICOL_LIMIT;
+        } else {
+            retcode = picolDoOneEvent(i,1,&handled);
+        }
+    }
+    if (copy) picolDecrRefCount(copy);
+    return retcode;
+}
+
+/* vwait varName runs the event loop until the global variable is set. Like
+ * in Tcl, errors of the event scripts don't stop it: they are reported by
+ * the bgerror procedure, or to stderr. */
+int picolCommandVwait(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    int retcode = picolWaitVariable(i,argv[1]);
+    if (retcode == PICOL_OK) picolSetResult(i,"");
+    return retcode;
+}
+
+/* update handles the pending events, without waiting. */
+int picolCommandUpdate(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int retcode, handled;
+    if (argc != 1) return picolArityErr(i,argv[0]);
+    do {
+        if (picolLimitCheckpoint(i)) return PICOL_LIMIT;
+        retcode = picolDoOneEvent(i,0,&handled);
+    } while(retcode == PICOL_OK && handled);
+    if (retcode == PICOL_OK) picolSetResult(i,"");
+    return retcode;
+}
+
+/* if cond body ?elseif cond body ...? ?else body? */
 int picolCommandIf(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
     int retcode, j = 1;
     while (1) {
         if (j >= argc) return picolArityErr(i,argv[0]);
         /* Evaluate condition of this branch. */
-        retcode = picolExprExpansion(i,argv[j]);
+        retcode = picolEvalExpr(i,argv[j]);
         if (retcode != PICOL_OK) return retcode;
         if (j+1 >= argc) return picolArityErr(i,argv[0]);
         /* True? Eval the corresponding branch and return. */
-        if (strtod(i->result,NULL)) return picolEval(i,argv[j+1]);
+        if (picolIsTrue(i->result)) return picolEval(i,argv[j+1]);
         j += 2;
         if (j >= argc) return PICOL_OK; // No more branches.
         /* Else statement? Evaluate the else branch (condition was false)
@@ -657,9 +5607,10 @@ int picolCommandIf(struct picolInterp *i, int argc, char **argv, struct picolCmd
 int picolCommandWhile(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
     if (argc != 3) return picolArityErr(i,argv[0]);
     while(1) {
-        int retcode = picolExprExpansion(i,argv[1]);
+        if (picolLimitCheckpoint(i)) return PICOL_LIMIT;
+        int retcode = picolEvalExpr(i,argv[1]);
         if (retcode != PICOL_OK) return retcode;
-        if (!strtod(i->result,NULL)) return PICOL_OK;
+        if (!picolIsTrue(i->result)) return PICOL_OK;
         retcode = picolEval(i,argv[2]);
         if (retcode == PICOL_CONTINUE || retcode == PICOL_OK) continue;
         else if (retcode == PICOL_BREAK) return PICOL_OK;
@@ -675,103 +5626,765 @@ int picolCommandRetCodes(struct picolInterp *i, int argc, char **argv, struct pi
     return PICOL_OK;
 }
 
+void picolReleaseLocals(struct picolLocals *l);
+void picolFreePmap(struct picolPmap *p);
+
 void picolDropCallFrame(struct picolInterp *i) {
     struct picolCallFrame *cf = i->callframe;
-    struct picolVar *v = cf->vars, *t;
-    while(v) {
-        t = v->next;
-        free(v->name);
-        free(v->val);
-        free(v);
-        v = t;
+    int j;
+    for (j = 0; cf->locals && j < cf->locals->numlocals; j++)
+        if (cf->slots[j].val) picolDecrRefCount(cf->slots[j].val);
+    for (j = 0; j < cf->varslots; j++) {
+        struct picolVar *v = cf->vars[j];
+        if (v == NULL) continue;
+        picolFreeSmall(v->name,strlen(v->name)+1);
+        picolDecrRefCount(v->val);
+        picolFreeSmall(v,sizeof(*v));
     }
+    xfree(cf->vars);
+    picolReleaseLocals(cf->locals);
     i->callframe = cf->parent;
-    free(cf);
+    if (i->numpooled < PICOL_FRAME_POOL) {
+        cf->parent = i->framepool;
+        i->framepool = cf;
+        i->numpooled++;
+    } else {
+        xfree(cf->slots);
+        xfree(cf);
+    }
 }
 
 void picolFreeInterp(struct picolInterp *i) {
     while(i->callframe) picolDropCallFrame(i);
-    while(i->commands) {
-        struct picolCmd *c = i->commands;
-        i->commands = c->next;
-        free(c->name);
-        free(c->arglist);
-        free(c->body);
-        free(c);
-    }
-    free(i->result);
-    free(i);
-}
-
-/* The callback used for user defined procedures. */
-int picolCommandCallProc(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
-    char *alist=cmd->arglist, *body=cmd->body, *p=xstrdup(alist), *tofree;
-    struct picolCallFrame *cf = xmalloc(sizeof(*cf));
-    int arity = 0, done = 0, errcode = PICOL_OK;
-    char errbuf[1024];
-    cf->vars = NULL;
-    cf->parent = i->callframe;
-    i->callframe = cf;
-    tofree = p;
-    while(1) {
-        char *start = p;
-        while(*p != ' ' && *p != '\0') p++;
-        if (*p != '\0' && p == start) {
-            p++; continue;
-        }
-        if (p == start) break;
-        if (*p == '\0') done=1; else *p = '\0';
-        if (++arity > argc-1) goto arityerr;
-        if (isupper(start[0])) {
-            snprintf(errbuf,sizeof(errbuf),"Procedure parameter '%s' can't be a global (upcase first character)", start);
-            goto err;
+    while(i->framepool) {
+        struct picolCallFrame *cf = i->framepool;
+        i->framepool = cf->parent;
+        xfree(cf->slots);
+        xfree(cf);
+    }
+    for (int j = 0; j < i->cmdslots; j++) {
+        struct picolCmd *c = i->commands[j];
+        if (c == NULL) continue;
+        xfree(c->name);
+        xfree(c->arglist);
+        xfree(c->body);
+        picolReleaseCode(c->code);
+        picolFreeMemo(c->memo);
+        picolFreeSmall(c,sizeof(*c));
+    }
+    xfree(i->commands);
+    for (int j = 0; j < PICOL_SCRIPT_CACHE_SIZE; j++) {
+        picolReleaseCode(i->scriptcache[j].code);
+        picolReleaseCode(i->exprcache[j].code);
+    }
+    xfree(i->stack);
+    xfree(i->execstack);
+    for (int j = 0; j < i->numfiles; j++)
+        if (i->files[j]) picolCloseChannel(i,i->files[j]);
+    xfree(i->files);
+    picolFreeEvents(i->events);
+    picolFreeChannel(&i->in);
+    picolFreeChannel(&i->out);
+    if (i->thread && !i->thread->started) picolRemoveThread(i->thread);
+    if (i->pmap) picolFreePmap(i->pmap);
+    picolFreeProfile(i->profile);
+    picolFreeArena(&i->arena);
+    picolDecrRefCount(i->result);
+    picolDecrRefCount(i->emptyobj);
+#ifdef PICOL_MEM_STATS
+    struct picolMemCounters *mem = i->mem;
+    xfree(i);
+    if (picolMemCurrent == mem) picolMemCurrent = NULL;
+    picolMemRelease(mem);
+#else
+    xfree(i);
+#endif
+}
+
+/* Fill 'st' with the memory counters of the interpreter. Returns PICOL_ERR
+ * if memory accounting is not compiled in, see PICOL_MEM_STATS. */
+int picolMemStats(struct picolInterp *i, struct picolMemStats *st) {
+    memset(st,0,sizeof(*st));
+#ifdef PICOL_MEM_STATS
+    struct picolMemCounters *m = i->mem;
+    st->allocs = atomic_load(&m->allocs);
+    st->frees = atomic_load(&m->frees);
+    st->live = atomic_load(&m->live);
+    st->peak = atomic_load(&m->peak);
+    for (int j = 0; j < PICOL_MEM_CATEGORIES; j++)
+        st->category[j] = atomic_load(&m->category[j]);
+    return PICOL_OK;
+#else
+    return PICOL_ERR;
+#endif
+}
+
+/* Check the arguments of a call of the procedure 'cmd', and push its call
+ * frame, with the arguments bound to the first local slots without copying
+ * them. Returns the code of the body, that the caller must execute and then
+ * pass to picolLeaveProc(), or NULL on errors. */
+struct picolCode *picolEnterProc(struct picolInterp *i, struct picolCmd *cmd, int argc, struct picolObj **argv) {
+    struct picolCode *code = picolValidCode(i,&cmd->code);
+    struct picolLocals *l = code->locals;
+
+    if (l->numargs != argc-1) {
+        picolSetResultf(i,"Proc '%s' called with wrong arg num",cmd->name);
+        return NULL;
+    }
+    if (l->globalarg != -1) {
+        picolSetResultf(i,"Procedure parameter '%s' can't be a global (upcase first character)", l->names[l->globalarg]);
+        return NULL;
+    }
+    if (i->level >= i->maxlevel) {
+        picolSetResult(i,"Nesting too deep");
+        return NULL;
+    }
+    picolPushCallFrame(i,l);
+    for (int j = 0; j < l->numargs; j++) {
+        i->callframe->slots[j].val = argv[j+1];
+        picolIncrRefCount(argv[j+1]);
+    }
+    code->refcount++; // The procedure may be redefined meanwhile.
+    i->level++;
+    return code;
+}
+
+void picolLeaveProc(struct picolInterp *i, struct picolCode *code) {
+    picolDropCallFrame(i); /* remove the called proc callframe */
+    picolReleaseCode(code);
+    i->level--;
+}
+
+/* The callback used for user defined procedures, when they are not called
+ * by compiled code directly, see picolExecCode(). */
+int picolCommandCallProc(struct picolInterp *i, int argc, struct picolObj **argv, struct picolCmd *cmd) {
+    struct picolObj *memokey = NULL;
+    if (cmd->memo) {
+        struct picolObj *cached = picolMemoLookup(cmd,argc,argv,&memokey);
+        if (cached) {
+            picolSetResultObj(i,cached);
+            return PICOL_OK;
         }
-        picolSetVar(i,start,argv[arity]);
-        p++;
-        if (done) break;
     }
-    free(tofree);
-    tofree = NULL;
-    if (arity != argc-1) goto arityerr;
-    errcode = picolEval(i,body);
+    struct picolCode *code = picolEnterProc(i,cmd,argc,argv);
+    if (code == NULL) {
+        if (memokey) picolDecrRefCount(memokey);
+        return PICOL_ERR;
+    }
+    int errcode = picolExecCode(i,code);
     if (errcode == PICOL_RETURN) errcode = PICOL_OK;
-    picolDropCallFrame(i); /* remove the called proc callframe */
+    if (memokey) picolMemoDone(cmd,code,memokey,errcode,i->result);
+    picolLeaveProc(i,code);
     return errcode;
-arityerr:
-    snprintf(errbuf,sizeof(errbuf),"Proc '%s' called with wrong arg num",argv[0]);
-err:
-    picolSetResult(i,errbuf);
-    free(tofree);
-    picolDropCallFrame(i); /* remove the called proc callframe */
-    return PICOL_ERR;
 }
 
+/* tailcall cmd ?arg ...? calls the command in place of the running procedure.
+ * This function is only used when no frame can be replaced, see
+ * picolExecCode(), and the call happens before returning. */
+int picolCommandTailcall(struct picolInterp *i, int argc, struct picolObj **argv, struct picolCmd *cmd) {
+    if (argc < 2) return picolArityErr(i,picolGetString(argv[0]));
+    if (i->callframe == i->rootframe) {
+        picolSetResult(i,"tailcall can only be called from a proc");
+        return PICOL_ERR;
+    }
+    struct picolCmd *c = picolGetCommand(i,picolGetString(argv[1]));
+    int retcode = picolCallCommand(i,c,argc-1,argv+1);
+    return retcode == PICOL_OK ? PICOL_RETURN : retcode;
+}
+
+/* interp recursionlimit {} ?limit? gets or sets the max depth of procedure
+ * calls. interp limit {} commands|time ?value? gets or sets the budget of
+ * checkpoints and the milliseconds left before the deadline, 0 removes
+ * the limit and an empty string is returned if there is none. Only the
+ * current interpreter, {}, is supported. */
+int picolCommandInterp(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    char buf[32];
+    int islimit = argc >= 4 && strcmp(argv[1],"limit") == 0;
+    if (islimit) {
+        if (argc > 5 || (strcmp(argv[3],"commands") != 0 &&
+                         strcmp(argv[3],"time") != 0))
+            return picolArityErr(i,argv[0]);
+    } else if (argc < 3 || argc > 4 || strcmp(argv[1],"recursionlimit") != 0) {
+        return picolArityErr(i,argv[0]);
+    }
+    if (argv[2][0] != '\0') {
+        picolSetResultf(i,"Could not find interpreter \"%s\"",argv[2]);
+        return PICOL_ERR;
+    }
+    if (islimit) {
+        int time = argv[3][0] == 't';
+        if (argc == 5) {
+            char *end;
+            long long limit = strtoll(argv[4],&end,10);
+            if (*end || end == argv[4] || limit < 0) {
+                picolSetResultf(i,"Bad %s limit '%s'",argv[3],argv[4]);
+                return PICOL_ERR;
+            }
+            if (time) picolSetTimeLimit(i,limit);
+            else picolSetBudget(i,limit);
+        }
+        buf[0] = '\0';
+        if (time && i->deadline) {
+            double ms = (i->deadline-picolProfileNow())/1e6;
+            snprintf(buf,sizeof(buf),"%lld",ms > 0 ? (long long)ms : 0);
+        } else if (!time && i->budget >= 0) {
+            snprintf(buf,sizeof(buf),"%lld",picolGetBudget(i));
+        }
+        picolSetResult(i,buf);
+        return PICOL_OK;
+    }
+    if (argc == 4) {
+        char *end;
+        long limit = strtol(argv[3],&end,10);
+        if (*end || end == argv[3] || limit <= 0 || limit > 1000000000) {
+            picolSetResultf(i,"Bad recursion limit '%s'",argv[3]);
+            return PICOL_ERR;
+        }
+        i->maxlevel = limit;
+    }
+    snprintf(buf,sizeof(buf),"%d",i->maxlevel);
+    picolSetResult(i,buf);
+    return PICOL_OK;
+}
+
+/* time script ?count? runs the script count times, once by default, and
+ * returns the average time it took, like Tcl. */
+int picolCommandTime(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct timespec start, end;
+    long count = 1;
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    if (argc == 3) {
+        char *end;
+        count = strtol(argv[2],&end,10);
+        if (*end || end == argv[2]) {
+            picolSetResultf(i,"Bad count '%s'",argv[2]);
+            return PICOL_ERR;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (long j = 0; j < count; j++) {
+        int retcode = picolEval(i,argv[1]);
+        if (retcode != PICOL_OK) return retcode;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    double us = (end.tv_sec-start.tv_sec)*1e6+(end.tv_nsec-start.tv_nsec)/1e3;
+    if (count <= 1)
+        picolSetResultf(i,"%lld microseconds per iteration",count <= 0 ? 0 : (long long)us);
+    else
+        picolSetResultf(i,"%.12g microseconds per iteration",us/count);
+    return PICOL_OK;
+}
+
+/* profile start|stop|report ?-folded? controls the profiler. start drops
+ * the previous data and times the calls from now on, stop stops timing
+ * them. report returns a table of the commands sorted by exclusive time,
+ * or with -folded the call chains in the format of the flame graph tools,
+ * with microseconds. */
+int picolCommandProfile(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int folded = argc == 3 && strcmp(argv[2],"-folded") == 0;
+    if (argc != 2 && !folded) return picolArityErr(i,argv[0]);
+    if (!folded && strcmp(argv[1],"start") == 0) {
+        picolProfileStart(i);
+    } else if (!folded && strcmp(argv[1],"stop") == 0) {
+        picolProfileStop(i);
+    } else if (strcmp(argv[1],"report") == 0) {
+        picolSetResultObj(i,picolProfileReport(i,folded));
+        return PICOL_OK;
+    } else {
+        picolSetResultf(i,"Bad option \"%s\": must be start, stop or report",argv[1]);
+        return PICOL_ERR;
+    }
+    picolSetResultObj(i,i->emptyobj);
+    return PICOL_OK;
+}
+
+/* memstats returns the memory counters of the interpreter as a dict: blocks
+ * allocated and freed, live and peak bytes, and live bytes by category. It
+ * needs memory accounting, see PICOL_MEM_STATS. */
+int picolCommandMemstats(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolMemStats st;
+    char buf[64];
+    if (argc != 1) return picolArityErr(i,argv[0]);
+    if (picolMemStats(i,&st) != PICOL_OK) {
+        picolSetResult(i,"Memory accounting not compiled in, build with -DPICOL_MEM_STATS");
+        return PICOL_ERR;
+    }
+    struct picolObj *o = picolNewStringObj("",0);
+    picolAppendString(o,buf,snprintf(buf,sizeof(buf),"allocs %llu frees %llu live %zu peak %zu",
+        st.allocs,st.frees,st.live,st.peak));
+    for (int j = 0; j < PICOL_MEM_CATEGORIES; j++)
+        picolAppendString(o,buf,snprintf(buf,sizeof(buf)," %s %zu",
+            picolMemCategoryNames[j],st.category[j]));
+    picolSetResultObj(i,o);
+    return PICOL_OK;
+}
+
+/* source fileName evaluates the script in the file. [return] stops it, and
+ * its value is the result. */
+int picolCommandSource(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolSource s;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if (picolLoadSource(&s,argv[1]) != PICOL_OK) {
+        picolSetResultf(i,"Couldn't read file \"%s\": %s",argv[1],strerror(errno));
+        return PICOL_ERR;
+    }
+    int retcode = picolEvalSource(i,s.text,s.len);
+    picolFreeSource(&s);
+    return retcode == PICOL_RETURN ? PICOL_OK : retcode;
+}
+
+/* proc ?-memoize? name arglist body. The arguments are split once here. */
 int picolCommandProc(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int memoize = argc == 5 && strcmp(argv[1],"-memoize") == 0;
+    argv += memoize;
+    argc -= memoize;
     if (argc != 4) return picolArityErr(i,argv[0]);
 
-    picolRegisterCommand(i,argv[1],picolCommandCallProc);
+    char *alist = xstrdup(argv[2]), *p = alist, **args = NULL;
+    int numargs = 0;
+    while(*p) {
+        char *start = p;
+        while(*p != ' ' && *p != '\0') p++;
+        if (p == start) {
+            p++; continue;
+        }
+        if (*p) *p++ = '\0';
+        args = xrealloc(args,sizeof(char*)*(numargs+1));
+        args[numargs++] = start;
+    }
+
+    picolRegisterObjCommand(i,argv[1],picolCommandCallProc);
     struct picolCmd *c = picolGetCommand(i,argv[1]);
     c->arglist = xstrdup(argv[2]);
     c->body = xstrdup(argv[3]);
+    picolMemTag(c->arglist,PICOL_MEM_COMMANDS);
+    picolMemTag(c->body,PICOL_MEM_COMMANDS);
+    c->code = picolCompileProc(i,c->body,numargs,args);
+    if (memoize) c->memo = picolNewMemo(PICOL_MEMO_SIZE);
+    xfree(args);
+    xfree(alist);
+    return PICOL_OK;
+}
+
+/* memoize ?-stats? procName ?maxResults? caches up to maxResults results of
+ * a procedure without side effects, 1000 by default, keyed by the arguments.
+ * The least recently used result is evicted when the cache is full, and 0
+ * turns memoization off. With -stats, returns the counters of the cache.
+ * Redefining the procedure drops the cache. */
+int picolCommandMemoize(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    int stats = argc > 1 && strcmp(argv[1],"-stats") == 0, maxlen = PICOL_MEMO_SIZE;
+    if (stats ? argc != 3 : argc < 2 || argc > 3) return picolArityErr(i,argv[0]);
+    struct picolCmd *c = picolGetCommand(i,argv[1+stats]);
+    if (c == NULL || c->objfunc != picolCommandCallProc) {
+        picolSetResultf(i,"\"%s\" is not a procedure",argv[1+stats]);
+        return PICOL_ERR;
+    }
+    struct picolMemo *m = c->memo;
+    if (stats) {
+        picolSetResultf(i,"hits %lld misses %lld evictions %lld size %d",
+            m ? m->hits : 0, m ? m->misses : 0, m ? m->evictions : 0,
+            m ? m->cache->len : 0);
+        return PICOL_OK;
+    }
+    if (argc == 3) {
+        char *end;
+        long n = strtol(argv[2],&end,10);
+        if (*end || end == argv[2] || n < 0 || n > 1000000000) {
+            picolSetResultf(i,"Bad cache size '%s'",argv[2]);
+            return PICOL_ERR;
+        }
+        maxlen = n;
+    }
+    picolFreeMemo(c->memo);
+    c->memo = maxlen ? picolNewMemo(maxlen) : NULL;
+    picolSetResult(i,"");
     return PICOL_OK;
 }
 
-int picolCommandReturn(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
-    if (argc != 1 && argc != 2) return picolArityErr(i,argv[0]);
-    picolSetResult(i, (argc == 2) ? argv[1] : "");
+int picolCommandReturn(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    if (objc != 1 && objc != 2) return picolArityErr(i,picolGetString(objv[0]));
+    picolSetResultObj(i, (objc == 2) ? objv[1] : i->emptyobj);
     return PICOL_RETURN;
 }
 
+void picolRegisterCoreCommands(struct picolInterp *i);
+
+/* Body of the threads of [thread::create]: run the script in a new
+ * interpreter, and keep the result for [thread::wait]. */
+void *picolThreadMain(void *arg) {
+    struct picolThread *t = arg;
+    struct picolInterp *i = picolInitInterp();
+    picolRegisterCoreCommands(i);
+    i->thread = t;
+    t->retcode = picolEval(i,t->script);
+    t->result = xstrdup(picolGetResult(i));
+    picolFreeInterp(i);
+    picolReleaseThread(t);
+    picolFreeSmallCache();
+    return NULL;
+}
+
+/* Return the thread of the interpreter, creating it if needed. */
+struct picolThread *picolGetThread(struct picolInterp *i) {
+    if (i->thread == NULL) i->thread = picolNewThread(NULL);
+    return i->thread;
+}
+
+/* Parse the thread id "tidN" into *id. */
+int picolGetThreadId(struct picolInterp *i, char *name, int *id) {
+    char *end;
+    long n = strncmp(name,"tid",3) == 0 ? strtol(name+3,&end,10) : -1;
+    if (n < 0 || n > INT_MAX || end == name+3 || *end) {
+        picolSetResultf(i,"Bad thread id \"%s\"",name);
+        return PICOL_ERR;
+    }
+    *id = n;
+    return PICOL_OK;
+}
+
+/* thread::create script runs the script in a new thread, with its own
+ * interpreter. Returns the id of the thread. */
+int picolCommandThreadCreate(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    struct picolThread *t = picolNewThread(argv[1]);
+    t->started = 1;
+    atomic_fetch_add(&t->refcount,1); // Released by the thread when done.
+    if (pthread_create(&t->tid,NULL,picolThreadMain,t) != 0) {
+        picolReleaseThread(t);
+        picolRemoveThread(t);
+        picolSetResult(i,"Can't create thread");
+        return PICOL_ERR;
+    }
+    picolSetResultf(i,"tid%d",t->id);
+    return PICOL_OK;
+}
+
+/* thread::id returns the id of the current thread, to send messages to. */
+int picolCommandThreadId(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    if (argc != 1) return picolArityErr(i,argv[0]);
+    picolSetResultf(i,"tid%d",picolGetThread(i)->id);
+    return PICOL_OK;
+}
+
+/* thread::send id message queues a copy of message in the mailbox of the
+ * thread, without waiting. */
+int picolCommandThreadSend(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    struct picolThread *t;
+    int id;
+    if (objc != 3) return picolArityErr(i,picolGetString(objv[0]));
+    if (picolGetThreadId(i,picolGetString(objv[1]),&id) != PICOL_OK) return PICOL_ERR;
+    if ((t = picolFindThread(id)) == NULL) {
+        picolSetResultf(i,"No such thread \"%s\"",objv[1]->str);
+        return PICOL_ERR;
+    }
+    char *msg = picolGetString(objv[2]);
+    picolThreadSend(t,msg,objv[2]->len);
+    picolReleaseThread(t);
+    picolSetResultObj(i,i->emptyobj);
+    return PICOL_OK;
+}
+
+/* thread::recv returns the oldest message sent to the current thread,
+ * waiting for one if there is none. */
+int picolCommandThreadRecv(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    if (argc != 1) return picolArityErr(i,argv[0]);
+    struct picolMsg *m = picolMailboxGet(&picolGetThread(i)->mbox);
+    picolSetResultObj(i,picolNewStringObj(m->data,m->len));
+    xfree(m);
+    return PICOL_OK;
+}
+
+/* thread::wait id waits for the thread script to finish, and returns its
+ * result, or its error. The id is no longer valid after that. */
+int picolCommandThreadWait(struct picolInterp *i, int argc, char **argv, struct picolCmd *cmd) {
+    struct picolThread *t = NULL;
+    int id;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    if (picolGetThreadId(i,argv[1],&id) != PICOL_OK) return PICOL_ERR;
+    /* Take the thread out of the table, so nobody else can wait for it. */
+    pthread_mutex_lock(&picolThreads.lock);
+    if (id < picolThreads.len) t = picolThreads.threads[id];
+    if (t && t->started && t != i->thread) picolThreads.threads[id] = NULL;
+    else t = NULL;
+    pthread_mutex_unlock(&picolThreads.lock);
+    if (t == NULL) {
+        picolSetResultf(i,"No thread \"%s\" to wait for",argv[1]);
+        return PICOL_ERR;
+    }
+    pthread_join(t->tid,NULL);
+    int retcode = t->retcode == PICOL_RETURN ? PICOL_OK : t->retcode;
+    picolSetResult(i,t->result);
+    picolReleaseThread(t);
+    return retcode;
+}
+
+/* Define in 'i' the procedures of 'src', replacing older definitions. */
+void picolCopyProcs(struct picolInterp *i, struct picolInterp *src) {
+    for (int j = 0; j < src->cmdslots; j++) {
+        struct picolCmd *c = src->commands[j];
+        if (c == NULL || c->objfunc != picolCommandCallProc) continue;
+        char *argv[4] = {"proc", c->name, c->arglist, c->body};
+        picolCommandProc(i,4,argv,NULL);
+        if (c->memo) picolGetCommand(i,c->name)->memo = picolNewMemo(c->memo->maxlen);
+    }
+    i->maxlevel = src->maxlevel;
+}
+
+/* Run the procedure of the job on the elements from 'lo' to 'hi'. */
+void picolPmapRun(struct picolPmapWorker *w, int lo, int hi) {
+    struct picolPmap *p = w->pool;
+    struct picolInterp *i = w->interp;
+    struct picolObj *objv[2];
+    objv[0] = picolNewStringObj(p->procname,-1);
+    picolIncrRefCount(objv[0]);
+    for (int j = lo; j < hi && !atomic_load(&p->failed); j++) {
+        struct picolCmd *c = picolGetCommand(i,p->procname);
+        objv[1] = picolNewStringObj(p->elem[j]->str,p->elem[j]->len);
+        picolIncrRefCount(objv[1]);
+        int retcode = picolCallCommand(i,c,2,objv);
+        picolDecrRefCount(objv[1]);
+        char *s = picolGetString(i->result);
+        struct picolMsg *m = xmalloc(sizeof(*m)+i->result->len+1);
+        m->len = i->result->len;
+        memcpy(m->data,s,m->len+1);
+        if (retcode == PICOL_OK || retcode == PICOL_RETURN) {
+            p->results[j] = m;
+            continue;
+        }
+        /* Keep the error of the first element, and stop the others. */
+        pthread_mutex_lock(&p->lock);
+        if (p->errmsg == NULL || j < p->errindex) {
+            xfree(p->errmsg);
+            p->errmsg = m;
+            p->errindex = j;
+        } else {
+            xfree(m);
+        }
+        pthread_mutex_unlock(&p->lock);
+        atomic_store(&p->failed,1);
+    }
+    picolDecrRefCount(objv[0]);
+}
+
+/* Body of the worker threads of [pmap]: wait for a job, copy the procedures
+ * of the caller if needed, then process elements until there are none left
+ * in its range or in the others. */
+void *picolPmapMain(void *arg) {
+    struct picolPmapWorker *w = arg;
+    struct picolPmap *p = w->pool;
+    w->interp = picolInitInterp();
+    picolRegisterCoreCommands(w->interp);
+    while(1) {
+        pthread_mutex_lock(&p->lock);
+        while(!p->quit && p->job == w->job) pthread_cond_wait(&p->work,&p->lock);
+        if (p->quit) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        w->job = p->job;
+        pthread_mutex_unlock(&p->lock);
+
+        if (w->id < p->active) {
+            int lo, hi;
+            if (w->cmdepoch != p->caller->cmdepoch) {
+                picolCopyProcs(w->interp,p->caller);
+                w->cmdepoch = p->caller->cmdepoch;
+            }
+            do {
+                while(picolPmapTake(w,p->grain,&lo,&hi)) picolPmapRun(w,lo,hi);
+            } while(!atomic_load(&p->failed) && picolPmapSteal(w));
+            picolFlushChannel(&w->interp->out);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (++p->finished == p->numworkers) pthread_cond_signal(&p->done);
+        pthread_mutex_unlock(&p->lock);
+    }
+    picolFreeInterp(w->interp);
+    picolFreeSmallCache();
+    return NULL;
+}
+
+/* Stop the workers of the pool and free it. */
+void picolFreePmap(struct picolPmap *p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int j = 0; j < p->numworkers; j++) {
+        pthread_join(p->workers[j]->tid,NULL);
+        xfree(p->workers[j]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    xfree(p);
+}
+
+/* Return the pool of the interpreter with at least 'n' workers, creating it
+ * or adding workers if needed. Returns NULL if no thread can be created. */
+struct picolPmap *picolGetPmap(struct picolInterp *i, int n) {
+    struct picolPmap *p = i->pmap;
+    if (p == NULL) {
+        p = i->pmap = xmalloc(sizeof(*p));
+        memset(p,0,sizeof(*p));
+        pthread_mutex_init(&p->lock,NULL);
+        pthread_cond_init(&p->work,NULL);
+        pthread_cond_init(&p->done,NULL);
+    }
+    while(p->numworkers < n) {
+        struct picolPmapWorker *w = xmalloc(sizeof(*w));
+        memset(w,0,sizeof(*w));
+        w->pool = p;
+        w->id = p->numworkers;
+        w->cmdepoch = -1;
+        w->job = p->job; // Wait for the next job, not the ones done.
+        if (pthread_create(&w->tid,NULL,picolPmapMain,w) != 0) {
+            xfree(w);
+            return NULL;
+        }
+        p->workers[p->numworkers++] = w;
+    }
+    return p;
+}
+
+/* pmap procName list ?-threads N? calls the procedure with every element
+ * of the list as argument, in N worker threads, by default one for every
+ * CPU, and returns the list of the results in order. Workers have their
+ * own interpreters, with a copy of the procedures of this one, but not of
+ * its variables, so the procedure must only depend on its argument. The
+ * first error of an element, in list order, is the error of [pmap]. */
+int picolCommandPmap(struct picolInterp *i, int objc, struct picolObj **objv, struct picolCmd *cmd) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (objc != 3 && objc != 5) return picolArityErr(i,picolGetString(objv[0]));
+    if (objc == 5) {
+        char *end, *opt = picolGetString(objv[3]), *val = picolGetString(objv[4]);
+        n = strtol(val,&end,10);
+        if (strcmp(opt,"-threads") != 0) {
+            picolSetResultf(i,"Bad option \"%s\": must be -threads",opt);
+            return PICOL_ERR;
+        }
+        if (*end || end == val || n < 1 || n > PICOL_PMAP_MAX_THREADS) {
+            picolSetResultf(i,"Bad number of threads '%s'",val);
+            return PICOL_ERR;
+        }
+    }
+    if (n < 1) n = 1;
+    if (n > PICOL_PMAP_MAX_THREADS) n = PICOL_PMAP_MAX_THREADS;
+    char *procname = picolGetString(objv[1]);
+    if (picolGetCommand(i,procname) == NULL) {
+        picolSetResultf(i,"No such command '%s'",procname);
+        return PICOL_ERR;
+    }
+
+    /* Workers only read the strings of the elements, so they are computed
+     * here, and the list is referenced until the job is done. */
+    struct picolObj *list = objv[2];
+    picolIncrRefCount(list);
+    struct picolList *l = picolGetList(list);
+    if (l->len == 0) {
+        picolDecrRefCount(list);
+        picolSetResultObj(i,i->emptyobj);
+        return PICOL_OK;
+    }
+    for (int j = 0; j < l->len; j++) picolGetString(l->elem[j]);
+    if (n > l->len) n = l->len;
+    struct picolPmap *p = picolGetPmap(i,n);
+    if (p == NULL) {
+        picolDecrRefCount(list);
+        picolSetResult(i,"Can't create thread");
+        return PICOL_ERR;
+    }
+
+    p->caller = i;
+    p->procname = procname;
+    p->elem = l->elem;
+    p->len = l->len;
+    p->results = xmalloc(sizeof(struct picolMsg*)*l->len);
+    memset(p->results,0,sizeof(struct picolMsg*)*l->len);
+    p->grain = l->len/(n*PICOL_PMAP_GRAINS);
+    if (p->grain < 1) p->grain = 1;
+    atomic_store(&p->failed,0);
+    p->errmsg = NULL;
+    for (int j = 0; j < p->numworkers; j++)
+        atomic_store(&p->workers[j]->range, j < n ?
+            picolRange(l->len*(long long)j/n,l->len*(long long)(j+1)/n) : 0);
+
+    pthread_mutex_lock(&p->lock);
+    p->active = n;
+    p->finished = 0;
+    p->job++;
+    pthread_cond_broadcast(&p->work);
+    while(p->finished < p->numworkers) pthread_cond_wait(&p->done,&p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    int retcode = PICOL_OK;
+    if (p->errmsg) {
+        picolSetResultObj(i,picolNewStringObj(p->errmsg->data,p->errmsg->len));
+        xfree(p->errmsg);
+        retcode = PICOL_ERR;
+        for (int j = 0; j < l->len; j++) xfree(p->results[j]);
+    } else {
+        struct picolObj *o = picolNewListObj(0,NULL);
+        for (int j = 0; j < l->len; j++) {
+            picolListPush(o->list,picolNewStringObj(p->results[j]->data,p->results[j]->len));
+            xfree(p->results[j]);
+        }
+        picolSetResultObj(i,o);
+    }
+    xfree(p->results);
+    picolDecrRefCount(list);
+    return retcode;
+}
+
 void picolRegisterCoreCommands(struct picolInterp *i) {
-    picolRegisterCommand(i,"expr",picolCommandExpr);
-    picolRegisterCommand(i,"set",picolCommandSet);
+    picolRegisterObjCommand(i,"expr",picolCommandExpr);
+    picolRegisterObjCommand(i,"set",picolCommandSet);
+    picolRegisterObjCommand(i,"append",picolCommandAppend);
+    picolRegisterObjCommand(i,"list",picolCommandList);
+    picolRegisterObjCommand(i,"llength",picolCommandLlength);
+    picolRegisterObjCommand(i,"lindex",picolCommandLindex);
+    picolRegisterObjCommand(i,"lrange",picolCommandLrange);
+    picolRegisterObjCommand(i,"lappend",picolCommandLappend);
+    picolRegisterObjCommand(i,"lset",picolCommandLset);
+    picolRegisterObjCommand(i,"lsort",picolCommandLsort);
+    picolRegisterObjCommand(i,"foreach",picolCommandForeach);
+    picolRegisterObjCommand(i,"dict",picolCommandDict);
     picolRegisterCommand(i,"puts",picolCommandPuts);
+    picolRegisterCommand(i,"flush",picolCommandFlush);
+    picolRegisterCommand(i,"fconfigure",picolCommandFconfigure);
+    picolRegisterCommand(i,"open",picolCommandOpen);
+    picolRegisterCommand(i,"close",picolCommandClose);
+    picolRegisterCommand(i,"gets",picolCommandGets);
+    picolRegisterCommand(i,"read",picolCommandRead);
+    picolRegisterCommand(i,"seek",picolCommandSeek);
+    picolRegisterCommand(i,"tell",picolCommandTell);
+    picolRegisterCommand(i,"eof",picolCommandEof);
+    picolRegisterCommand(i,"fblocked",picolCommandFblocked);
+    picolRegisterCommand(i,"socket",picolCommandSocket);
+    picolRegisterCommand(i,"fileevent",picolCommandFileevent);
+    picolRegisterCommand(i,"after",picolCommandAfter);
+    picolRegisterCommand(i,"vwait",picolCommandVwait);
+    picolRegisterCommand(i,"update",picolCommandUpdate);
     picolRegisterCommand(i,"if",picolCommandIf);
     picolRegisterCommand(i,"while",picolCommandWhile);
     picolRegisterCommand(i,"break",picolCommandRetCodes);
     picolRegisterCommand(i,"continue",picolCommandRetCodes);
     picolRegisterCommand(i,"proc",picolCommandProc);
-    picolRegisterCommand(i,"return",picolCommandReturn);
+    picolRegisterCommand(i,"memoize",picolCommandMemoize);
+    picolRegisterObjCommand(i,"return",picolCommandReturn);
+    picolRegisterObjCommand(i,"tailcall",picolCommandTailcall);
+    picolRegisterCommand(i,"interp",picolCommandInterp);
+    picolRegisterCommand(i,"source",picolCommandSource);
+    picolRegisterCommand(i,"time",picolCommandTime);
+    picolRegisterCommand(i,"profile",picolCommandProfile);
+    picolRegisterCommand(i,"memstats",picolCommandMemstats);
+    picolRegisterCommand(i,"thread::create",picolCommandThreadCreate);
+    picolRegisterCommand(i,"thread::id",picolCommandThreadId);
+    picolRegisterObjCommand(i,"thread::send",picolCommandThreadSend);
+    picolRegisterCommand(i,"thread::recv",picolCommandThreadRecv);
+    picolRegisterCommand(i,"thread::wait",picolCommandThreadWait);
+    picolRegisterObjCommand(i,"pmap",picolCommandPmap);
 }
 
 /* =============================================================================
@@ -787,21 +6400,41 @@ int main(int argc, char **argv) {
             char clibuf[1024];
             int retcode;
             printf("picol> "); fflush(stdout);
-            if (fgets(clibuf,1024,stdin) == NULL) return 0;
+            if (fgets(clibuf,1024,stdin) == NULL) break;
             retcode = picolEval(interp,clibuf);
-            if (interp->result[0] != '\0')
-                printf("[%d] %s\n", retcode, interp->result);
+            picolFlushChannel(&interp->out);
+            if (picolGetResult(interp)[0] != '\0')
+                printf("[%d] %s\n", retcode, picolGetResult(interp));
         }
-    } else if (argc == 2) {
-        char buf[1024*16];
-        FILE *fp = fopen(argv[1],"r");
-        if (!fp) {
+    } else if (argc == 2 || (argc == 3 && strcmp(argv[1],"-profile") == 0)) {
+        /* With -profile, the report goes to stderr, and the folded stacks
+         * to picol.folded, for the flame graph tools. */
+        struct picolSource s;
+        char *file = argv[argc-1];
+        if (picolLoadSource(&s,file) != PICOL_OK) {
             perror("open"); exit(1);
         }
-        size_t bytesRead = fread(buf,1,1024*16-1,fp);
-        buf[bytesRead] = '\0';
-        fclose(fp);
-        if (picolEval(interp,buf) != PICOL_OK) printf("%s\n", interp->result);
+        if (argc == 3) picolProfileStart(interp);
+        if (picolEvalSource(interp,s.text,s.len) != PICOL_OK) {
+            picolFlushChannel(&interp->out);
+            printf("%s\n", picolGetResult(interp));
+        }
+        picolFreeSource(&s);
+        if (argc == 3) {
+            picolProfileStop(interp);
+            picolFlushChannel(&interp->out);
+            struct picolObj *o = picolProfileReport(interp,0);
+            picolIncrRefCount(o);
+            fputs(picolGetString(o),stderr);
+            picolDecrRefCount(o);
+            FILE *fp = fopen("picol.folded","w");
+            o = picolProfileReport(interp,1);
+            picolIncrRefCount(o);
+            if (fp == NULL || fwrite(o->str,1,o->len,fp) != (size_t)o->len)
+                perror("picol.folded");
+            if (fp) fclose(fp);
+            picolDecrRefCount(o);
+        }
     }
     picolFreeInterp(interp);
     return 0;
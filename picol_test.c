@@ -1,5 +1,7 @@
 #define PICOL_NO_MAIN
 #include "picol.c"
+#include <signal.h>
+#include <sys/socket.h>
 
 int passed = 0, failed = 0;
 
@@ -11,14 +13,62 @@ void test(int num, const char *name, int ok) {
 /* Helper: eval and check result string. */
 int eval_ok(struct picolInterp *i, char *code, const char *expected) {
     int rc = picolEval(i, code);
-    return rc == PICOL_OK && strcmp(i->result, expected) == 0;
+    return rc == PICOL_OK && strcmp(picolGetResult(i), expected) == 0;
 }
 
 /* Helper: eval code, then check a variable's value. */
 int var_ok(struct picolInterp *i, char *code, const char *varname, const char *expected) {
     if (picolEval(i, code) != PICOL_OK) return 0;
     struct picolVar *v = picolGetVar(i, (char*)varname);
-    return v && strcmp(v->val, expected) == 0;
+    return v && strcmp(picolGetString(v->val), expected) == 0;
+}
+
+/* Output handler collecting the output of puts in 'captured'. */
+char captured[1024];
+void capture(void *privdata, const char *buf, int len) {
+    (void)privdata;
+    strncat(captured, buf, len);
+}
+
+/* Interrupt the interpreter from another thread, directly or by sending a
+ * signal to the thread running it, whose handler calls picolInterrupt(). */
+struct picolInterp *interrupted;
+pthread_t interruptedthread;
+int interruptwithsignal;
+
+void interrupt_handler(int sig) {
+    (void)sig;
+    picolInterrupt(interrupted);
+}
+
+void *interrupter(void *arg) {
+    (void)arg;
+    usleep(20000);
+    if (interruptwithsignal) pthread_kill(interruptedthread, SIGUSR1);
+    else picolInterrupt(interrupted);
+    return NULL;
+}
+
+int interrupt_ok(struct picolInterp *i, int withsignal) {
+    pthread_t tid;
+    interrupted = i;
+    interruptedthread = pthread_self();
+    interruptwithsignal = withsignal;
+    pthread_create(&tid, NULL, interrupter, NULL);
+    int rc = picolEval(i, "while {1} {}");
+    pthread_join(tid, NULL);
+    return rc == PICOL_LIMIT && strcmp(picolGetResult(i), "Interrupted") == 0 &&
+           eval_ok(i, "llength {a b}", "2");
+}
+
+/* Read from a socket until the end of file, counting the bytes. */
+void *drain(void *arg) {
+    int fd = *(int*)arg;
+    char buf[4096];
+    ssize_t n;
+    long total = 0;
+    while((n = read(fd, buf, sizeof(buf))) > 0) total += n;
+    return (void*)total;
 }
 
 int main(void) {
@@ -83,7 +133,7 @@ int main(void) {
         (picolEval(interp, "set z outer") == PICOL_OK &&
          picolEval(interp, "proc lf {} { set z inner }") == PICOL_OK &&
          picolEval(interp, "lf") == PICOL_OK &&
-         strcmp(picolGetVar(interp, "z")->val, "outer") == 0));
+         strcmp(picolGetString(picolGetVar(interp, "z")->val), "outer") == 0));
     test(++t, "proc wrong arity",
         picolEval(interp, "proc g {a b} { expr $a+$b }; g 1") == PICOL_ERR);
     test(++t, "proc redefine",
@@ -95,14 +145,14 @@ int main(void) {
     /* Global variables (uppercase). */
     test(++t, "global var set from proc",
         (picolEval(interp, "proc setg {} { set G 99 }; setg") == PICOL_OK &&
-         strcmp(picolGetVar(interp, "G")->val, "99") == 0));
+         strcmp(picolGetString(picolGetVar(interp, "G")->val), "99") == 0));
     test(++t, "global var read from proc",
         eval_ok(interp, "set H world; proc readg {} { set r $H }; readg", "world"));
     test(++t, "global var modified by proc",
         (picolEval(interp, "set Counter 0") == PICOL_OK &&
          picolEval(interp, "proc inc {} { set Counter [expr $Counter+1] }") == PICOL_OK &&
          picolEval(interp, "inc; inc; inc") == PICOL_OK &&
-         strcmp(picolGetVar(interp, "Counter")->val, "3") == 0));
+         strcmp(picolGetString(picolGetVar(interp, "Counter")->val), "3") == 0));
 
     /* String interpolation. */
     test(++t, "interpolation in double quotes",
@@ -246,6 +296,447 @@ int main(void) {
     test(++t, "set read nonexistent var",
         picolEval(interp, "set nosuchvar") == PICOL_ERR);
 
+    /* Inlined control flow in compiled code. */
+    test(++t, "break from command substitution in loop",
+        var_ok(interp, "set i 0; while {$i < 10} { set i [expr $i+1]; set x [if {$i == 5} {break}] }", "i", "5"));
+    test(++t, "nested loops break inner only",
+        eval_ok(interp, "proc nl {} { set n 0; while {1} { set n [expr $n+1]; set m 0; while {1} { set m [expr $m+1]; if {$m > 3} break }; if {$n > 2} { return \"$n $m\" } } }; nl", "3 4"));
+    test(++t, "redefining an inlined command",
+        (picolEval(interp, "proc sel {x} { if {$x} { return a } else { return b } }") == PICOL_OK &&
+         eval_ok(interp, "sel 0", "b") &&
+         eval_ok(interp, "proc if {c b e f} { return myif }; sel 0", "myif")));
+    /* Restore if for later tests. */
+    picolRegisterCommand(interp, "if", picolCommandIf);
+    test(++t, "restored inlined command",
+        eval_ok(interp, "sel 0", "b"));
+    test(++t, "inlined command redefined by the running script",
+        eval_ok(interp, "set n 0; while {$n < 3} { if {$n == 1} { proc if {c b} { return myif } }; "
+                        "set r [if {1} {set x orig}]; set n [expr {$n+1}] }; list $n $r", "3 myif") &&
+        eval_ok(interp, "proc while {c b} { return mywhile }; while {0} {}", "mywhile"));
+    picolRegisterCommand(interp, "if", picolCommandIf);
+    picolRegisterCommand(interp, "while", picolCommandWhile);
+    test(++t, "break code of a redefined inlined command",
+        eval_ok(interp, "set n 0; while {1} { set n [expr {$n+1}]; if {$n == 3} { proc if {c b} { break } }; "
+                        "if {1} {set y 1} }; set n", "3"));
+    picolRegisterCommand(interp, "if", picolCommandIf);
+    test(++t, "set redefined by the running script",
+        eval_ok(interp, "proc set {a b} { return \"myset $a $b\" }; set x 1", "myset x 1"));
+    picolRegisterObjCommand(interp, "set", picolCommandSet);
+    test(++t, "expr redefined by the running script",
+        eval_ok(interp, "proc expr {a} { return myexpr }; list [expr {1+1}]", "myexpr"));
+    picolRegisterObjCommand(interp, "expr", picolCommandExpr);
+
+    /* Commands table growth. */
+    test(++t, "many procs defined and called",
+        eval_ok(interp, "set n 0; while {$n < 300} { proc many$n {} \"return $n\"; set n [expr $n+1] }; many7; many299", "299"));
+
+    /* Local variable slots and variables created by name. */
+    test(++t, "set local by computed name",
+        eval_ok(interp, "proc dyn {} { set x 1; set n x; set $n 5; return $x }; dyn", "5"));
+    test(++t, "local created by non compiled script",
+        eval_ok(interp, "proc dyn2 {} { set b {set y 7}; if 1 $b; return $y }; dyn2", "7"));
+    test(++t, "unset local is an error",
+        picolEval(interp, "proc dyn3 {} { if {0} { set w 1 }; return $w }; dyn3") == PICOL_ERR);
+    test(++t, "repeated argument name last wins",
+        eval_ok(interp, "proc dup {a a} { return $a }; dup 1 2", "2"));
+
+    /* Numbers flow between commands without being formatted. */
+    test(++t, "expr result keeps full precision",
+        eval_ok(interp, "set a [expr 1.0/3]; expr $a * 3", "1"));
+    test(++t, "number formatted when used as string",
+        eval_ok(interp, "set a [expr 1.0/3]; set r \"<$a>\"", "<0.333333333333>"));
+    test(++t, "proc argument shared with caller",
+        eval_ok(interp, "proc chg {v} { set v [expr $v+1]; return $v }; set o 5; chg $o; set o", "5"));
+
+    /* Compiled expressions. */
+    test(++t, "condition with commands and parens",
+        eval_ok(interp, "if {([expr 2+3] - 1) * 2 == 8} {set r yes} else {set r no}", "yes"));
+    test(++t, "condition variable is not parsed as expression",
+        picolEval(interp, "proc ce {} { set e {1+1}; while {$e == 2} { return no }; return yes }; ce") == PICOL_ERR);
+    test(++t, "condition not known at compile time",
+        eval_ok(interp, "set c {$x > 1}; set x 3; if $c {set r a} else {set r b}", "a"));
+    test(++t, "condition syntax error",
+        picolEval(interp, "if {1 +} {set r a}") == PICOL_ERR);
+
+    /* Braced expressions, short circuits and the ternary operator. */
+    test(++t, "braced expr substitution",
+        eval_ok(interp, "set a 5; expr {$a + [expr 2*3]}", "11"));
+    test(++t, "and or short circuit",
+        eval_ok(interp, "proc never {} { error }; expr {0 && [never] || 1 || [never]}", "1"));
+    test(++t, "ternary operator",
+        eval_ok(interp, "set a 5; expr {$a > 9 ? 1 : $a > 3 ? 2 : [never]}", "2"));
+    test(++t, "unbraced ternary",
+        eval_ok(interp, "expr 0 ? 1 : 2", "2"));
+
+    /* Integers. */
+    test(++t, "integer division and modulo",
+        eval_ok(interp, "expr {-7 / 2 + -7 % 2 * 10 + 7.0 / 2}", "9.5"));
+    test(++t, "large integers keep precision",
+        eval_ok(interp, "expr {1099511627776 * 1000 + 1}", "1099511627776001"));
+    test(++t, "integer overflow becomes double",
+        eval_ok(interp, "expr {9223372036854775807 + 1}", "9.22337203685e+18"));
+    test(++t, "bitwise operators",
+        eval_ok(interp, "expr {(6 & 3 | 8 ^ 1) + (1 << 4) + (-16 >> 2) + ~0}", "22"));
+    test(++t, "division by zero",
+        picolEval(interp, "expr 1 / 0") == PICOL_ERR);
+
+    /* Arena and small blocks allocation. */
+    test(++t, "command with many arguments compiling scripts",
+        eval_ok(interp, "set c 0; if $c {set r 1} elseif $c {set r 2} elseif $c {set r 3} "
+                        "elseif $c {set r 4} elseif $c {set r 5} elseif $c {set r 6} "
+                        "else {set r [if $c {} else {set x \"[set c]k\"}]}", "0k"));
+    test(++t, "expr with many arguments to join",
+        eval_ok(interp, "set a 2; expr {$a} + {$a} * 3 + {$a} - 1 + {$a} * {$a} + 1 + {$a}", "16"));
+    test(++t, "escapes merged into a long word",
+        eval_ok(interp, "set s \"a\\tb\\tc\\td\\te\\tf\\tg\\th\\ti\\tj\\tk\\tl\\tm\\tn\"",
+                "a\tb\tc\td\te\tf\tg\th\ti\tj\tk\tl\tm\tn"));
+
+    /* Call frames reuse. */
+    test(++t, "reused frames start with unset locals",
+        picolEval(interp, "proc sl {a} { if {$a} { set v 1 }; set v }; sl 1") == PICOL_OK &&
+        picolEval(interp, "sl 0") == PICOL_ERR);
+    test(++t, "reused frames with more slots",
+        eval_ok(interp, "proc one {a} { set a }; proc five {a b} { set c 3; set d 4; set e 5; "
+                        "expr {$a+$b+$c+$d+$e+[one 6]} }; one 1; five 1 2; five 1 2", "21"));
+
+    /* Procedure calls without C recursion. */
+    test(++t, "deep recursion",
+        eval_ok(interp, "proc dr {n} { if {$n == 0} { return 0 }; expr {1 + [dr [expr {$n-1}]]} }; dr 20000", "20000"));
+    test(++t, "deep recursion through foreach",
+        eval_ok(interp, "proc fr {n} { if {$n == 0} { return 0 }; foreach x {1} { set y [fr [expr {$n-1}]] }; "
+                        "return $y }; fr 1000", "0"));
+    test(++t, "deep recursion through dict for",
+        eval_ok(interp, "proc dfr {n} { if {$n == 0} { return 0 }; dict for {k v} {a 1} { set y [dfr [expr {$n-1}]] }; "
+                        "return $y }; dfr 1000", "0"));
+    test(++t, "tailcall does not grow the depth",
+        eval_ok(interp, "interp recursionlimit {} 100; proc tl {n} { if {$n == 0} { return done }; "
+                        "tailcall tl [expr {$n-1}] }; tl 1000", "done"));
+    test(++t, "return of a call is a tail call",
+        eval_ok(interp, "proc ev {n} { if {$n == 0} { return even }; return [od [expr {$n-1}]] }; "
+                        "proc od {n} { if {$n == 0} { return odd }; return [ev [expr {$n-1}]] }; od 1001", "even"));
+    test(++t, "recursion limit",
+        picolEval(interp, "dr 200") == PICOL_ERR &&
+        eval_ok(interp, "interp recursionlimit {} 300; dr 200", "200"));
+
+    /* Append. */
+    test(++t, "append creates the variable",
+        eval_ok(interp, "append ap1 a b; append ap1 c", "abc"));
+    test(++t, "append does not change shared values",
+        eval_ok(interp, "set ap2 abc; set ap3 $ap2; append ap2 def; set r \"$ap2 $ap3\"", "abcdef abc"));
+    test(++t, "append to a number",
+        eval_ok(interp, "set ap4 [expr {6*7}]; append ap4 0; expr {$ap4 + 1}", "421"));
+    test(++t, "append to shared numbers and lists",
+        eval_ok(interp, "set n [expr {3*4}]; set m $n; append n x; list $n $m", "12x 12") &&
+        eval_ok(interp, "set L [list a b]; set K $L; append L \" c\"; set L", "a b c"));
+
+    /* Lists. */
+    test(++t, "list quoting round trip",
+        eval_ok(interp, "set e \"x{\"; set l [list a {b c} {} $e \\{ \\\\]; "
+                        "set r \"[llength $l] [lindex $l 1] [lindex $l 3] [lindex $l end] $l\"",
+                "6 b c x{ \\ a {b c} {} x\\{ \\{ \\\\"));
+    test(++t, "lindex and lrange with end",
+        eval_ok(interp, "set l {a {b {c d}} e f}; set r \"[lindex $l 1 1 0] [lindex $l end-1] "
+                        "[lrange $l 1 end-2] <[lindex $l 9]> <[lrange $l 3 1]>\"", "c e {b {c d}} <> <>"));
+    test(++t, "lappend and lset do not change shared values",
+        eval_ok(interp, "set l1 {1 {2 3}}; set l2 $l1; lappend l1 4; lset l1 1 0 x; lset l1 end y; "
+                        "set r \"$l1 | $l2\"", "1 {x 3} y | 1 {2 3}"));
+    test(++t, "lset appends only at the end",
+        eval_ok(interp, "set l3 {a b c}; lset l3 3 d", "a b c d") &&
+        picolEval(interp, "set l3 {a b c}; lset l3 5 X") == PICOL_ERR &&
+        eval_ok(interp, "set l3", "a b c"));
+    test(++t, "lsort and foreach",
+        eval_ok(interp, "set r {}; foreach {a b} [lsort -integer -decreasing {3 10 2 7 1}] c {x y} "
+                        "{ append r $a$b$c, }; set r", "107x,32y,1,"));
+
+    /* Dicts. */
+    test(++t, "dict create get and size",
+        eval_ok(interp, "set d [dict create a 1 b {x y}]; dict set d a 2; "
+                        "set r \"[dict get $d a] [dict size $d] [dict keys $d] $d\"", "2 2 a b a 2 b {x y}"));
+    test(++t, "dict from a list and missing keys",
+        eval_ok(interp, "set r \"[dict get {k 1 k 2} k] [dict exists {a {b c}} a b] [dict exists {a 1} b]\"", "2 1 0") &&
+        picolEval(interp, "dict get {a 1} b") == PICOL_ERR &&
+        picolEval(interp, "dict get {a 1 b} a") == PICOL_ERR);
+    test(++t, "nested dict set does not change shared values",
+        eval_ok(interp, "set d1 {a {b 1}}; set d2 $d1; dict set d1 a c 2; dict set d1 x y 3; dict unset d1 a b; "
+                        "set r \"$d1 | $d2\"", "a {c 2} x {y 3} | a {b 1}"));
+    test(++t, "dict for and many keys",
+        eval_ok(interp, "set d {}; set j 0; while {$j < 5000} { dict set d k$j $j; set j [expr {$j+1}] }; "
+                        "set j 0; while {$j < 5000} { if {$j % 10} { dict unset d k$j }; set j [expr {$j+1}] }; "
+                        "set s 0; dict for {k v} $d { if {$v > 100} break; set s [expr {$s+$v}] }; "
+                        "set r \"[dict size $d] $s [dict get $d k4990]\"", "500 550 4990"));
+
+    /* Memoization. */
+    test(++t, "memoized fib is linear",
+        eval_ok(interp, "proc -memoize mfib {x} { if {$x <= 1} { return $x }; "
+                        "expr {[mfib [expr {$x-1}]] + [mfib [expr {$x-2}]]} }; "
+                        "set r \"[mfib 90] [memoize -stats mfib]\"",
+                "2880067194370816120 hits 88 misses 91 evictions 0 size 91"));
+    test(++t, "memoize evicts the least recently used result",
+        eval_ok(interp, "proc ms {a b} { set Calls [expr {$Calls+1}]; return $a$b }; set Calls 0; memoize ms 2; "
+                        "ms 1 2; ms 1 2; ms 3 4; ms 1 2; ms 5 6; ms 3 4; ms 1 2; "
+                        "set r \"$Calls [memoize -stats ms]\"", "5 hits 2 misses 5 evictions 3 size 2"));
+    test(++t, "memoize skips errors and drops results on redefinition",
+        picolEval(interp, "proc -memoize me {n} { if {$n} { error }; return old }; me 0; me 1") == PICOL_ERR &&
+        eval_ok(interp, "memoize -stats me", "hits 0 misses 2 evictions 0 size 1") &&
+        eval_ok(interp, "proc me {n} { return new }; memoize me; set r \"[me 0] [memoize -stats me]\"",
+                "new hits 0 misses 1 evictions 0 size 1"));
+
+    /* Output. */
+    picolSetOutputHandler(interp, capture, NULL);
+    captured[0] = '\0';
+    test(++t, "full buffering keeps output until flush",
+        picolEval(interp, "fconfigure stdout -buffering full; puts a; puts -nonewline stdout b") == PICOL_OK &&
+        captured[0] == '\0' &&
+        picolEval(interp, "flush stdout") == PICOL_OK && strcmp(captured, "a\nb") == 0);
+    captured[0] = '\0';
+    test(++t, "line and no buffering",
+        picolEval(interp, "fconfigure stdout -buffering line; puts -nonewline a") == PICOL_OK &&
+        captured[0] == '\0' && picolEval(interp, "puts b") == PICOL_OK && strcmp(captured, "ab\n") == 0 &&
+        picolEval(interp, "fconfigure stdout -buffering none; puts -nonewline c") == PICOL_OK &&
+        strcmp(captured, "ab\nc") == 0);
+    captured[0] = '\0';
+    test(++t, "small buffer size flushes when full",
+        eval_ok(interp, "fconfigure stdout -buffering full -buffersize 4; puts -nonewline abc; "
+                        "puts -nonewline def; fconfigure stdout", "-blocking 1 -buffering full -buffersize 4") &&
+        strcmp(captured, "abc") == 0 &&
+        picolEval(interp, "fconfigure stdout -buffering fast") == PICOL_ERR &&
+        picolEval(interp, "puts nosuchchan x") == PICOL_ERR);
+    picolSetOutputHandler(interp, NULL, NULL);
+
+    /* Script files. */
+    test(++t, "evaluation stops at the given length",
+        picolEvalSource(interp, "set sa 1; set sb 2", 8) == PICOL_OK &&
+        strcmp(picolGetResult(interp), "1") == 0 && picolGetVar(interp, "sb") == NULL);
+    test(++t, "unterminated words at the end of the text",
+        picolEvalSource(interp, "set sv $sa", 8) == PICOL_OK &&
+        strcmp(picolGetResult(interp), "$") == 0 &&
+        picolEvalSource(interp, "set sv [set sa]", 14) == PICOL_OK &&
+        strcmp(picolGetResult(interp), "1") == 0);
+    FILE *fp = fopen("/tmp/picol_test_source.tcl", "w");
+    fprintf(fp, "proc sq {x} {expr {$x*$x}}\nset total 0\n");
+    for (int j = 0; j < 3000; j++) fprintf(fp, "set total [expr {$total+[sq %d]}]\n", j%10);
+    fprintf(fp, "while {1} {\n  break\n}\n# Comment at the end\nreturn $total\nset total 0\n");
+    fclose(fp);
+    test(++t, "source of a file longer than a compiled batch",
+        eval_ok(interp, "source /tmp/picol_test_source.tcl", "85500") &&
+        eval_ok(interp, "set total", "85500"));
+    unlink("/tmp/picol_test_source.tcl");
+    test(++t, "source of a missing file",
+        picolEval(interp, "source /tmp/picol_test_source.tcl") == PICOL_ERR &&
+        strstr(picolGetResult(interp), "No such file") != NULL);
+
+    /* File I/O. */
+    test(++t, "write a file and read it back",
+        eval_ok(interp, "set f [open /tmp/picol_test_io.txt w]; puts $f one; puts -nonewline $f two\\nthree; "
+                        "close $f; set f [open /tmp/picol_test_io.txt]; read $f", "one\ntwo\nthree"));
+    test(++t, "gets with and without a variable",
+        eval_ok(interp, "seek $f 0; set n [gets $f line]; list $n $line [gets $f] [eof $f] "
+                        "[gets $f line] $line [eof $f] [gets $f line] $line [eof $f]",
+                "3 one two 0 5 three 1 -1 {} 1"));
+    test(++t, "read a number of bytes, seek and tell",
+        eval_ok(interp, "seek $f 2; set a [read $f 3]; set b [tell $f]; seek $f -2 end; "
+                        "list $a $b [read $f 100] [tell $f] [eof $f]", "{e\nt} 5 ee 13 1") &&
+        eval_ok(interp, "seek $f 4; gets $f; seek $f -1 current; read -nonewline $f", "\nthree"));
+    test(++t, "close and bad channels",
+        eval_ok(interp, "close $f; set g [open /tmp/picol_test_io.txt a+]; list $f $g", "file0 file0") &&
+        picolEval(interp, "close stdout") == PICOL_ERR &&
+        picolEval(interp, "gets file9") == PICOL_ERR &&
+        picolEval(interp, "open /tmp/picol_test_io.txt rw") == PICOL_ERR &&
+        picolEval(interp, "open /nonexistent/file") == PICOL_ERR);
+    test(++t, "append mode writes at the end",
+        eval_ok(interp, "gets $g; puts $g four; seek $g 0; set all [read $g]; close $g; set all",
+                "one\ntwo\nthreefour\n"));
+    test(++t, "channels are used for their access mode only",
+        picolEval(interp, "set f [open /tmp/picol_test_io.txt]; puts $f hello") == PICOL_ERR &&
+        !strcmp(picolGetResult(interp), "Channel \"file0\" wasn't opened for writing") &&
+        eval_ok(interp, "close $f", "") &&
+        picolEval(interp, "set f [open /tmp/picol_test_io.txt a]; gets $f") == PICOL_ERR &&
+        !strcmp(picolGetResult(interp), "Channel \"file0\" wasn't opened for reading") &&
+        eval_ok(interp, "close $f", "") &&
+        picolEval(interp, "gets stdout") == PICOL_ERR &&
+        picolEval(interp, "puts stdin x") == PICOL_ERR);
+    FILE *big = fopen("/tmp/picol_test_io.txt", "w");
+    for (int j = 0; j < 200000; j++) fprintf(big, "line %d\n", j);
+    fclose(big);
+    test(++t, "read of a mapped file",
+        eval_ok(interp, "set f [open /tmp/picol_test_io.txt]; gets $f; seek $f 12; set data [read $f]; "
+                        "close $f; list [lindex $data 0] [lindex $data end]", "1 199999") &&
+        eval_ok(interp, "append data x; lindex $data end", "x") &&
+        eval_ok(interp, "set f [open /tmp/picol_test_io.txt]; set data [read -nonewline $f]; "
+                        "close $f; lindex $data end", "199999"));
+    test(++t, "gets reuses the variable string",
+        eval_ok(interp, "set f [open /tmp/picol_test_io.txt]; set n 0; "
+                        "while {[gets $f l] >= 0} {set n [expr {$n+1}]}; close $f; list $n $l", "200000 {}"));
+    unlink("/tmp/picol_test_io.txt");
+
+    /* Threads. */
+    test(++t, "thread script result",
+        eval_ok(interp, "set t [thread::create {expr {6*7}}]; thread::wait $t", "42") &&
+        picolEval(interp, "thread::wait $t") == PICOL_ERR);
+    test(++t, "messages between threads",
+        eval_ok(interp, "set t [thread::create {set parent [thread::recv]; set n [thread::recv]; "
+                        "thread::send $parent [expr {$n*2}]; return done}]; "
+                        "thread::send $t [thread::id]; thread::send $t 21; "
+                        "list [thread::recv] [thread::wait $t]", "42 done"));
+    test(++t, "thread errors",
+        picolEval(interp, "thread::wait [thread::create {nosuchcmd}]") == PICOL_ERR &&
+        strcmp(picolGetResult(interp), "No such command 'nosuchcmd'") == 0 &&
+        picolEval(interp, "thread::send tid999 x") == PICOL_ERR &&
+        picolEval(interp, "thread::send foo x") == PICOL_ERR &&
+        picolEval(interp, "thread::wait [thread::id]") == PICOL_ERR);
+    test(++t, "many producers, one consumer",
+        eval_ok(interp, "set me [thread::id]; set n 0; set workers {}; "
+                        "while {$n < 4} {lappend workers [thread::create {set to [thread::recv]; set j 0; "
+                        "  while {$j < 2000} {thread::send $to $j; set j [expr {$j+1}]}}]; "
+                        "  thread::send [lindex $workers end] $me; set n [expr {$n+1}]}; "
+                        "set sum 0; set n 0; "
+                        "while {$n < 8000} {set sum [expr {$sum+[thread::recv]}]; set n [expr {$n+1}]}; "
+                        "foreach w $workers {thread::wait $w}; set sum", "7996000"));
+    test(++t, "time runs the script count times",
+        picolEval(interp, "set tn 0; time {set tn [expr {$tn+1}]} 25") == PICOL_OK &&
+        strstr(picolGetResult(interp), " microseconds per iteration") != NULL &&
+        eval_ok(interp, "set tn", "25") &&
+        eval_ok(interp, "time {set tn 0} 0; set tn", "25") &&
+        picolEval(interp, "time {nosuchcmd} 3") == PICOL_ERR &&
+        picolEval(interp, "time {set tn 0} x") == PICOL_ERR);
+    test(++t, "profile counts calls",
+        picolEval(interp, "proc pf {n} {if {$n <= 1} {return 1}; expr {[pf [expr {$n-1}]]+1}}; "
+                          "proc pg {} {pf 5; pf 3}; "
+                          "profile start; pg; pg; profile stop; pg") == PICOL_OK &&
+        picolEval(interp, "profile report") == PICOL_OK &&
+        strstr(picolGetResult(interp), "\npf                               16 ") != NULL &&
+        strstr(picolGetResult(interp), "\npg                                2 ") != NULL &&
+        picolEval(interp, "profile report -folded") == PICOL_OK &&
+        strstr(picolGetResult(interp), "pg;pf") != NULL &&
+        picolEval(interp, "profile foo") == PICOL_ERR);
+#ifdef PICOL_MEM_STATS
+    {
+        struct picolMemStats before, during, after;
+        picolEval(interp, "set ml {}");
+        picolMemStats(interp, &before);
+        test(++t, "memstats counts live bytes by category",
+            picolEval(interp, "set n 0; while {$n < 1000} {lappend ml \"item $n\"; set n [expr {$n+1}]}") == PICOL_OK &&
+            picolMemStats(interp, &during) == PICOL_OK &&
+            during.live > before.live+1000*16 &&
+            during.category[PICOL_MEM_VALUES] > before.category[PICOL_MEM_VALUES]+1000*16 &&
+            during.peak >= during.live &&
+            picolEval(interp, "set ml {}") == PICOL_OK &&
+            picolMemStats(interp, &after) == PICOL_OK &&
+            after.category[PICOL_MEM_VALUES] < during.category[PICOL_MEM_VALUES] &&
+            picolEval(interp, "dict get [memstats] peak") == PICOL_OK &&
+            atoll(picolGetResult(interp)) >= (long long)during.peak);
+    }
+#else
+    test(++t, "memstats needs PICOL_MEM_STATS",
+        picolEval(interp, "memstats") == PICOL_ERR);
+#endif
+    test(++t, "pmap results in order",
+        eval_ok(interp, "proc psq {x} {expr {$x*$x}}; set l {}; set n 0; "
+                        "while {$n < 5000} {lappend l $n; set n [expr {$n+1}]}; "
+                        "set r [pmap psq $l -threads 4]; "
+                        "list [llength $r] [lindex $r 0] [lindex $r 77] [lindex $r 4999]",
+                        "5000 0 5929 24990001") &&
+        eval_ok(interp, "pmap llength {{a b} {} {c d e}} -threads 8", "2 0 3") &&
+        eval_ok(interp, "pmap psq {}", ""));
+    test(++t, "pmap copies redefined procs",
+        eval_ok(interp, "proc psq {x} {expr {$x+1}}; pmap psq {1 2 3}", "2 3 4"));
+    test(++t, "pmap errors",
+        picolEval(interp, "proc pbad {x} {if {$x == 30} {nosuchcmd}; return $x}; "
+                          "pmap pbad [lrange $l 0 99] -threads 4") == PICOL_ERR &&
+        strcmp(picolGetResult(interp), "No such command 'nosuchcmd'") == 0 &&
+        picolEval(interp, "pmap nosuchproc {1 2}") == PICOL_ERR &&
+        picolEval(interp, "pmap psq {1 2} -threads 0") == PICOL_ERR &&
+        picolEval(interp, "pmap psq {1 2} -foo 2") == PICOL_ERR);
+
+    /* Execution limits. */
+    picolSetBudget(interp, 5);
+    test(++t, "command budget",
+        eval_ok(interp, "llength a; llength a; llength a; llength a; llength a", "1") &&
+        picolGetBudget(interp) == 0 &&
+        picolEval(interp, "llength a") == PICOL_LIMIT &&
+        strcmp(picolGetResult(interp), "Command limit exceeded") == 0 &&
+        (picolSetBudget(interp, 100000), picolEval(interp, "while {1} {}")) == PICOL_LIMIT &&
+        (picolSetBudget(interp, 100000), picolEval(interp, "set c 1; while $c {}")) == PICOL_LIMIT &&
+        (picolSetBudget(interp, 0), eval_ok(interp, "interp limit {} commands", "")) &&
+        eval_ok(interp, "interp limit {} commands 10; llength a; interp limit {} commands", "8") &&
+        picolEval(interp, "interp limit {} commands 0; interp limit {} foo 1") == PICOL_ERR);
+    {
+        double start = picolProfileNow();
+        picolSetTimeLimit(interp, 50);
+        test(++t, "time limit",
+            picolEval(interp, "proc spin {} {while {1} {spin2}}; proc spin2 {} {}; spin") == PICOL_LIMIT &&
+            strcmp(picolGetResult(interp), "Time limit exceeded") == 0 &&
+            picolProfileNow()-start < 1e9 &&
+            picolEval(interp, "llength a") == PICOL_LIMIT &&
+            (picolSetTimeLimit(interp, 0), eval_ok(interp, "llength a", "1")) &&
+            eval_ok(interp, "interp limit {} time 60000; expr {[interp limit {} time] > 59000}", "1") &&
+            eval_ok(interp, "interp limit {} time 0; interp limit {} time", ""));
+    }
+    signal(SIGUSR1, interrupt_handler);
+    test(++t, "picolInterrupt from a thread and a signal handler",
+        interrupt_ok(interp, 0) && interrupt_ok(interp, 1));
+
+    /* Event loop. */
+    test(++t, "after, vwait and update",
+        eval_ok(interp, "set Order {}; after 30 {set Done 1}; after idle {lappend Order idle}; "
+                        "set id [after 10 {lappend Order cancelled}]; after 5 {lappend Order t5}; "
+                        "after 0 {lappend Order t0}; after cancel $id; vwait Done; set Order",
+                        "t0 idle t5") &&
+        eval_ok(interp, "proc vw {} {after 1 {set done 2}; vwait done; return ok}; list [vw] $done", "ok 2") &&
+        eval_ok(interp, "after idle {set Done 3}; update; set Done", "3") &&
+        eval_ok(interp, "set V [expr {5}]; after 1 {set W \"<$V>\"; set V 1}; vwait V; set W", "<5>") &&
+        picolEval(interp, "vwait Nothing") == PICOL_ERR &&
+        strcmp(picolGetResult(interp), "Can't wait for variable \"Nothing\": would wait forever") == 0 &&
+        eval_ok(interp, "proc bgerror {msg} {lappend Bg $msg}; set Bg {}; after 1 {nosuchcmd}; "
+                        "after 2 {break}; after -5 {lappend Bg neg}; after 10 {set Done 4}; vwait Done; set Bg",
+                "neg {No such command 'nosuchcmd'} {invoked \"break\" outside of a loop}") &&
+        picolEval(interp, "set t [after 10000 {}]; interp limit {} time 50; vwait Nothing") == PICOL_LIMIT &&
+        (picolSetTimeLimit(interp, 0), eval_ok(interp, "after cancel $t; after 1", "")) &&
+        picolEval(interp, "after foo") == PICOL_ERR);
+    {
+        int fds[2];
+        pthread_t tid;
+        void *total;
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        picolSetVar(interp, "S", picolAddChannel(interp, fds[0], "sock")->name);
+        test(++t, "fileevent and non blocking channels",
+            write(fds[1], "one\ntwo\nthr", 11) == 11 &&
+            eval_ok(interp, "set Lines {}; fconfigure $S -blocking 0; "
+                            "fileevent $S readable {if {[gets $S l] >= 0} {lappend Lines $l} "
+                            "elseif {[fblocked $S]} {set Done blocked}}; "
+                            "vwait Done; list $Lines $Done [fileevent $S readable]",
+                            "{one two} blocked {if {[gets $S l] >= 0} {lappend Lines $l} "
+                            "elseif {[fblocked $S]} {set Done blocked}}") &&
+            write(fds[1], "ee\n", 3) == 3 &&
+            eval_ok(interp, "vwait Lines; fileevent $S readable {}; set Lines", "one two three") &&
+            write(fds[1], "x\n", 2) == 2 &&
+            eval_ok(interp, "set Bg {}; fileevent $S readable {nosuchcmd}; after 20 {set Done e}; "
+                            "vwait Done; list [llength $Bg] [lindex $Bg 0] [fileevent $S readable]",
+                    "1 {No such command 'nosuchcmd'} {}") &&
+            eval_ok(interp, "set big x; set n 0; while {$n < 20} {append big $big; set n [expr {$n+1}]}; "
+                            "puts -nonewline $S $big; fileevent $S writable {set Done w}; vwait Done; "
+                            "fileevent $S writable {}; set Done", "w") &&
+            pthread_create(&tid, NULL, drain, &fds[1]) == 0 &&
+            eval_ok(interp, "close $S", "") &&
+            shutdown(fds[1], SHUT_WR) == 0 &&
+            pthread_join(tid, &total) == 0 && (long)total == 1048576 &&
+            picolEval(interp, "fileevent stdin readable {}") == PICOL_ERR);
+        close(fds[1]);
+    }
+    test(++t, "echo server on loopback",
+        eval_ok(interp, "proc accept {s addr port} {fconfigure $s -blocking 0 -buffering line; "
+                        "  fileevent $s readable [list echo $s]}; "
+                        "proc echo {s} {if {[gets $s l] < 0} {if {[eof $s]} {close $s}; return}; puts $s $l}; "
+                        "set srv [socket -server accept -myaddr 127.0.0.1 0]; "
+                        "set port [lindex [fconfigure $srv -sockname] 2]; "
+                        "set C1 [socket 127.0.0.1 $port]; set C2 [socket 127.0.0.1 $port]; "
+                        "fconfigure $C1 -buffering line; fconfigure $C2 -buffering line; "
+                        "puts $C1 a; puts $C2 b; puts $C1 c; set Got {}; "
+                        "fileevent $C1 readable {lappend Got [gets $C1]; if {[llength $Got] == 3} {set Done 1}}; "
+                        "fileevent $C2 readable {lappend Got [gets $C2]; if {[llength $Got] == 3} {set Done 1}}; "
+                        "vwait Done; close $C1; close $C2; update; close $srv; lsort $Got", "a b c") &&
+        picolEval(interp, "socket 127.0.0.1 $port") == PICOL_ERR);
+
     picolFreeInterp(interp);
 
     printf("\n%d tests passed, %d failed.\n", passed, failed);
@@ -0,0 +1,54 @@
+proc mandel {cr ci maxiter} {
+    set zr 0
+    set zi 0
+    set n 0
+    while {$n < $maxiter} {
+        set zr2 [expr $zr * $zr]
+        set zi2 [expr $zi * $zi]
+        if {[expr $zr2 + $zi2] > 4} { return $n }
+        set zi [expr 2 * $zr * $zi + $ci]
+        set zr [expr $zr2 - $zi2 + $cr]
+        set n [expr $n + 1]
+    }
+    return $maxiter
+}
+
+proc char {n} {
+    if {$n == 30} {
+        return "#"
+    } elseif {$n > 15} {
+        return "@"
+    } elseif {$n > 10} {
+        return "%"
+    } elseif {$n > 5} {
+        return "+"
+    } elseif {$n > 3} {
+        return "-"
+    } elseif {$n > 1} {
+        return "."
+    } else {
+        return " "
+    }
+}
+
+# Every row is computed by [row] in one of the [pmap] worker threads, that
+# have a copy of the procedures above. Rows are returned in order.
+proc row {y} {
+    set line ""
+    set x -2.0
+    while {$x < 1.0} {
+        append line [char [mandel $x $y 30]]
+        set x [expr $x + 0.0385]
+    }
+    return $line
+}
+
+set rows {}
+set y -1.2
+while {$y < 1.2} {
+    lappend rows $y
+    set y [expr $y + 0.06]
+}
+foreach line [pmap row $rows] {
+    puts $line
+}